@@ -0,0 +1,323 @@
+/* Copyright (C) 2012 Akiri Solutions, Inc.
+ * For conditions of distribution and use, see copyright notice in logr.h
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <syslog.h>
+
+#include <logr.h>
+
+/*
+ * logr-bench - measure the cost of a logging call.
+ *
+ * Every case makes the same call (a short message with an int and a
+ * string) from one or more threads, timing each call.  One line per case
+ * is printed on stdout:
+ *
+ *   case=file-basic threads=1 calls=100000 ns_per_call=412.3 \
+ *       calls_per_sec=2402318 p50=390 p99=811 p99.9=4519
+ *
+ * ns_per_call is the mean time a caller spends in the call, the
+ * percentiles are in nanoseconds and calls_per_sec is the total throughput
+ * of all threads.  Reading each call's time costs some nanoseconds too;
+ * the "clock" case shows how much.
+ *
+ * Files are written to a temporary directory which is removed at exit.
+ * While the "stderr" cases run, stderr is pointed at /dev/null so that
+ * terminal speed doesn't count.  The "syslog" case sends its messages to
+ * the host's syslog daemon, so it only runs when named on the command
+ * line.
+ */
+
+#define MSG "request %d from %s completed\n"
+#define ARG "10.0.0.1"
+
+enum target {
+    TARGET_CLOCK,           /* nothing, just the timing overhead */
+    TARGET_LOGR,
+    TARGET_FPRINTF,
+    TARGET_SYSLOG
+};
+
+struct bench {
+    const char *name;
+    enum target target;
+    int level;              /* of the calls made through logr */
+    const char *prefix;
+    int file;               /* log to a file rather than stderr */
+    int rotate;             /* rotate the file every 1MB */
+    int threaded;           /* run with 1..max threads */
+    int named;              /* only run when named on the command line */
+};
+
+static const struct bench benches[] = {
+    { "clock", TARGET_CLOCK, 0, NULL, 0, 0, 0, 0 },
+    { "filtered", TARGET_LOGR, LOGR_DEBUG, LOGR_PREFIX_FORMAT_BASIC,
+      1, 0, 0, 0 },
+    { "fprintf-stderr", TARGET_FPRINTF, 0, NULL, 0, 0, 0, 0 },
+    { "fprintf-file", TARGET_FPRINTF, 0, NULL, 1, 0, 1, 0 },
+    { "syslog", TARGET_SYSLOG, 0, NULL, 0, 0, 0, 1 },
+    { "stderr-basic", TARGET_LOGR, LOGR_ERR, LOGR_PREFIX_FORMAT_BASIC,
+      0, 0, 0, 0 },
+    { "file-none", TARGET_LOGR, LOGR_ERR, "", 1, 0, 0, 0 },
+    { "file-basic", TARGET_LOGR, LOGR_ERR, LOGR_PREFIX_FORMAT_BASIC,
+      1, 0, 1, 0 },
+    { "file-verbose", TARGET_LOGR, LOGR_ERR, LOGR_PREFIX_FORMAT_VERBOSE,
+      1, 0, 0, 0 },
+    { "file-basic-rotate", TARGET_LOGR, LOGR_ERR, LOGR_PREFIX_FORMAT_BASIC,
+      1, 1, 1, 0 },
+};
+
+struct worker {
+    pthread_t thread;
+    const struct bench *b;
+    logr_t *logr;
+    FILE *f;
+    int calls;
+    uint32_t *lat;          /* ns per call */
+    uint64_t total;
+};
+
+static char dir[] = "/tmp/logr-bench.XXXXXX";
+static int devnull;
+static char path[sizeof(dir) + 16];
+
+static inline uint64_t
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *
+run(void *arg)
+{
+    struct worker *w = (struct worker *)arg;
+    uint64_t t0, t1;
+    int i;
+
+    for (i = 0; i < w->calls; i++) {
+        t0 = now();
+        switch (w->b->target) {
+        case TARGET_CLOCK:
+            break;
+        case TARGET_LOGR:
+            logr_printf(w->logr, w->b->level, MSG, i, ARG);
+            break;
+        case TARGET_FPRINTF:
+            fprintf(w->f, MSG, i, ARG);
+            break;
+        case TARGET_SYSLOG:
+            syslog(LOG_DEBUG, MSG, i, ARG);
+            break;
+        }
+        t1 = now();
+        w->lat[i] = (t1 - t0 > UINT32_MAX) ? UINT32_MAX : t1 - t0;
+        w->total += t1 - t0;
+    }
+    return NULL;
+}
+
+static int
+cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void
+cleanup(void)
+{
+    glob_t g;
+    char pattern[sizeof(path) + 2];
+    size_t i;
+
+    sprintf(pattern, "%s/*", dir);
+    if (glob(pattern, 0, NULL, &g) == 0) {
+        for (i = 0; i < g.gl_pathc; i++) {
+            unlink(g.gl_pathv[i]);
+        }
+        globfree(&g);
+    }
+    rmdir(dir);
+}
+
+static int
+bench(const struct bench *b, int threads, int calls)
+{
+    struct worker w[threads];
+    uint32_t *lat;
+    uint64_t total = 0, t0, wall;
+    size_t n = (size_t)threads * calls;
+    logr_t *logr = NULL;
+    FILE *f = NULL;
+    int i, saved = -1;
+
+    lat = (uint32_t *)malloc(n * sizeof(uint32_t));
+    if (lat == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    unlink(path);
+    if (b->target == TARGET_LOGR) {
+        logr = logr_alloc(b->file ? path : NULL);
+        if (logr == NULL) {
+            perror(path);
+            free(lat);
+            return -1;
+        }
+        logr_set_level(logr, LOGR_ERR);
+        logr_set_prefix_format(logr, b->prefix);
+        if (b->rotate) {
+            logr_set_threshold(logr, 1024 * 1024);
+            logr_set_rotate_file_count(logr, 2);
+        }
+    } else if (b->target == TARGET_SYSLOG) {
+        openlog("logr-bench", LOG_NDELAY, LOG_USER);
+    } else if (b->target == TARGET_FPRINTF) {
+        f = b->file ? fopen(path, "a") : stderr;
+        if (f == NULL) {
+            perror(path);
+            free(lat);
+            return -1;
+        }
+    }
+
+    if (!b->file) {
+        fflush(stderr);
+        saved = dup(STDERR_FILENO);
+        dup2(devnull, STDERR_FILENO);
+    }
+
+    t0 = now();
+    for (i = 0; i < threads; i++) {
+        w[i].b = b;
+        w[i].logr = logr;
+        w[i].f = f;
+        w[i].calls = calls;
+        w[i].lat = lat + (size_t)i * calls;
+        w[i].total = 0;
+        if (pthread_create(&w[i].thread, NULL, run, &w[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (i = 0; i < threads; i++) {
+        pthread_join(w[i].thread, NULL);
+        total += w[i].total;
+    }
+    wall = now() - t0;
+
+    if (logr != NULL) {
+        logr_free(logr);
+    }
+    if ((f != NULL) && (f != stderr)) {
+        fclose(f);
+    }
+    if (b->target == TARGET_SYSLOG) {
+        closelog();
+    }
+    if (saved >= 0) {
+        fflush(stderr);
+        dup2(saved, STDERR_FILENO);
+        close(saved);
+    }
+
+    qsort(lat, n, sizeof(uint32_t), cmp);
+    printf("case=%s threads=%d calls=%zu ns_per_call=%.1f calls_per_sec=%.0f "
+           "p50=%u p99=%u p99.9=%u\n", b->name, threads, n,
+           (double)total / n, n * 1e9 / wall, lat[n / 2],
+           lat[(size_t)(n * 0.99)], lat[(size_t)(n * 0.999)]);
+    fflush(stdout);
+    free(lat);
+    return 0;
+}
+
+static void
+usage(const char *prog)
+{
+    size_t i;
+
+    fprintf(stderr,
+            "usage: %s [-n calls] [-t threads] [case ...]\n"
+            "  -n  calls per thread, default 100000\n"
+            "  -t  run the threaded cases with 1 up to this many threads,\n"
+            "      default 4\n"
+            "Cases (* only when named):", prog);
+    for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        fprintf(stderr, " %s%s", benches[i].name,
+                benches[i].named ? "*" : "");
+    }
+    fprintf(stderr, "\n");
+    exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+    int calls = 100000, max_threads = 4;
+    int c, t, j;
+    size_t i;
+
+    while ((c = getopt(argc, argv, "n:t:h")) != -1) {
+        switch (c) {
+        case 'n':
+            calls = atoi(optarg);
+            break;
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if ((calls <= 0) || (max_threads <= 0)) {
+        usage(argv[0]);
+    }
+
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    sprintf(path, "%s/bench.log", dir);
+    /* registered first so it runs after logr's own exit handlers */
+    atexit(cleanup);
+
+    devnull = open("/dev/null", O_WRONLY);
+    if (devnull < 0) {
+        perror("/dev/null");
+        return 1;
+    }
+    for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        if (optind < argc) {
+            for (j = optind; j < argc; j++) {
+                if (strcmp(argv[j], benches[i].name) == 0) {
+                    break;
+                }
+            }
+            if (j == argc) {
+                continue;
+            }
+        } else if (benches[i].named) {
+            continue;
+        }
+        for (t = 1; t <= (benches[i].threaded ? max_threads : 1); t++) {
+            if (bench(&benches[i], t, calls) < 0) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
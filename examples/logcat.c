@@ -52,7 +52,7 @@ main(int argc, char **argv)
     logr_set_ops(logr, &ops);
 
     logr_set_prefix_format(logr, "%{timestamp}s %{level}s/logcat( %{pid}d): ");
-    logr_set_timestamp_format(logr, "%m-%d %H:%M:%S.xxx");
+    logr_set_timestamp_format(logr, "%m-%d %H:%M:%S.%{msec}");
 
     /* This message will NOT be printed since LOGR_INFO < LOGR_WARNING */
     logr_printf(logr, LOGCAT_INFO,
@@ -33,6 +33,11 @@ main(int argc, char **argv)
         return -1;
     }
 
+    if ((logr_set_compress(logr, 6) != 0) && (errno != ENOTSUP)) {
+        perror("logr_set_compress");
+        return -1;
+    }
+
     retval = logr_open(logr, LOGFILE);
     if (retval != 0) {
 	perror("logr_open");
@@ -43,7 +48,7 @@ main(int argc, char **argv)
 	logr_err(MSG);
     }
 
-    printf("See '%1$s', '%1$s.0' and '%1$s.1.bz2'.\n", LOGFILE);
-    printf("Subsequent runs will generate additional .bz2 files.\n");
+    printf("See '%1$s', '%1$s.1.gz' and '%1$s.2.gz'.\n", LOGFILE);
+    printf("Subsequent runs will generate additional .gz files.\n");
     return 0;
 }
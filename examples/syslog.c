@@ -0,0 +1,47 @@
+/* Copyright (C) 2012 Akiri Solutions, Inc.
+ * For conditions of distribution and use, see copyright notice in logr.h
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <logr.h>
+
+#ifdef __WIN32
+#  define LOG_USER (1 << 3)
+#else
+#  include <syslog.h>
+#endif
+
+#ifndef ENOTSUP
+#  define ENOTSUP 48 /* missing from mingw */
+#endif
+
+/* This example demonstrates sending errors to the local syslog daemon, or
+   with -j to the systemd journal, while everything goes to stderr. */
+
+int
+main(int argc, char **argv)
+{
+    logr_t *logr = logr_getlogger();
+    unsigned int flags = 0;
+
+    if ((argc > 1) && (strcmp(argv[1], "-j") == 0)) {
+        flags = LOGR_SYSLOG_JOURNAL;
+    }
+
+    logr_set_level(logr, LOGR_DEBUG);
+    if (logr_add_syslog(logr, NULL, "logr-example", LOG_USER, LOGR_ERR,
+                        flags) != 0) {
+        if (errno == ENOTSUP) {
+            fprintf(stderr, "syslog sinks are not supported on this platform.\n");
+        } else {
+            perror("logr_add_syslog");
+        }
+        return -1;
+    }
+
+    logr_debug("only on stderr\n");
+    logr_err("on stderr and in the system log\n");
+    logr_flush(logr);
+    return 0;
+}
@@ -0,0 +1,93 @@
+/* Copyright (C) 2012 Akiri Solutions, Inc.
+ * For conditions of distribution and use, see copyright notice in logr.h
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "logr.h"
+
+/*
+ * logr-decode - turn binary logs back into text.
+ *
+ * Entries are written through a logger so they look exactly as they would
+ * have in text mode.
+ */
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-p prefix] [-t timestamp] [-l level] [-o output] "
+            "[file ...]\n"
+            "  -p  prefix format, default is the one in the file\n"
+            "  -t  timestamp format, default is the one in the file\n"
+            "  -l  highest level to output (0-7), default is all\n"
+            "  -o  append to this file instead of stdout\n", prog);
+    exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+    logr_t *logr = logr_getlogger();
+    const char *output = "/dev/stdout";
+    unsigned int flags = 0;
+    int c, fd, i, retval = 0;
+
+    logr_set_level(logr, LOGR_DEBUG);
+    while ((c = getopt(argc, argv, "p:t:l:o:h")) != -1) {
+        switch (c) {
+        case 'p':
+            if (logr_set_prefix_format(logr, optarg) != 0) {
+                perror("logr-decode: prefix format");
+                return 2;
+            }
+            flags |= LOGR_DECODE_KEEP_PREFIX;
+            break;
+        case 't':
+            if (logr_set_timestamp_format(logr, optarg) != 0) {
+                perror("logr-decode: timestamp format");
+                return 2;
+            }
+            flags |= LOGR_DECODE_KEEP_TIMESTAMP;
+            break;
+        case 'l':
+            logr_set_level(logr, atoi(optarg));
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (logr_open(logr, output) != 0) {
+        fprintf(stderr, "logr-decode: %s: %s\n", output, strerror(errno));
+        return 1;
+    }
+
+    if (optind == argc) {
+        if (logr_decode(logr, STDIN_FILENO, flags) != 0) {
+            fprintf(stderr, "logr-decode: <stdin>: %s\n", strerror(errno));
+            retval = 1;
+        }
+    }
+    for (i = optind; i < argc; i++) {
+        fd = open(argv[i], O_RDONLY);
+        if ((fd < 0) || (logr_decode(logr, fd, flags) != 0)) {
+            fprintf(stderr, "logr-decode: %s: %s\n", argv[i], strerror(errno));
+            retval = 1;
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    logr_open(logr, NULL);
+    return retval;
+}
@@ -18,10 +18,14 @@
    Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
    02111-1307 USA.  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* sendmmsg() */
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
 #include <signal.h>
 #include <errno.h>
@@ -29,7 +33,11 @@
 #include <unistd.h>
 
 #include <ctype.h>
+#include <limits.h>
+#include <fcntl.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
@@ -43,6 +51,43 @@
 #endif
 #else
 #include <pthread.h>
+#include <sched.h>
+#endif
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifndef __WIN32
+#include <fnmatch.h>
+#include <glob.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#ifdef HAVE_SYSLOG_H
+#include <syslog.h>
+#endif
+#ifndef _PATH_LOG
+#define _PATH_LOG "/dev/log"
+#endif
+#ifndef LOG_USER
+#define LOG_USER (1 << 3)
+#endif
+#define LOGR_JOURNAL_PATH "/run/systemd/journal/socket"
+
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(__linux__) && defined(HAVE_LINUX_IO_URING_H)
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#if defined(IORING_FEAT_SQPOLL_NONFIXED) && defined(__NR_io_uring_setup)
+#define LOGR_IO_URING
+#endif
 #endif
 
 #ifdef HAVE_STDBOOL_H
@@ -54,6 +99,7 @@ typedef int bool;
 #endif
 
 #define MAX_ROTATE_EXT_LEN strlen(".99")
+#define LOGR_GZ_EXT ".gz"
 #define MAX_ROTATE_FILES 99
 
 typedef struct _code {
@@ -78,33 +124,334 @@ CODE prioritynames[] = {
 
 #define _XARGS file, line, func, pretty_func
 
-#define STREQ(name, field, size) \
-    ((sizeof(name)-1 == size) && (strncasecmp(name, field, size) == 0))
+/*
+ * Compiled timestamp format plus a cache of its rendering for one second.
+ * The strftime() output only changes once per second so it is rebuilt at
+ * most that often and published under a sequence lock: readers copy the
+ * string without any lock and retry (or render privately) if a rebuild
+ * raced with them.  Sub-second directives split the format into segments;
+ * their digits are patched into the copied string at the recorded offsets.
+ */
+#define LOGR_MAX_TS_SEGMENTS 8
+
+struct logr_tsfmt {
+    unsigned int seq;         /* odd while the cache is being rebuilt */
+    time_t sec;               /* second the cache holds, -1 if none */
+    size_t len;
+    size_t off[LOGR_MAX_TS_SEGMENTS];
+    char buf[LOGR_MAX_TIMESTAMP_SIZE];
+    int count;
+    struct {
+        const char *fmt;      /* strftime() format of this segment */
+        int digits;           /* sub-second digits that follow, 0 if none */
+    } seg[LOGR_MAX_TS_SEGMENTS];
+    const char *spec;         /* format as given by the user */
+    char *mem;                /* owned copy backing fmt/spec */
+};
 
-static const char *logr_default_timestamp_fmt = LOGR_DEFAULT_DATE_FORMAT;
+static struct logr_tsfmt logr_default_tsfmt = {
+    .sec = -1,
+    .count = 1,
+    .seg = { { LOGR_DEFAULT_DATE_FORMAT, 0 } },
+    .spec = LOGR_DEFAULT_DATE_FORMAT
+};
 
-struct logr {
-    FILE *f;
-    char *path;
+/*
+ * The prefix format is compiled once by logr_set_prefix_format into a list
+ * of ops: runs of literal characters and field opcodes.  Rendering an entry
+ * is then a straight walk over the ops without re-parsing the format.
+ */
+enum logr_opcode {
+    LOGR_OP_LITERAL,
+    LOGR_OP_FILE,
+    LOGR_OP_LINE,
+    LOGR_OP_FUNC,
+    LOGR_OP_PRETTY,
+    LOGR_OP_LEVEL_S,
+    LOGR_OP_LEVEL_D,
+    LOGR_OP_PID,
+    LOGR_OP_TIMESTAMP_S,
+    LOGR_OP_TIMESTAMP_D,
+    LOGR_OP_TIMESTAMP_U,
+    LOGR_OP_MSEC,
+    LOGR_OP_USEC
+};
+
+struct logr_op {
+    enum logr_opcode code;
+    size_t len;              /* LOGR_OP_LITERAL only */
+    const char *str;         /* LOGR_OP_LITERAL only */
+};
+
+struct logr_prefix {
+    size_t count;
+    struct logr_op *op;
+    /* followed by the ops array and the literal characters */
+};
+
+static const struct {
+    const char *name;
+    char specifier;
+    enum logr_opcode code;
+} logr_fields[] = {
+    { "file", 's', LOGR_OP_FILE },
+    { "line", 'd', LOGR_OP_LINE },
+    { "func", 's', LOGR_OP_FUNC },
+    { "pretty", 's', LOGR_OP_PRETTY },
+    { "level", 's', LOGR_OP_LEVEL_S },
+    { "level", 'd', LOGR_OP_LEVEL_D },
+    { "priority", 's', LOGR_OP_LEVEL_S },
+    { "priority", 'd', LOGR_OP_LEVEL_D },
+    { "pid", 'd', LOGR_OP_PID },
+    { "timestamp", 's', LOGR_OP_TIMESTAMP_S },
+    { "timestamp", 'd', LOGR_OP_TIMESTAMP_D },
+    { "timestamp", 'u', LOGR_OP_TIMESTAMP_U },
+    { "msec", 'd', LOGR_OP_MSEC },
+    { "usec", 'd', LOGR_OP_USEC },
+    { NULL, 0, LOGR_OP_LITERAL }
+};
+
+/*
+ * Everything needed to render a single log entry.  The message is either
+ * formatted directly from the caller's va_list or, in asynchronous mode,
+ * pre-formatted into msg/len.
+ */
+struct logr_record {
+    const char *file;
+    int line;
+    const char *func;
+    const char *pretty_func;
+    int level;
+    struct timespec ts;
+    long pid;                 /* 0 for this process */
+    int kv;                   /* LOGR_KV_* for encoded pairs, else 0 */
+    const char *msg;
+    size_t len;
+};
+
+#define _RXARGS rec->file, rec->line, rec->func, rec->pretty_func
+
+/* kv of a line of logr's own, written as it is without a prefix */
+#define LOGR_KV_RAW (-1)
+
+/* Another descriptor receiving the entries of a logger. */
+struct logr_sink {
+    int fd;                   /* -1 for a syslog sink */
+    int level;                /* lowest priority written */
+    struct logr_syslog *syslog; /* see logr_add_syslog */
+};
+
+/*
+ * Growable byte buffer.  Entries are rendered into a per-thread buffer and
+ * handed to write(2) in one piece.
+ */
+struct logr_buf {
+    char *data;
+    size_t len;
+    size_t size;
+};
+
+#define LOGR_BUF_SIZE 512
+#define LOGR_BATCH_SIZE (64 * 1024)
+
+#ifndef __WIN32
+/*
+ * Bounded multi-producer queue used in asynchronous mode.  Producers copy
+ * records into a byte ring under q->lock; a single writer thread per logger
+ * drains them and does the actual formatting, writing and rotation.
+ */
+struct logr_queue {
     pthread_mutex_t lock;
+    pthread_cond_t cond;      /* signalled when records are added */
+    pthread_t thread;
+    char *buf;
+    size_t size;
+    size_t head;
+    size_t tail;
+    size_t used;
+    unsigned long dropped;
+    bool active;
+    bool stop;
+    struct logr_queue *next;  /* list of queues drained at exit */
+    struct logr_buf *batch;   /* the writer's, see _logr_crash_flush */
+    size_t drained;           /* bytes past head in batch or written */
+};
+
+/* Header of each record in the ring, the message bytes follow. */
+struct logr_qrec {
+    uint32_t size;            /* aligned size of header + message, 0 = wrap */
+    int level;
+    int line;
+    int kv;
+    const char *file;
+    const char *func;
+    const char *pretty_func;
+    struct timespec ts;
+    uint64_t seq;             /* order across shards, see logr_set_sharded */
+    size_t len;
+};
+
+#define LOGR_QALIGN(n) (((n) + 7) & ~((size_t)7))
+#define LOGR_MIN_QUEUE_SIZE 4096
+
+static void _logr_queue_free(struct logr_queue *q);
+struct logr_shards;
+static void _logr_shards_free(struct logr_shards *set);
+static void _logr_timer_remove(logr_t *logr);
+static void _logr_janitor_wait(void);
+struct logr_syslog;
+static void _logr_syslog_free(struct logr_syslog *sl);
+static void _logr_syslog_flush(struct logr_syslog *sl);
+#endif
+static int _logr_commit(logr_t *logr, struct logr_buf *b);
+static int _logr_put(logr_t *logr, struct logr_record *rec);
+static int _logr_bin_prologue(logr_t *logr);
+struct logr_uring;
+static int _logr_uring_wait(logr_t *logr);
+static void _logr_unmap(logr_t *logr);
+struct logr_dedup;
+static void _logr_dedup_flush(logr_t *logr);
+#ifndef __WIN32
+static unsigned int _logr_dedup_expire(logr_t *logr);
+#endif
+struct logr_flight;
+static void _logr_flight_free(struct logr_flight *fl);
+static void _logr_store_level(logr_t *logr, unsigned int level);
+static void _logr_named_inherit(logr_t *parent);
+static struct logr_cfg *_logr_cfg_edit(logr_t *logr);
+static void _logr_cfg_publish(logr_t *logr, struct logr_cfg *cfg);
+static void _logr_cfg_cancel(logr_t *logr, struct logr_cfg *cfg);
+static void _logr_cfg_free(struct logr_cfg *cfg);
+static void _logr_named_output(logr_t *logr, bool opened);
+
+/*
+ * The settings read while entries are written.  A published config is
+ * never changed: setters change a copy and swap the pointer, see
+ * _logr_cfg_publish().
+ */
+struct logr_cfg {
     char *prefix_fmt;
-    char *timestamp_fmt;
-    int prefix_len;
-    int need_date;
+    struct logr_prefix *prefix;
+    struct logr_tsfmt *tsfmt;
+    logr_ops_t ops;
+    off_t threshold;
+    int rotated_file_max;
+    int compress;             /* gzip level for rotated files, 0 for none */
+    unsigned int rotate_interval;
+    char *rotate_name;        /* strftime suffix for rotated files */
+};
+
+/* Shared by all loggers until their settings change, never freed. */
+static struct logr_cfg logr_default_cfg = {
+    .rotated_file_max = LOGR_DEFAULT_MAX_FILE_ROTATE
+};
+
+/*
+ * Counters bumped without logr->lock, see logr_get_stats.  Each thread
+ * uses one of the stripes so that threads rarely share a cache line.
+ */
+#define LOGR_STRIPES 16
+
+struct logr_stripe {
+    unsigned long long emitted;
+    unsigned long long filtered;
+    unsigned long long dropped;
+    unsigned long long lock_wait_ns;
+    unsigned long long rotate_errors; /* of the background thread */
+} __attribute__((aligned(64)));
+
+struct logr {
+    /* gate MUST remain the first member, see _LOGR_LEVEL in logr.h */
+    unsigned int gate;        /* the greater of level and the flight level */
     unsigned int level;
+    int fd;
+    char *path;
+    bool regular;             /* fd is a regular file */
+    pthread_mutex_t lock;
+    struct logr_cfg *cfg;     /* see _logr_cfg_publish */
+    pthread_mutex_t cfg_lock; /* serializes changes to cfg */
+    int kv_format;            /* see logr_set_kv_format */
+    struct logr_dedup *dedup; /* see logr_set_dedup */
+    unsigned int dedup_ms;
+    struct logr_flight *flight; /* see logr_set_flight_recorder */
+    struct logr_flight *flight_retired;
     off_t size;
-    off_t threshold;
     int rotate_file_count;
-    int rotated_file_max;
-    logr_ops_t ops;
+    unsigned int rotate_seq;
+    time_t rotate_start;      /* start of the current period */
+    time_t rotate_at;         /* next time based rotation, 0 for none */
+    bool binary;              /* write entries in the binary format */
+    bool bin_fresh;           /* the output needs a binary file header */
+    struct logr_buf bin_sites; /* every call site defined so far */
+    size_t bin_written;       /* ... of which the output has this much */
+    uint8_t *bin_seen;        /* bitmap of defined call site ids */
+    size_t bin_seen_size;
+    struct logr_sink *sinks;  /* see logr_add_sink */
+    size_t nsinks;
+    struct logr_buf out;      /* entries held back by the flush policy */
+    bool buffered;
+    int flush_level;
+    size_t flush_bytes;       /* 0 for the buffer size */
+    size_t buffer_size;
+    unsigned int flush_ms;
+    logr_t *flush_next;       /* list of buffered loggers flushed at exit */
+    logr_t *target;           /* writes the entries, see logr_get_named */
+    const char *name;         /* NULL unless named, "" for the root */
+    logr_t *parent;
+    logr_t *child;            /* first of the children */
+    logr_t *sibling;
+    logr_t *named_next;       /* next in the hash chain */
+    bool level_set;           /* level not inherited */
+    bool opened;              /* has a file of its own */
+#ifndef __WIN32
+    char *reload_path;        /* see logr_reload_on_sighup */
+    logr_t *reload_next;      /* list of loggers reloaded on SIGHUP */
+    struct logr_queue *queue;
+    struct logr_shards *shards;
+    struct timespec flush_due;
+    struct timespec dedup_due;
+    logr_t *timer_next;       /* list of loggers with a flush interval
+                                 or a dedup window */
+    int owner;                /* id of the thread holding lock, 0 if none */
+    int crash_busy;           /* a crash handler is writing, see logr_lock */
+    struct logr_uring *uring; /* see logr_set_io_uring */
+    logr_t *uring_next;       /* list of loggers waited for at exit */
+    size_t map_extent;        /* see logr_set_mmap, 0 if not used */
+    bool map_failed;          /* write(2) to this file instead */
+    bool mapped;              /* the file has a preallocated tail */
+    char *map;                /* window onto the end of the file */
+    off_t map_off;            /* file offset of map */
+    off_t map_pos;            /* end of the data in the file */
+    logr_t *map_next;         /* list of loggers trimmed at exit */
+#endif
+    unsigned long long bytes; /* statistics kept with logr->lock */
+    unsigned long long flushes;
+    unsigned long long rotations;
+    unsigned long long rotate_errors;
+    unsigned long long write_errors;
+    struct logr_stripe stripes[LOGR_STRIPES];
 };
 
 static struct logr logr = {
     .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cfg = &logr_default_cfg,
+    .cfg_lock = PTHREAD_MUTEX_INITIALIZER,
+    .fd = -1,
+    .gate = LOGR_ERR,
     .level = LOGR_ERR,
-    .rotated_file_max = LOGR_DEFAULT_MAX_FILE_ROTATE
+    .flush_level = LOGR_FLUSH_ALWAYS,
+    .buffer_size = LOGR_DEFAULT_BUFFER_SIZE,
+    .target = &logr,
+    .name = "",
+    .level_set = true,
+    .opened = true
 };
 
+logr_t *const _logr_global = &logr;
+
+/* Guards the tree of named loggers, see logr_get_named. */
+static pthread_mutex_t logr_named_lock = PTHREAD_MUTEX_INITIALIZER;
+
 logr_t *
 logr_getlogger() {
     return &logr;
@@ -115,8 +462,17 @@ _logr_init(logr_t *logr)
 {
     memset(logr, 0, sizeof(struct logr));
     pthread_mutex_init(&logr->lock, NULL);
+    logr->cfg = &logr_default_cfg;
+    pthread_mutex_init(&logr->cfg_lock, NULL);
+    logr->fd = -1;
+    logr->gate = LOGR_ERR;
     logr->level = LOGR_ERR;
-    logr->rotated_file_max = LOGR_DEFAULT_MAX_FILE_ROTATE;
+    logr->flush_level = LOGR_FLUSH_ALWAYS;
+    logr->buffer_size = LOGR_DEFAULT_BUFFER_SIZE;
+    logr->kv_format = LOGR_KV_JSON;
+    logr->target = logr;
+    logr->level_set = true;
+    logr->opened = true;
 }
 
 static inline int
@@ -126,15 +482,19 @@ _logr_errno(int x)
     return -1;
 }
 
-/*
- * Wrapper around abort() that gets called for 'bad' format strings.
- * This approach mimics libc's handling of indexed directives.
- */
-static void
-_logr_fatal(const char *msg)
+/* Wall clock time of an entry. */
+static inline void
+_logr_now(struct timespec *ts)
 {
-    fputs(msg, stderr);
-    abort();
+#ifdef __WIN32
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    ts->tv_sec = tv.tv_sec;
+    ts->tv_nsec = tv.tv_usec * 1000;
+#else
+    clock_gettime(CLOCK_REALTIME, ts);
+#endif
 }
 
 static inline bool
@@ -155,18 +515,105 @@ _logr_specifier_char(const char c)
     return isalpha((int)c);
 }
 
+static unsigned int logr_stripe_next;
+static __thread unsigned int logr_stripe_id;
+
+/* This thread's stripe of the counters of logr. */
+static inline struct logr_stripe *
+_logr_stripe(logr_t *logr)
+{
+    if (logr_stripe_id == 0) {
+        logr_stripe_id = __atomic_add_fetch(&logr_stripe_next, 1,
+                                            __ATOMIC_RELAXED);
+    }
+    return &logr->stripes[logr_stripe_id % LOGR_STRIPES];
+}
+
 static inline void
-logr_lock(logr_t *logr)
+_logr_count(unsigned long long *counter, unsigned long long n)
+{
+    __atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+}
+
+#ifndef __WIN32
+static __thread int logr_tid;
+#ifndef __linux__
+static int logr_tid_next;
+#endif
+
+/* This thread's id for logr->owner: the kernel's where there is one. */
+static inline int
+_logr_tid(void)
+{
+    if (logr_tid == 0) {
+#ifdef __linux__
+        logr_tid = syscall(SYS_gettid);
+#else
+        logr_tid = __atomic_add_fetch(&logr_tid_next, 1, __ATOMIC_RELAXED);
+#endif
+    }
+    return logr_tid;
+}
+#endif
+
+static void
+_logr_lock_wait(logr_t *logr)
 {
+    struct timespec t0, t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
     pthread_mutex_lock(&logr->lock);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    _logr_count(&_logr_stripe(logr)->lock_wait_ns,
+                (t1.tv_sec - t0.tv_sec) * 1000000000LL +
+                (t1.tv_nsec - t0.tv_nsec));
+}
+
+/* Only time spent waiting is measured, an uncontended lock costs nothing. */
+static inline void
+logr_lock(logr_t *logr)
+{
+#ifndef __WIN32
+    for (;;) {
+#endif
+        if (pthread_mutex_trylock(&logr->lock) != 0) {
+            _logr_lock_wait(logr);
+        }
+#ifndef __WIN32
+        /*
+         * A crash handler can't take the lock, it waits for owner to be
+         * cleared instead and sets crash_busy: one of the two sees the
+         * other, so the handler never writes along with this thread.
+         */
+        __atomic_store_n(&logr->owner, _logr_tid(), __ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&logr->crash_busy, __ATOMIC_SEQ_CST)) {
+            break;
+        }
+        __atomic_store_n(&logr->owner, 0, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&logr->lock);
+        while (__atomic_load_n(&logr->crash_busy, __ATOMIC_ACQUIRE)) {
+            sched_yield();
+        }
+    }
+#endif
 }
 
 static inline void
 logr_unlock(logr_t *logr)
 {
+#ifndef __WIN32
+    __atomic_store_n(&logr->owner, 0, __ATOMIC_RELEASE);
+#endif
     pthread_mutex_unlock(&logr->lock);
 }
 
+/* The settings of a logger, valid as long as logr->lock is held. */
+static inline struct logr_cfg *
+_logr_cfg(logr_t *logr)
+{
+    return __atomic_load_n(&logr->cfg, __ATOMIC_ACQUIRE);
+}
+
 const char *
 logr_util_priority(logr_t *unused, int level)
 {
@@ -201,7 +648,30 @@ logr_set_level(logr_t *logr, unsigned int level)
     if (logr == NULL) {
         return _logr_errno(EINVAL);
     }
-    logr->level = level;
+    if (logr->name == NULL) {
+        _logr_store_level(logr, level);
+        return 0;
+    }
+    pthread_mutex_lock(&logr_named_lock);
+    logr->level_set = true;
+    _logr_store_level(logr, level);
+    _logr_named_inherit(logr);
+    pthread_mutex_unlock(&logr_named_lock);
+    return 0;
+}
+
+int
+logr_inherit_level(logr_t *logr)
+{
+    if ((logr == NULL) || (logr->parent == NULL)) {
+        return _logr_errno(EINVAL);
+    }
+    pthread_mutex_lock(&logr_named_lock);
+    logr->level_set = false;
+    _logr_store_level(logr, __atomic_load_n(&logr->parent->level,
+                                            __ATOMIC_RELAXED));
+    _logr_named_inherit(logr);
+    pthread_mutex_unlock(&logr_named_lock);
     return 0;
 }
 
@@ -211,51 +681,210 @@ logr_get_level(logr_t *logr)
     if (logr == NULL) {
         return _logr_errno(EINVAL);
     }
-    return logr->level;
+    return __atomic_load_n(&logr->level, __ATOMIC_RELAXED);
 }
 
 int
 logr_set_threshold(logr_t *logr, off_t threshold)
 {
+    struct logr_cfg *cfg;
+
     if (logr == NULL) {
         return _logr_errno(EINVAL);
     }
-    logr->threshold = threshold;
-    if (threshold == 0) {
-        return 0;
+    cfg = _logr_cfg_edit(logr);
+    if (cfg == NULL) {
+        return -1;
     }
+    cfg->threshold = threshold;
+    _logr_cfg_publish(logr, cfg);
     return 0;
 }
 
 int
 logr_set_rotate_file_count(logr_t *logr, int max_files)
 {
+    struct logr_cfg *cfg;
+
     if ((logr == NULL) || (max_files > MAX_ROTATE_FILES)) {
         return _logr_errno(EINVAL);
     }
 
-    logr->rotated_file_max = max_files;
+    cfg = _logr_cfg_edit(logr);
+    if (cfg == NULL) {
+        return -1;
+    }
+    cfg->rotated_file_max = max_files;
+    _logr_cfg_publish(logr, cfg);
+    return 0;
+}
+
+static void
+_logr_localtime(time_t sec, struct tm *tm)
+{
+#ifdef __WIN32
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+    pthread_mutex_lock(&lock);
+    /* don't use localtime_r since it's missing from mingw */
+    *tm = *localtime(&sec);
+    pthread_mutex_unlock(&lock);
+#else
+    localtime_r(&sec, tm);
+#endif
+}
+
+/*
+ * Work out the period 'now' falls into, aligned to local midnight, and
+ * when the next one starts.  Done once per period so that checking for
+ * a time based rotation is a single comparison.
+ */
+static void
+_logr_rotate_period(logr_t *logr, time_t now)
+{
+    unsigned int interval = _logr_cfg(logr)->rotate_interval;
+    unsigned int secs;
+    struct tm tm;
+
+    _logr_localtime(now, &tm);
+    secs = tm.tm_hour * 3600 + tm.tm_min * 60 + tm.tm_sec;
+    tm.tm_hour = 0;
+    tm.tm_min = 0;
+    tm.tm_sec = secs - (secs % interval);
+    tm.tm_isdst = -1;
+    logr->rotate_start = mktime(&tm);
+
+    tm.tm_sec += interval;
+    tm.tm_isdst = -1;
+    logr->rotate_at = mktime(&tm);
+    if (logr->rotate_at <= now) {
+        /* daylight saving time folded the boundary back */
+        logr->rotate_at = now + interval;
+    }
+}
+
+int
+logr_set_rotate_interval(logr_t *logr, unsigned int interval,
+                         const char *name_fmt)
+{
+    struct logr_cfg *cfg;
+    char *name = NULL;
+
+    if ((logr == NULL) || ((interval != 0) &&
+                           (LOGR_ROTATE_DAILY % interval != 0))) {
+        return _logr_errno(EINVAL);
+    }
+    if (name_fmt != NULL) {
+#ifdef __WIN32
+        return _logr_errno(ENOTSUP);
+#else
+        name = strdup(name_fmt);
+        if (name == NULL) {
+            return -1;
+        }
+#endif
+    }
+
+    cfg = _logr_cfg_edit(logr);
+    if (cfg == NULL) {
+        free(name);
+        return -1;
+    }
+    free(cfg->rotate_name);
+    cfg->rotate_name = name;
+    cfg->rotate_interval = interval;
+    _logr_cfg_publish(logr, cfg);
+    return 0;
+}
+
+int
+logr_set_compress(logr_t *logr, int level)
+{
+#if defined(HAVE_ZLIB) && !defined(__WIN32)
+    struct logr_cfg *cfg;
+#endif
+
+    if ((logr == NULL) || (level < 0) || (level > 9)) {
+        return _logr_errno(EINVAL);
+    }
+#if defined(HAVE_ZLIB) && !defined(__WIN32)
+    cfg = _logr_cfg_edit(logr);
+    if (cfg == NULL) {
+        return -1;
+    }
+    cfg->compress = level;
+    _logr_cfg_publish(logr, cfg);
     return 0;
+#else
+    if (level == 0) {
+        return 0;
+    }
+    return _logr_errno(ENOTSUP);
+#endif
 }
 
 void
 logr_free(logr_t *logr)
 {
+#ifndef __WIN32
+    size_t i;
+#endif
     int tmp = errno;
 
-    if (logr == NULL)
+    /* named loggers and the global one last as long as the process */
+    if ((logr == NULL) || (logr->name != NULL))
         return;
+    _logr_dedup_flush(logr);
+    if (logr->buffered) {
+        logr_set_flush_policy(logr, LOGR_FLUSH_ALWAYS, 0, 0);
+    }
+#ifndef __WIN32
+    if (logr->reload_path != NULL) {
+        logr_reload_on_sighup(logr, NULL);
+    }
+    logr_set_crash_flush(logr, 0);
+    if (logr->queue != NULL) {
+        _logr_queue_free(logr->queue);
+    }
+    if (logr->shards != NULL) {
+        _logr_shards_free(logr->shards);
+    }
+    _logr_timer_remove(logr);
+    if (logr->uring != NULL) {
+        logr_set_io_uring(logr, 0, 0);
+    }
+    if (logr->map_extent != 0) {
+        logr_set_mmap(logr, 0);
+    }
+#endif
     logr_lock(logr);
-    if (logr->f != NULL) {
-        fclose(logr->f);
+    _logr_commit(logr, &logr->out);
+    free(logr->out.data);
+    if (logr->fd >= 0) {
+        close(logr->fd);
     }
-    if (logr->prefix_fmt != NULL) {
-        free(logr->prefix_fmt);
+    if (logr->path != NULL) {
+        free(logr->path);
     }
-    if (logr->timestamp_fmt != NULL) {
-        free(logr->timestamp_fmt);
+#ifndef __WIN32
+    for (i = 0; i < logr->nsinks; i++) {
+        if (logr->sinks[i].syslog != NULL) {
+            _logr_syslog_free(logr->sinks[i].syslog);
+        }
     }
+#endif
+    free(logr->sinks);
+    free(logr->dedup);
+    _logr_flight_free(logr->flight);
+    _logr_flight_free(logr->flight_retired);
+    free(logr->bin_sites.data);
+    free(logr->bin_seen);
+    _logr_cfg_free(logr->cfg);
     logr_unlock(logr);
+#ifndef __WIN32
+    /* rotations of this logger count their errors in it */
+    _logr_janitor_wait();
+#endif
     free(logr);
 
     errno = tmp;
@@ -266,31 +895,53 @@ _logr_close(logr_t *logr)
 {
     int tmp = errno;
 
-    if (logr->f != NULL) {
-        fclose(logr->f);
-        logr->f = NULL;
+    /* buffered entries belong to the old file */
+    _logr_commit(logr, &logr->out);
+    _logr_uring_wait(logr);
+    _logr_unmap(logr);
+    if (logr->fd >= 0) {
+        close(logr->fd);
+        logr->fd = -1;
     }
+    logr->regular = false;
     if (logr->path != NULL) {
         free(logr->path);
         logr->path = NULL;
     }
+    logr->bin_fresh = true;
     errno = tmp;
 }
 
+/*
+ * Open the log file for appending.  O_APPEND makes every write(2) land at
+ * the current end of file, so entries from several processes sharing the
+ * file never interleave.
+ */
+static int
+_logr_openfd(const char *path)
+{
+    return open(path, O_WRONLY | O_APPEND | O_CREAT, 0666);
+}
+
 int
 logr_open(logr_t *logr, const char *p)
 {
-    FILE *f;
+    int fd;
     char *path;
-    long pos;
+    off_t pos;
+    struct stat st;
+    bool regular;
 
     if (logr == NULL) {
         return _logr_errno(EINVAL);
     }
 
-    /* just use stderr */
+    /* just use stderr, or the file of a named logger's parent */
     if (p == NULL) {
+        logr_lock(logr);
         _logr_close(logr);
+        logr_unlock(logr);
+        _logr_named_output(logr, false);
         return 0;
     }
 
@@ -299,25 +950,36 @@ logr_open(logr_t *logr, const char *p)
         return -1;
     }
 
-    f = fopen(path, "a");
-    if (f == NULL) {
+    fd = _logr_openfd(path);
+    if (fd < 0) {
         free(path);
         return -1;
     }
 
-    /* file position is guaranteed to be at the end with 'a' */
-    pos = ftell(f);
+    pos = lseek(fd, 0, SEEK_END);
+    if ((pos < 0) && (errno == ESPIPE)) {
+        /* a fifo or terminal */
+        pos = 0;
+    }
     if (pos < 0) {
-        fclose(f);
+        close(fd);
         free(path);
         return -1;
     }
+    regular = (fstat(fd, &st) == 0) && S_ISREG(st.st_mode);
 
+    logr_lock(logr);
     _logr_close(logr);
-    logr->f = f;
+    logr->fd = fd;
     logr->path = path;
+    logr->regular = regular;
+#ifndef __WIN32
+    logr->map_failed = false;
+#endif
     logr->size = pos;
+    logr_unlock(logr);
 
+    _logr_named_output(logr, true);
     return 0;
 }
 
@@ -342,294 +1004,6506 @@ logr_alloc(const char *path)
     return logr;
 }
 
-int
-logr_set_prefix_format(logr_t *logr, const char *fmt)
-{
-    char *prefix_fmt;
-    int need_date;
+/*
+ * Named loggers form a tree under the global logger, each linked into a
+ * hash table of all of them.  Lookups walk a chain without a lock; the
+ * tree changes under logr_named_lock and named loggers are never freed.
+ */
+#define LOGR_NAMED_BUCKETS 256
 
-    if (logr == NULL || fmt == NULL)
-        return _logr_errno(EINVAL);
+static logr_t *logr_named[LOGR_NAMED_BUCKETS];
 
-    prefix_fmt = strdup(fmt);
-    if (prefix_fmt == NULL)
-        return _logr_errno(ENOMEM);
+/* FNV-1a of a name. */
+static inline uint32_t
+_logr_named_hash(const char *name, size_t len)
+{
+    uint32_t h = 2166136261U;
+    size_t i;
 
-    if (strstr(prefix_fmt, "%5$s") != NULL) {
-        need_date = 1;
-    } else {
-        need_date = 0;
+    for (i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)name[i]) * 16777619U;
     }
+    return h;
+}
 
-    logr_lock(logr);
-    free(logr->prefix_fmt);
-    logr->prefix_fmt = prefix_fmt;
-    logr->prefix_len = strlen(prefix_fmt);
-    logr->need_date = need_date;
-    logr_unlock(logr);
+static logr_t *
+_logr_named_find(const char *name, size_t len, uint32_t h)
+{
+    logr_t *l;
 
-    return 0;
+    for (l = __atomic_load_n(&logr_named[h % LOGR_NAMED_BUCKETS],
+                             __ATOMIC_ACQUIRE);
+         l != NULL; l = __atomic_load_n(&l->named_next, __ATOMIC_ACQUIRE)) {
+        if ((strncmp(l->name, name, len) == 0) && (l->name[len] == '\0')) {
+            return l;
+        }
+    }
+    return NULL;
 }
 
-int
-logr_set_timestamp_format(logr_t *logr, const char *fmt)
+/*
+ * Pass the level and output of parent on to the descendants inheriting
+ * them, visiting no subtree that inherits neither.  With logr_named_lock.
+ */
+static void
+_logr_named_inherit(logr_t *parent)
 {
-    char *timestamp_fmt, *tmp = NULL;
+    logr_t *c;
 
-    if (logr == NULL || fmt == NULL) {
-        return _logr_errno(EINVAL);
+    for (c = parent->child; c != NULL; c = c->sibling) {
+        if (c->level_set && c->opened) {
+            continue;
+        }
+        if (!c->level_set) {
+            _logr_store_level(c, __atomic_load_n(&parent->level,
+                                                 __ATOMIC_RELAXED));
+        }
+        if (!c->opened) {
+            __atomic_store_n(&c->target, parent->target, __ATOMIC_RELEASE);
+        }
+        _logr_named_inherit(c);
     }
+}
 
-    timestamp_fmt = strdup(fmt);
-    if (timestamp_fmt == NULL) {
-        return _logr_errno(ENOMEM);
-    }
+/* A named logger got a file of its own or gave it up. */
+static void
+_logr_named_output(logr_t *logr, bool opened)
+{
+    if (logr->parent == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&logr_named_lock);
+    logr->opened = opened;
+    __atomic_store_n(&logr->target, opened ? logr : logr->parent->target,
+                     __ATOMIC_RELEASE);
+    _logr_named_inherit(logr);
+    pthread_mutex_unlock(&logr_named_lock);
+}
 
-    logr_lock(logr);
-    if ((logr->timestamp_fmt != NULL) &&
-        (logr->timestamp_fmt != logr_default_timestamp_fmt)) {
-        tmp = logr->timestamp_fmt;
+/* Find or make the named logger and its ancestors.  With logr_named_lock. */
+static logr_t *
+_logr_named_create(const char *name, size_t len)
+{
+    uint32_t h = _logr_named_hash(name, len);
+    logr_t *l, *parent;
+    const char *dot;
+    char *copy;
+
+    l = _logr_named_find(name, len, h);
+    if (l != NULL) {
+        return l;
+    }
+    for (dot = name + len - 1; dot > name; dot--) {
+        if (*dot == '.') {
+            break;
+        }
+    }
+    parent = (dot > name) ? _logr_named_create(name, dot - name) : &logr;
+    if (parent == NULL) {
+        return NULL;
+    }
+
+    l = (logr_t *)malloc(sizeof(logr_t));
+    copy = (char *)malloc(len + 1);
+    if ((l == NULL) || (copy == NULL)) {
+        free(l);
+        free(copy);
+        return NULL;
+    }
+    _logr_init(l);
+    memcpy(copy, name, len);
+    copy[len] = '\0';
+    l->name = copy;
+    l->parent = parent;
+    l->level_set = false;
+    l->opened = false;
+    l->gate = l->level = parent->level;
+    l->target = parent->target;
+    l->sibling = parent->child;
+    parent->child = l;
+    l->named_next = logr_named[h % LOGR_NAMED_BUCKETS];
+    __atomic_store_n(&logr_named[h % LOGR_NAMED_BUCKETS], l,
+                     __ATOMIC_RELEASE);
+    return l;
+}
+
+logr_t *
+logr_get_named(const char *name)
+{
+    size_t len;
+    logr_t *l;
+
+    if ((name == NULL) || (*name == '\0')) {
+        return &logr;
+    }
+    len = strlen(name);
+    if ((name[0] == '.') || (name[len - 1] == '.') ||
+            (strstr(name, "..") != NULL)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    l = _logr_named_find(name, len, _logr_named_hash(name, len));
+    if (l == NULL) {
+        pthread_mutex_lock(&logr_named_lock);
+        l = _logr_named_create(name, len);
+        pthread_mutex_unlock(&logr_named_lock);
+    }
+    return l;
+}
+
+/* Map a field name and specifier to its opcode, -1 if unknown. */
+static int
+_logr_field_code(const char *field, size_t size, char specifier)
+{
+    int i;
+
+    for (i = 0; logr_fields[i].name != NULL; i++) {
+        if ((strlen(logr_fields[i].name) == size) &&
+            (strncasecmp(logr_fields[i].name, field, size) == 0)) {
+            if (logr_fields[i].specifier == specifier) {
+                return logr_fields[i].code;
+            }
+        }
+    }
+    return -1;
+}
+
+/* Append a character to the trailing literal op, starting one if needed. */
+static inline void
+_logr_prefix_literal(struct logr_prefix *prog, char **lit, char c)
+{
+    struct logr_op *op = NULL;
+
+    if (prog->count != 0) {
+        op = &prog->op[prog->count - 1];
+    }
+    if ((op == NULL) || (op->code != LOGR_OP_LITERAL)) {
+        op = &prog->op[prog->count++];
+        op->code = LOGR_OP_LITERAL;
+        op->str = *lit;
+        op->len = 0;
+    }
+    *(*lit)++ = c;
+    op->len++;
+}
+
+/*
+ * Parse and validate a prefix format.
+ * Returns the compiled program or NULL with errno set (EINVAL on a bad
+ * format string).
+ */
+static struct logr_prefix *
+_logr_prefix_compile(const char *fmt)
+{
+    size_t len = strlen(fmt);
+    struct logr_prefix *prog;
+    struct logr_op *op;
+    const char *p, *field = NULL;
+    char *lit;
+    int code;
+    size_t n = 0;
+    enum {
+        CHARACTER,        // plain format char
+        DIRECTIVE_SYMBOL, // %
+        FIELD,            // between {}
+        FIELD_CLOSE       // saw }, need specifier.
+    } state = CHARACTER;
+
+    /* a format of length n never needs more than n ops or n literals */
+    prog = (struct logr_prefix *)malloc(sizeof(struct logr_prefix) +
+                                        len * sizeof(struct logr_op) + len);
+    if (prog == NULL) {
+        return NULL;
+    }
+    prog->count = 0;
+    prog->op = (struct logr_op *)(prog + 1);
+    lit = (char *)(prog->op + len);
+
+    for (p = fmt; *p != 0; p++) {
+        switch (state) {
+        case CHARACTER:
+            if (*p == '%') {
+                state = DIRECTIVE_SYMBOL;
+            } else if (isprint((int)(*p)) || (*p == '\r') || (*p == '\n')) {
+                _logr_prefix_literal(prog, &lit, *p);
+            } else {
+                goto invalid;
+            }
+            break;
+        case DIRECTIVE_SYMBOL:
+            if (*p == '%') {
+                _logr_prefix_literal(prog, &lit, *p);
+                state = CHARACTER;
+            } else if (*p == '{') {
+                state = FIELD;
+                n = 0;
+            } else {
+                goto invalid;
+            }
+            break;
+        case FIELD:
+            if (*p == '}') {
+                state = FIELD_CLOSE;
+                break;
+            } else if (!_logr_field_char(*p)) {
+                goto invalid;
+            }
+            if (n == 0) {
+                field = p;
+            }
+            n++;
+            break;
+        case FIELD_CLOSE:
+            if (!_logr_specifier_char(*p) || (n == 0)) {
+                goto invalid;
+            }
+            code = _logr_field_code(field, n, *p);
+            if (code < 0) {
+                goto invalid;
+            }
+            op = &prog->op[prog->count++];
+            op->code = (enum logr_opcode)code;
+            state = CHARACTER;
+            break;
+        }
     }
-    logr->timestamp_fmt = timestamp_fmt;
-    logr_unlock(logr);
 
-    if (tmp != NULL) {
-        free(tmp);
+    if (state != CHARACTER) {
+        goto invalid;
     }
+    return prog;
+
+invalid:
+    free(prog);
+    errno = EINVAL;
+    return NULL;
+}
+
+/*
+ * Set the prefix format of cfg.  A custom prefix function gets the format
+ * as it is and may know fields we don't, so the format is only compiled,
+ * and checked, for the built-in renderer.
+ */
+static int
+_logr_cfg_prefix(struct logr_cfg *cfg, const char *fmt)
+{
+    struct logr_prefix *prefix = NULL;
+    char *prefix_fmt;
 
+    if (cfg->ops.prefix == NULL) {
+        prefix = _logr_prefix_compile(fmt);
+        if (prefix == NULL) {
+            return -1;
+        }
+    }
+    prefix_fmt = strdup(fmt);
+    if (prefix_fmt == NULL) {
+        free(prefix);
+        return _logr_errno(ENOMEM);
+    }
+    free(cfg->prefix_fmt);
+    free(cfg->prefix);
+    cfg->prefix_fmt = prefix_fmt;
+    cfg->prefix = prefix;
     return 0;
 }
 
 int
-logr_set_ops(logr_t *logr, logr_ops_t *ops)
+logr_set_prefix_format(logr_t *logr, const char *fmt)
 {
-    if (logr == NULL) {
+    struct logr_cfg *cfg;
+
+    if (logr == NULL || fmt == NULL)
+        return _logr_errno(EINVAL);
+
+    cfg = _logr_cfg_edit(logr);
+    if (cfg == NULL) {
         return -1;
     }
-    if (ops == NULL) {
-        return 0;
+    if (_logr_cfg_prefix(cfg, fmt) < 0) {
+        _logr_cfg_cancel(logr, cfg);
+        return -1;
     }
-    logr->ops = *ops;
+    _logr_cfg_publish(logr, cfg);
+
     return 0;
 }
 
-void
-_logr_rotatelog(logr_t *logr)
+/*
+ * Split a timestamp format at its %{msec} and %{usec} directives.
+ * Returns NULL with errno set on error.
+ */
+static struct logr_tsfmt *
+_logr_tsfmt_compile(const char *fmt)
 {
-    int retval;
-    char newname[strlen(logr->path) + MAX_ROTATE_EXT_LEN];
-    char oldname[strlen(logr->path) + MAX_ROTATE_EXT_LEN];
-    int i;
+    struct logr_tsfmt *tf;
+    size_t len = strlen(fmt);
+    char *p;
+    int digits;
 
-    if (logr->rotate_file_count < logr->rotated_file_max) {
-        logr->rotate_file_count++;
+    tf = (struct logr_tsfmt *)calloc(1, sizeof(struct logr_tsfmt));
+    if (tf == NULL) {
+        return NULL;
     }
+    /* room for the user's format followed by the cut up copy */
+    tf->mem = (char *)malloc(2 * (len + 1));
+    if (tf->mem == NULL) {
+        free(tf);
+        return NULL;
+    }
+    tf->sec = -1;
+    tf->spec = strcpy(tf->mem, fmt);
+    p = strcpy(tf->mem + len + 1, fmt);
 
-    for(i = logr->rotate_file_count; i >= 1; i--) {
-        if (i == 1) {
-            strcpy(oldname, logr->path);
+    tf->seg[0].fmt = p;
+    tf->count = 1;
+    while (*p != 0) {
+        if (*p != '%') {
+            p++;
+            continue;
+        }
+        if (strncmp(p, "%{msec}", 7) == 0) {
+            digits = 3;
+        } else if (strncmp(p, "%{usec}", 7) == 0) {
+            digits = 6;
         } else {
-            sprintf(oldname, "%s.%d", logr->path, i-1);
+            /* skip the conversion character, which may be a '%' */
+            p += (p[1] != 0) ? 2 : 1;
+            continue;
         }
+        if (tf->count == LOGR_MAX_TS_SEGMENTS) {
+            free(tf->mem);
+            free(tf);
+            errno = EINVAL;
+            return NULL;
+        }
+        *p = 0;
+        tf->seg[tf->count - 1].digits = digits;
+        p += 7;
+        tf->seg[tf->count++].fmt = p;
+    }
+    return tf;
+}
 
-        sprintf(newname, "%s.%d", logr->path, i);
-
-#ifdef __WIN32
-        /*
-         * win32 fails with "File exists." if the newname exists during
-         * the rename.
-         */
-        unlink(newname);
-#endif
+static void
+_logr_tsfmt_free(struct logr_tsfmt *tsfmt)
+{
+    if (tsfmt != NULL) {
+        free(tsfmt->mem);
+        free(tsfmt);
+    }
+}
 
-        // printf("renaming %s to %s\n\r", oldname, newname);
-        fflush(stdout);
+/*
+ * Start changing the settings of a logger: returns a copy of its config
+ * to change and hand to _logr_cfg_publish(), with logr->cfg_lock held,
+ * or NULL.
+ */
+static struct logr_cfg *
+_logr_cfg_edit(logr_t *logr)
+{
+    const struct logr_cfg *old;
+    struct logr_cfg *cfg;
 
-        retval = rename(oldname, newname);
-        if (retval != 0) {
-            // fixme
-            printf("ERROR: couldn't rename the file from %s to %s\n\r",
-                   oldname, newname);
-            perror("rename");
-            continue;
-        }
+    cfg = (struct logr_cfg *)malloc(sizeof(struct logr_cfg));
+    if (cfg == NULL) {
+        return NULL;
+    }
+    pthread_mutex_lock(&logr->cfg_lock);
+    old = logr->cfg;
+    *cfg = *old;
+    cfg->prefix_fmt = NULL;
+    cfg->prefix = NULL;
+    cfg->tsfmt = NULL;
+    cfg->rotate_name = NULL;
+    if (((old->prefix_fmt != NULL) &&
+         ((cfg->prefix_fmt = strdup(old->prefix_fmt)) == NULL)) ||
+            ((old->prefix != NULL) &&
+             ((cfg->prefix = _logr_prefix_compile(old->prefix_fmt)) == NULL)) ||
+            ((old->tsfmt != NULL) &&
+             ((cfg->tsfmt = _logr_tsfmt_compile(old->tsfmt->spec)) == NULL)) ||
+            ((old->rotate_name != NULL) &&
+             ((cfg->rotate_name = strdup(old->rotate_name)) == NULL))) {
+        pthread_mutex_unlock(&logr->cfg_lock);
+        _logr_cfg_free(cfg);
+        return NULL;
     }
+    return cfg;
 }
 
-static int
-_logr_fputs(const char *p, FILE *f)
+/*
+ * Swap in a config made by _logr_cfg_edit() and free the old one after a
+ * grace period.  Everything reading a config holds logr->lock, so once
+ * the lock has been free after the swap nobody uses the old one.  Writers
+ * never wait for the copy or the free, only the caller waits for the
+ * entry being written.
+ */
+static void
+_logr_cfg_publish(logr_t *logr, struct logr_cfg *cfg)
 {
-    int retval, c, n;
+    struct logr_cfg *old = logr->cfg;
 
-    for (n = 0; ((c = *p) != 0); p++,n++){
-        retval = fputc(c, f);
-        if (retval == EOF) {
-            return -1;
+    __atomic_store_n(&logr->cfg, cfg, __ATOMIC_RELEASE);
+    logr_lock(logr);
+    if (cfg->rotate_interval != old->rotate_interval) {
+        if (cfg->rotate_interval != 0) {
+            _logr_rotate_period(logr, time(NULL));
+        } else {
+            logr->rotate_at = 0;
         }
     }
-    return n;
+    logr_unlock(logr);
+    pthread_mutex_unlock(&logr->cfg_lock);
+    _logr_cfg_free(old);
 }
 
-static int
-_logr_timestamp(const char *fmt, char specifier, FILE *f)
+/* Give up on a config made by _logr_cfg_edit(). */
+static void
+_logr_cfg_cancel(logr_t *logr, struct logr_cfg *cfg)
 {
-    int retval;
-    char buf[LOGR_MAX_TIMESTAMP_SIZE];
-    size_t size = LOGR_MAX_TIMESTAMP_SIZE;
-    struct tm tm, *_tm;
-    time_t t;
-    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    int tmp = errno;
 
-    time(&t);
+    pthread_mutex_unlock(&logr->cfg_lock);
+    _logr_cfg_free(cfg);
+    errno = tmp;
+}
 
-    if (specifier == 'd') {
-        return fprintf(f, "%ld", (long)t);
-    } else if (specifier == 'u') {
-        return fprintf(f, "%lu", (unsigned long)t);
-    } else if (specifier != 's') {
-        return 0;
+static void
+_logr_cfg_free(struct logr_cfg *cfg)
+{
+    if (cfg == &logr_default_cfg) {
+        return;
     }
+    free(cfg->prefix_fmt);
+    free(cfg->prefix);
+    _logr_tsfmt_free(cfg->tsfmt);
+    free(cfg->rotate_name);
+    free(cfg);
+}
 
-    pthread_mutex_lock(&lock);
-    /* don't use localtime_r since it's missing from mingw */
-    _tm = localtime(&t);
-    tm = *_tm;
-    pthread_mutex_unlock(&lock);
+int
+logr_set_timestamp_format(logr_t *logr, const char *fmt)
+{
+    struct logr_tsfmt *tsfmt;
+    struct logr_cfg *cfg;
+
+    if (logr == NULL || fmt == NULL) {
+        return _logr_errno(EINVAL);
+    }
 
-    if ((fmt == NULL) || (fmt[0] == 0)) {
+    if (fmt[0] == 0) {
         fmt = LOGR_DEFAULT_DATE_FORMAT;
     }
+    tsfmt = _logr_tsfmt_compile(fmt);
+    if (tsfmt == NULL) {
+        return -1;
+    }
 
-    retval = strftime(buf, size, fmt, &tm);
-    if (retval <= 0) {
+    cfg = _logr_cfg_edit(logr);
+    if (cfg == NULL) {
+        _logr_tsfmt_free(tsfmt);
         return -1;
     }
-    buf[LOGR_MAX_TIMESTAMP_SIZE-1] = 0;
+    _logr_tsfmt_free(cfg->tsfmt);
+    cfg->tsfmt = tsfmt;
+    _logr_cfg_publish(logr, cfg);
 
-    retval = _logr_fputs(buf, f);
-    if (retval < 0) {
+    return 0;
+}
+
+int
+logr_set_ops(logr_t *logr, logr_ops_t *ops)
+{
+    struct logr_cfg *cfg;
+
+    if (logr == NULL) {
         return -1;
     }
-    return retval;
+    if (ops == NULL) {
+        return 0;
+    }
+    cfg = _logr_cfg_edit(logr);
+    if (cfg == NULL) {
+        return -1;
+    }
+    cfg->ops = *ops;
+    /* back to the built-in renderer, which needs a format it knows */
+    if ((cfg->ops.prefix == NULL) && (cfg->prefix_fmt != NULL) &&
+            (cfg->prefix == NULL)) {
+        cfg->prefix = _logr_prefix_compile(cfg->prefix_fmt);
+        if (cfg->prefix == NULL) {
+            _logr_cfg_cancel(logr, cfg);
+            return -1;
+        }
+    }
+    _logr_cfg_publish(logr, cfg);
+    return 0;
+}
+
+/*
+ * Apply one line of a settings file to cfg.  Keys are named after the
+ * logr_set_*() functions, a level is returned in *level.
+ */
+static int
+_logr_cfg_set(struct logr_cfg *cfg, const char *key, const char *value,
+              int *level)
+{
+    struct logr_tsfmt *tsfmt;
+    char *copy, *end;
+    long long n;
+
+    if (strcmp(key, "prefix_format") == 0) {
+        return _logr_cfg_prefix(cfg, value);
+    }
+    if (strcmp(key, "timestamp_format") == 0) {
+        tsfmt = _logr_tsfmt_compile((value[0] != 0) ? value :
+                                    LOGR_DEFAULT_DATE_FORMAT);
+        if (tsfmt == NULL) {
+            return -1;
+        }
+        _logr_tsfmt_free(cfg->tsfmt);
+        cfg->tsfmt = tsfmt;
+        return 0;
+    }
+    if (strcmp(key, "rotate_name") == 0) {
+        copy = NULL;
+        if ((value[0] != 0) && ((copy = strdup(value)) == NULL)) {
+            return -1;
+        }
+        free(cfg->rotate_name);
+        cfg->rotate_name = copy;
+        return 0;
+    }
+    if ((strcmp(key, "level") == 0) &&
+            ((*level = logr_util_level(value)) >= 0)) {
+        return 0;
+    }
+
+    /* the rest are numbers */
+    errno = 0;
+    n = strtoll(value, &end, 10);
+    if ((errno != 0) || (end == value) || (*end != 0) || (n < 0)) {
+        return _logr_errno(EINVAL);
+    }
+    if ((strcmp(key, "level") == 0) && (n <= LOGR_DEBUG)) {
+        *level = n;
+    } else if (strcmp(key, "threshold") == 0) {
+        cfg->threshold = n;
+    } else if ((strcmp(key, "rotate_file_count") == 0) &&
+               (n <= MAX_ROTATE_FILES)) {
+        cfg->rotated_file_max = n;
+    } else if ((strcmp(key, "compress") == 0) && (n <= 9)) {
+#if !defined(HAVE_ZLIB) || defined(__WIN32)
+        if (n != 0) {
+            return _logr_errno(ENOTSUP);
+        }
+#endif
+        cfg->compress = n;
+    } else if ((strcmp(key, "rotate_interval") == 0) &&
+               (n <= LOGR_ROTATE_DAILY) &&
+               ((n == 0) || (LOGR_ROTATE_DAILY % n == 0))) {
+        cfg->rotate_interval = n;
+    } else {
+        return _logr_errno(EINVAL);
+    }
+    return 0;
 }
 
 int
-logr_util_process(LOGR_XARGV, logr_t *logr, int level, FILE *f,
-                  const char *field, size_t size, char specifier)
+logr_load_config(logr_t *logr, const char *path)
 {
-    /* call user specified conversion function, if applicable */
-
-    if (STREQ("file", field, size)) {
-        return (specifier == 's') ? _logr_fputs(file, f) : 0;
-    } else if (STREQ("line", field, size)) {
-        return (specifier == 'd') ? fprintf(f, "%d", line) : 0;
-    } else if (STREQ("func", field, size)) {
-        return (specifier == 's') ? _logr_fputs(func, f) : 0;
-    } else if (STREQ("pretty", field, size)) {
-        return (specifier == 's') ? _logr_fputs(pretty_func, f) : 0;
-    } else if (STREQ("level", field, size) || STREQ("priority", field, size)) {
-        if (specifier == 's') {
-            return _logr_fputs(logr_util_priority(logr, level), f);
-        } else if (specifier == 'd') {
-            return fprintf(f, "%d", level);
-        } else {
-            return 0;
+    struct logr_cfg *cfg;
+    char line[1024], *key, *value, *end;
+    int level = -1, retval = 0;
+    FILE *f;
+
+    if ((logr == NULL) || (path == NULL)) {
+        return _logr_errno(EINVAL);
+    }
+    f = fopen(path, "r");
+    if (f == NULL) {
+        return -1;
+    }
+    cfg = _logr_cfg_edit(logr);
+    if (cfg == NULL) {
+        fclose(f);
+        return -1;
+    }
+
+    while ((retval == 0) && (fgets(line, sizeof(line), f) != NULL)) {
+        end = line + strlen(line);
+        if ((end[-1] != '\n') && !feof(f)) {
+            retval = _logr_errno(EINVAL);
+            break;
+        }
+        key = line + strspn(line, " \t");
+        if ((*key == '#') || (*key == '\n') || (*key == 0)) {
+            continue;
+        }
+        value = strchr(key, '=');
+        if (value == NULL) {
+            retval = _logr_errno(EINVAL);
+            break;
+        }
+        /* trim the key and the value, and quotes around the value */
+        for (end = value; (end > key) && isspace((int)end[-1]); end--)
+            ;
+        *end = 0;
+        value += 1 + strspn(value + 1, " \t");
+        for (end = value + strlen(value);
+             (end > value) && isspace((int)end[-1]); end--)
+            ;
+        *end = 0;
+        if ((end - value >= 2) && (value[0] == '"') && (end[-1] == '"')) {
+            end[-1] = 0;
+            value++;
+        }
+        retval = _logr_cfg_set(cfg, key, value, &level);
+    }
+    if (ferror(f)) {
+        retval = -1;
+    }
+    fclose(f);
+
+    /* all or nothing */
+    if (retval < 0) {
+        _logr_cfg_cancel(logr, cfg);
+        return -1;
+    }
+    _logr_cfg_publish(logr, cfg);
+    if (level >= 0) {
+        logr_set_level(logr, level);
+    }
+    return 0;
+}
+
+#ifndef __WIN32
+/*
+ * The SIGHUP handler only writes to a pipe; a thread started on first use
+ * reads it and reloads the settings of every logger that asked for it.
+ */
+static pthread_mutex_t logr_reload_lock = PTHREAD_MUTEX_INITIALIZER;
+static logr_t *logr_reloads;
+static int logr_reload_pipe[2] = { -1, -1 };
+static struct sigaction logr_reload_prev;
+
+static void
+_logr_reload_signal(int sig, siginfo_t *info, void *ctx)
+{
+    int tmp = errno;
+    ssize_t n;
+
+    n = write(logr_reload_pipe[1], "", 1);
+    (void)n;
+    errno = tmp;
+
+    /* chain to the application's handler */
+    if (logr_reload_prev.sa_flags & SA_SIGINFO) {
+        if (logr_reload_prev.sa_sigaction != NULL) {
+            logr_reload_prev.sa_sigaction(sig, info, ctx);
+        }
+    } else if ((logr_reload_prev.sa_handler != SIG_DFL) &&
+               (logr_reload_prev.sa_handler != SIG_IGN)) {
+        logr_reload_prev.sa_handler(sig);
+    }
+}
+
+static void *
+_logr_reload(void *unused)
+{
+    char buf[64];
+    ssize_t n;
+    logr_t *l;
+
+    for (;;) {
+        n = read(logr_reload_pipe[0], buf, sizeof(buf));
+        if ((n < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        pthread_mutex_lock(&logr_reload_lock);
+        for (l = logr_reloads; l != NULL; l = l->reload_next) {
+            if (logr_load_config(l, l->reload_path) < 0) {
+                logr_xprintf(LOGR_XARGS, l, LOGR_ERR, "reloading %s: %s\n",
+                             l->reload_path, strerror(errno));
+            }
+        }
+        pthread_mutex_unlock(&logr_reload_lock);
+    }
+    return NULL;
+}
+
+/* Create the pipe, the thread and the handler.  With logr_reload_lock. */
+static int
+_logr_reload_start(void)
+{
+    struct sigaction sa;
+    pthread_t thread;
+    int retval;
+
+    if (pipe(logr_reload_pipe) != 0) {
+        return -1;
+    }
+    fcntl(logr_reload_pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(logr_reload_pipe[1], F_SETFD, FD_CLOEXEC);
+    /* the handler must never block */
+    fcntl(logr_reload_pipe[1], F_SETFL, O_NONBLOCK);
+
+    retval = pthread_create(&thread, NULL, _logr_reload, NULL);
+    if (retval != 0) {
+        close(logr_reload_pipe[0]);
+        close(logr_reload_pipe[1]);
+        logr_reload_pipe[0] = logr_reload_pipe[1] = -1;
+        return _logr_errno(retval);
+    }
+    pthread_detach(thread);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = _logr_reload_signal;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGHUP, &sa, &logr_reload_prev);
+    return 0;
+}
+#endif
+
+int
+logr_reload_on_sighup(logr_t *logr, const char *path)
+{
+#ifdef __WIN32
+    return _logr_errno(ENOTSUP);
+#else
+    char *copy = NULL;
+    logr_t **pl;
+
+    if (logr == NULL) {
+        return _logr_errno(EINVAL);
+    }
+    if (path != NULL) {
+        copy = strdup(path);
+        if (copy == NULL) {
+            return -1;
+        }
+        /* a bad file is reported now rather than on the first signal */
+        if (logr_load_config(logr, path) < 0) {
+            free(copy);
+            return -1;
+        }
+    }
+
+    pthread_mutex_lock(&logr_reload_lock);
+    if ((copy != NULL) && (logr_reload_pipe[0] < 0) &&
+            (_logr_reload_start() < 0)) {
+        pthread_mutex_unlock(&logr_reload_lock);
+        free(copy);
+        return -1;
+    }
+    for (pl = &logr_reloads; *pl != NULL; pl = &(*pl)->reload_next) {
+        if (*pl == logr) {
+            *pl = logr->reload_next;
+            break;
+        }
+    }
+    free(logr->reload_path);
+    logr->reload_path = copy;
+    if (copy != NULL) {
+        logr->reload_next = logr_reloads;
+        logr_reloads = logr;
+    }
+    pthread_mutex_unlock(&logr_reload_lock);
+    return 0;
+#endif
+}
+
+static bool
+_logr_exists(const char *path)
+{
+    struct stat st;
+
+    return stat(path, &st) == 0;
+}
+
+static int
+_logr_rename(const char *oldname, const char *newname)
+{
+#ifdef __WIN32
+    /*
+     * win32 fails with "File exists." if the newname exists during
+     * the rename.
+     */
+    unlink(newname);
+#endif
+
+    return rename(oldname, newname);
+}
+
+/*
+ * Shift the generations up by one: path.N-1 becomes path.N and so on,
+ * and 'first' becomes path.1.  A generation may have been compressed,
+ * in which case it keeps its .gz suffix; a stale copy under the other
+ * name is removed so each number only exists once.  Returns -1 if any
+ * rename failed.
+ */
+static int
+_logr_shift(const char *path, int count, const char *first)
+{
+    size_t len = strlen(path) + MAX_ROTATE_EXT_LEN + strlen(LOGR_GZ_EXT) + 1;
+    char newname[len];
+    char oldname[len];
+    size_t n;
+    int i, retval = 0;
+
+    for(i = count; i >= 1; i--) {
+        n = sprintf(newname, "%s.%d", path, i);
+        if (i == 1) {
+            unlink(strcat(newname, LOGR_GZ_EXT));
+            newname[n] = '\0';
+            if (_logr_rename(first, newname) != 0) {
+                retval = -1;
+            }
+            continue;
+        }
+
+        sprintf(oldname, "%s.%d%s", path, i-1, LOGR_GZ_EXT);
+        if (_logr_exists(oldname)) {
+            unlink(newname);
+            strcat(newname, LOGR_GZ_EXT);
+        } else {
+            oldname[strlen(oldname) - strlen(LOGR_GZ_EXT)] = '\0';
+            if (!_logr_exists(oldname)) {
+                continue;
+            }
+            unlink(strcat(newname, LOGR_GZ_EXT));
+            newname[n] = '\0';
+        }
+        if (_logr_rename(oldname, newname) != 0) {
+            retval = -1;
+        }
+    }
+    return retval;
+}
+
+int
+_logr_rotatelog(logr_t *logr)
+{
+    if (logr->rotate_file_count < _logr_cfg(logr)->rotated_file_max) {
+        logr->rotate_file_count++;
+    }
+    return _logr_shift(logr->path, logr->rotate_file_count, logr->path);
+}
+
+static __thread struct logr_buf logr_tls_buf;
+#ifndef __WIN32
+static pthread_key_t logr_tls_key;
+static pthread_once_t logr_tls_once = PTHREAD_ONCE_INIT;
+
+static void
+_logr_tls_free(void *arg)
+{
+    free(((struct logr_buf *)arg)->data);
+}
+
+static void
+_logr_tls_init(void)
+{
+    pthread_key_create(&logr_tls_key, _logr_tls_free);
+}
+#endif
+
+/* Returns this thread's (empty) render buffer. */
+static struct logr_buf *
+_logr_tls(void)
+{
+    struct logr_buf *b = &logr_tls_buf;
+
+#ifndef __WIN32
+    if (b->data == NULL) {
+        /* release the buffer when the thread exits */
+        pthread_once(&logr_tls_once, _logr_tls_init);
+        pthread_setspecific(logr_tls_key, b);
+    }
+#endif
+    b->len = 0;
+    return b;
+}
+
+/* Make room for n more bytes. */
+static int
+_logr_buf_grow(struct logr_buf *b, size_t n)
+{
+    size_t size;
+    char *data;
+
+    if (b->len + n <= b->size) {
+        return 0;
+    }
+    size = (b->size != 0) ? b->size : LOGR_BUF_SIZE;
+    while (size < b->len + n) {
+        size *= 2;
+    }
+    data = (char *)realloc(b->data, size);
+    if (data == NULL) {
+        return _logr_errno(ENOMEM);
+    }
+    b->data = data;
+    b->size = size;
+    return 0;
+}
+
+static int
+_logr_buf_put(struct logr_buf *b, const char *p, size_t n)
+{
+    if (_logr_buf_grow(b, n) < 0) {
+        return -1;
+    }
+    memcpy(b->data + b->len, p, n);
+    b->len += n;
+    return n;
+}
+
+static int
+_logr_buf_puts(struct logr_buf *b, const char *p)
+{
+    return _logr_buf_put(b, p, strlen(p));
+}
+
+/* fputs() equivalent for integers, avoiding printf's format parsing. */
+static int
+_logr_buf_putd(struct logr_buf *b, long long v)
+{
+    char buf[24], *p = buf + sizeof(buf);
+    unsigned long long u = (v < 0) ? -(unsigned long long)v :
+                           (unsigned long long)v;
+
+    do {
+        *--p = '0' + (u % 10);
+        u /= 10;
+    } while (u != 0);
+    if (v < 0) {
+        *--p = '-';
+    }
+    return _logr_buf_put(b, p, buf + sizeof(buf) - p);
+}
+
+static int
+_logr_buf_vprintf(struct logr_buf *b, const char *fmt, va_list ap)
+{
+    va_list aq;
+    int n;
+
+    if (_logr_buf_grow(b, LOGR_BUF_SIZE / 4) < 0) {
+        return -1;
+    }
+    for (;;) {
+        va_copy(aq, ap);
+        n = vsnprintf(b->data + b->len, b->size - b->len, fmt, aq);
+        va_end(aq);
+        if (n < 0) {
+            return -1;
+        }
+        if ((size_t)n < b->size - b->len) {
+            b->len += n;
+            return n;
+        }
+        if (_logr_buf_grow(b, n + 1) < 0) {
+            return -1;
+        }
+    }
+}
+
+/* Zero padded sub-second digits of ts, 3 for msec or 6 for usec. */
+static void
+_logr_subsec(char *p, int digits, const struct timespec *ts)
+{
+    long v = ts->tv_nsec / ((digits == 3) ? 1000000 : 1000);
+
+    while (digits-- > 0) {
+        p[digits] = '0' + (v % 10);
+        v /= 10;
+    }
+}
+
+/*
+ * strftime() every segment for the given second into buf, leaving room for
+ * the sub-second digits and recording their offsets.  Returns the length.
+ */
+static size_t
+_logr_ts_build(const struct logr_tsfmt *tf, time_t sec, char *buf,
+               size_t *off)
+{
+    struct tm tm;
+    size_t n = 0;
+    int i;
+
+    _logr_localtime(sec, &tm);
+
+    for (i = 0; i < tf->count; i++) {
+        if (tf->seg[i].fmt[0] != 0) {
+            n += strftime(buf + n, LOGR_MAX_TIMESTAMP_SIZE - n,
+                          tf->seg[i].fmt, &tm);
+        }
+        off[i] = n;
+        if (tf->seg[i].digits != 0) {
+            if (n + tf->seg[i].digits >= LOGR_MAX_TIMESTAMP_SIZE) {
+                break;
+            }
+            memset(buf + n, '0', tf->seg[i].digits);
+            n += tf->seg[i].digits;
+        }
+    }
+    return n;
+}
+
+static int
+_logr_timestamp(struct logr_tsfmt *tf, const struct timespec *ts,
+                struct logr_buf *b)
+{
+    size_t len, off[LOGR_MAX_TS_SEGMENTS];
+    unsigned int seq;
+    char *dst;
+    int i;
+
+    if (_logr_buf_grow(b, LOGR_MAX_TIMESTAMP_SIZE) < 0) {
+        return -1;
+    }
+    dst = b->data + b->len;
+
+    seq = __atomic_load_n(&tf->seq, __ATOMIC_ACQUIRE);
+    if (((seq & 1) == 0) &&
+        (__atomic_load_n(&tf->sec, __ATOMIC_RELAXED) == ts->tv_sec)) {
+        len = tf->len;
+        memcpy(dst, tf->buf, len);
+        memcpy(off, tf->off, sizeof(off));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&tf->seq, __ATOMIC_RELAXED) != seq) {
+            /* raced with a rebuild */
+            len = _logr_ts_build(tf, ts->tv_sec, dst, off);
+        }
+    } else if (((seq & 1) == 0) &&
+               (ts->tv_sec > __atomic_load_n(&tf->sec, __ATOMIC_RELAXED)) &&
+               __atomic_compare_exchange_n(&tf->seq, &seq, seq + 1, false,
+                                           __ATOMIC_ACQUIRE,
+                                           __ATOMIC_RELAXED)) {
+        /*
+         * A new second: rebuild the cache for everybody, from our own copy
+         * since the next second may rebuild it as soon as it's published.
+         */
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        len = _logr_ts_build(tf, ts->tv_sec, dst, off);
+        tf->len = len;
+        memcpy(tf->buf, dst, len);
+        memcpy(tf->off, off, sizeof(off));
+        __atomic_store_n(&tf->sec, ts->tv_sec, __ATOMIC_RELAXED);
+        __atomic_store_n(&tf->seq, seq + 2, __ATOMIC_RELEASE);
+    } else {
+        /* somebody else is rebuilding or this is an older entry */
+        len = _logr_ts_build(tf, ts->tv_sec, dst, off);
+    }
+
+    for (i = 0; i < tf->count; i++) {
+        if ((tf->seg[i].digits != 0) &&
+            (off[i] + tf->seg[i].digits <= len)) {
+            _logr_subsec(dst + off[i], tf->seg[i].digits, ts);
+        }
+    }
+    b->len += len;
+    return len;
+}
+
+/* Render the prefix for one entry by walking the compiled ops. */
+static int
+_logr_prefix_run(const struct logr_prefix *prog,
+                 const struct logr_record *rec, logr_t *logr,
+                 struct logr_buf *b)
+{
+    const struct logr_op *op, *end = prog->op + prog->count;
+    struct logr_tsfmt *tsfmt;
+    int retval, total = 0;
+
+    for (op = prog->op; op < end; op++) {
+        switch (op->code) {
+        case LOGR_OP_LITERAL:
+            retval = _logr_buf_put(b, op->str, op->len);
+            break;
+        case LOGR_OP_FILE:
+            retval = _logr_buf_puts(b, rec->file);
+            break;
+        case LOGR_OP_LINE:
+            retval = _logr_buf_putd(b, rec->line);
+            break;
+        case LOGR_OP_FUNC:
+            retval = _logr_buf_puts(b, rec->func);
+            break;
+        case LOGR_OP_PRETTY:
+            retval = _logr_buf_puts(b, rec->pretty_func);
+            break;
+        case LOGR_OP_LEVEL_S:
+            retval = _logr_buf_puts(b, logr_util_priority(logr, rec->level));
+            break;
+        case LOGR_OP_LEVEL_D:
+            retval = _logr_buf_putd(b, rec->level);
+            break;
+        case LOGR_OP_PID:
+            retval = _logr_buf_putd(b, (rec->pid != 0) ? rec->pid : getpid());
+            break;
+        case LOGR_OP_TIMESTAMP_S:
+            tsfmt = _logr_cfg(logr)->tsfmt;
+            retval = _logr_timestamp((tsfmt != NULL) ? tsfmt :
+                                     &logr_default_tsfmt, &rec->ts, b);
+            break;
+        case LOGR_OP_TIMESTAMP_D:
+        case LOGR_OP_TIMESTAMP_U:
+            retval = _logr_buf_putd(b, (long)rec->ts.tv_sec);
+            break;
+        case LOGR_OP_MSEC:
+        case LOGR_OP_USEC:
+            if (_logr_buf_grow(b, 6) < 0) {
+                return -1;
+            }
+            retval = (op->code == LOGR_OP_MSEC) ? 3 : 6;
+            _logr_subsec(b->data + b->len, retval, &rec->ts);
+            b->len += retval;
+            break;
+        default:
+            retval = 0;
+            break;
+        }
+        if (retval < 0) {
+            return -1;
+        }
+        total += retval;
+    }
+    return total;
+}
+
+int
+logr_util_process(LOGR_XARGV, logr_t *logr, int level, FILE *f,
+                  const char *field, size_t size, char specifier)
+{
+    struct logr_op op;
+    struct logr_prefix prog = { .count = 1, .op = &op };
+    struct logr_record rec = {
+        .file = file, .line = line, .func = func, .pretty_func = pretty_func,
+        .level = level
+    };
+    struct logr_buf b = { NULL, 0, 0 };
+    int code, retval;
+
+    code = _logr_field_code(field, size, specifier);
+    if (code < 0) {
+        return 0;
+    }
+    op.code = (enum logr_opcode)code;
+    _logr_now(&rec.ts);
+    retval = _logr_prefix_run(&prog, &rec, logr, &b);
+    if ((retval > 0) && (fwrite(b.data, 1, b.len, f) != b.len)) {
+        retval = -1;
+    }
+    free(b.data);
+    return retval;
+}
+
+/*
+ * Run a user supplied prefix function.  Those print to a FILE so give them
+ * a memory stream and copy the result into the render buffer.
+ */
+static int
+_logr_prefix_user(const struct logr_record *rec, logr_t *logr,
+                  const struct logr_cfg *cfg, struct logr_buf *b)
+{
+    int retval;
+    FILE *f;
+#ifdef HAVE_OPEN_MEMSTREAM
+    char *p = NULL;
+    size_t n = 0;
+
+    f = open_memstream(&p, &n);
+#else
+    char chunk[LOGR_BUF_SIZE];
+    size_t n;
+
+    f = tmpfile();
+#endif
+    if (f == NULL) {
+        return -1;
+    }
+
+    retval = cfg->ops.prefix(_RXARGS, logr, rec->level, f, cfg->prefix_fmt);
+
+#ifdef HAVE_OPEN_MEMSTREAM
+    fclose(f);
+    if ((retval >= 0) && (_logr_buf_put(b, p, n) < 0)) {
+        retval = -1;
+    }
+    free(p);
+#else
+    rewind(f);
+    while ((retval >= 0) && ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)) {
+        if (_logr_buf_put(b, chunk, n) < 0) {
+            retval = -1;
+        }
+    }
+    fclose(f);
+#endif
+    return retval;
+}
+
+static inline int
+_logr_util_prefix(const struct logr_record *rec, logr_t *logr,
+                  struct logr_buf *b)
+{
+    const struct logr_cfg *cfg = _logr_cfg(logr);
+
+    if (cfg->ops.prefix != NULL) {
+        return _logr_prefix_user(rec, logr, cfg, b);
+    }
+    if (cfg->prefix != NULL) {
+        return _logr_prefix_run(cfg->prefix, rec, logr, b);
+    }
+    return 0;
+}
+
+/*
+ * Structured entries, see logr_kv().
+ *
+ * The caller's message and pairs are encoded when the entry is made, like
+ * a formatted message; the prefix fields are encoded as keys when the
+ * entry is written, in place of the prefix.  rec->kv says which format
+ * the two halves are in.
+ */
+static const struct {
+    const char *key;
+    unsigned int len;
+    unsigned int bit;         /* fields sharing a key share a bit */
+} logr_kv_fields[] = {
+    [LOGR_OP_FILE] = { _LOGR_KV_KEY("file"), 0x01 },
+    [LOGR_OP_LINE] = { _LOGR_KV_KEY("line"), 0x02 },
+    [LOGR_OP_FUNC] = { _LOGR_KV_KEY("func"), 0x04 },
+    [LOGR_OP_PRETTY] = { _LOGR_KV_KEY("pretty"), 0x08 },
+    [LOGR_OP_LEVEL_S] = { _LOGR_KV_KEY("level"), 0x10 },
+    [LOGR_OP_LEVEL_D] = { _LOGR_KV_KEY("level"), 0x10 },
+    [LOGR_OP_PID] = { _LOGR_KV_KEY("pid"), 0x20 },
+    [LOGR_OP_TIMESTAMP_S] = { _LOGR_KV_KEY("timestamp"), 0x40 },
+    [LOGR_OP_TIMESTAMP_D] = { _LOGR_KV_KEY("timestamp"), 0x40 },
+    [LOGR_OP_TIMESTAMP_U] = { _LOGR_KV_KEY("timestamp"), 0x40 },
+    [LOGR_OP_MSEC] = { _LOGR_KV_KEY("msec"), 0x80 },
+    [LOGR_OP_USEC] = { _LOGR_KV_KEY("usec"), 0x100 },
+};
+
+/* Append a key, given in its JSON form "key":, as JSON or as logfmt key=. */
+static inline int
+_logr_kv_key(struct logr_buf *b, bool json, const char *key, size_t len)
+{
+    if (json) {
+        return _logr_buf_put(b, key, len);
+    }
+    if ((_logr_buf_put(b, key + 1, len - 3) < 0) ||
+            (_logr_buf_put(b, "=", 1) < 0)) {
+        return -1;
+    }
+    return len - 2;
+}
+
+/* Append s as a JSON string, or as a logfmt value quoted when it must be. */
+static int
+_logr_kv_str(struct logr_buf *b, bool json, const char *s, size_t n)
+{
+    static const char hex[] = "0123456789abcdef";
+    const char *p, *run = s, *end = s + n;
+    char u[6] = { '\\', 'u', '0', '0' };
+    bool quote = json || (n == 0);
+    unsigned char c;
+    int retval;
+
+    for (p = s; !quote && (p < end); p++) {
+        c = (unsigned char)*p;
+        quote = (c <= ' ') || (c == '"') || (c == '=') || (c == '\\') ||
+                (c == 0x7f);
+    }
+    if (!quote) {
+        return _logr_buf_put(b, s, n);
+    }
+
+    if (_logr_buf_put(b, "\"", 1) < 0) {
+        return -1;
+    }
+    for (p = s; p < end; p++) {
+        c = (unsigned char)*p;
+        if ((c >= ' ') && (c != '"') && (c != '\\')) {
+            continue;
+        }
+        if (_logr_buf_put(b, run, p - run) < 0) {
+            return -1;
+        }
+        switch (c) {
+        case '"':
+            retval = _logr_buf_put(b, "\\\"", 2);
+            break;
+        case '\\':
+            retval = _logr_buf_put(b, "\\\\", 2);
+            break;
+        case '\n':
+            retval = _logr_buf_put(b, "\\n", 2);
+            break;
+        case '\r':
+            retval = _logr_buf_put(b, "\\r", 2);
+            break;
+        case '\t':
+            retval = _logr_buf_put(b, "\\t", 2);
+            break;
+        default:
+            u[4] = hex[c >> 4];
+            u[5] = hex[c & 0xf];
+            retval = _logr_buf_put(b, u, sizeof(u));
+            break;
+        }
+        if (retval < 0) {
+            return -1;
+        }
+        run = p + 1;
+    }
+    if ((_logr_buf_put(b, run, end - run) < 0) ||
+            (_logr_buf_put(b, "\"", 1) < 0)) {
+        return -1;
+    }
+    return 0;
+}
+
+static inline int
+_logr_kv_cstr(struct logr_buf *b, bool json, const char *s)
+{
+    return _logr_kv_str(b, json, s, strlen(s));
+}
+
+/*
+ * Encode the fields of the logger's prefix format as the first pairs of a
+ * structured entry.  Must be called with logr->lock.
+ */
+static int
+_logr_kv_prefix(const struct logr_record *rec, logr_t *logr,
+                struct logr_buf *b)
+{
+    const struct logr_cfg *cfg = _logr_cfg(logr);
+    const struct logr_op *op, *end;
+    bool json = (rec->kv == LOGR_KV_JSON);
+    char ts[LOGR_MAX_TIMESTAMP_SIZE];
+    size_t start = b->len, pos;
+    unsigned int seen = 0;
+    int retval;
+
+    if (json && (_logr_buf_put(b, "{", 1) < 0)) {
+        return -1;
+    }
+    if (cfg->prefix == NULL) {
+        return b->len - start;
+    }
+
+    end = cfg->prefix->op + cfg->prefix->count;
+    for (op = cfg->prefix->op; op < end; op++) {
+        if ((op->code == LOGR_OP_LITERAL) ||
+                (seen & logr_kv_fields[op->code].bit)) {
+            continue;
+        }
+        seen |= logr_kv_fields[op->code].bit;
+        if (_logr_kv_key(b, json, logr_kv_fields[op->code].key,
+                         logr_kv_fields[op->code].len) < 0) {
+            return -1;
+        }
+        switch (op->code) {
+        case LOGR_OP_FILE:
+            retval = _logr_kv_cstr(b, json, rec->file);
+            break;
+        case LOGR_OP_LINE:
+            retval = _logr_buf_putd(b, rec->line);
+            break;
+        case LOGR_OP_FUNC:
+            retval = _logr_kv_cstr(b, json, rec->func);
+            break;
+        case LOGR_OP_PRETTY:
+            retval = _logr_kv_cstr(b, json, rec->pretty_func);
+            break;
+        case LOGR_OP_LEVEL_S:
+            retval = _logr_kv_cstr(b, json,
+                                   logr_util_priority(logr, rec->level));
+            break;
+        case LOGR_OP_LEVEL_D:
+            retval = _logr_buf_putd(b, rec->level);
+            break;
+        case LOGR_OP_PID:
+            retval = _logr_buf_putd(b, (rec->pid != 0) ? rec->pid : getpid());
+            break;
+        case LOGR_OP_TIMESTAMP_S:
+            /* render it in place, then again escaped */
+            pos = b->len;
+            retval = _logr_timestamp((cfg->tsfmt != NULL) ? cfg->tsfmt :
+                                     &logr_default_tsfmt, &rec->ts, b);
+            if (retval >= 0) {
+                retval = b->len - pos;
+                memcpy(ts, b->data + pos, retval);
+                b->len = pos;
+                retval = _logr_kv_str(b, json, ts, retval);
+            }
+            break;
+        case LOGR_OP_TIMESTAMP_D:
+        case LOGR_OP_TIMESTAMP_U:
+            retval = _logr_buf_putd(b, (long)rec->ts.tv_sec);
+            break;
+        case LOGR_OP_MSEC:
+            retval = _logr_buf_putd(b, rec->ts.tv_nsec / 1000000);
+            break;
+        case LOGR_OP_USEC:
+            retval = _logr_buf_putd(b, rec->ts.tv_nsec / 1000);
+            break;
+        default:
+            retval = 0;
+            break;
+        }
+        if ((retval < 0) || (_logr_buf_put(b, json ? "," : " ", 1) < 0)) {
+            return -1;
+        }
+    }
+    return b->len - start;
+}
+
+/* Encode the message and pairs of a structured entry, the rest of it. */
+static int
+_logr_kv_body(struct logr_buf *b, int format, const char *msg,
+              const struct logr_kv *kv, size_t count)
+{
+    bool json = (format == LOGR_KV_JSON);
+    size_t start = b->len, i;
+    char tmp[32];
+    int retval;
+
+    if ((_logr_kv_key(b, json, "\"msg\":", 6) < 0) ||
+            (_logr_kv_cstr(b, json, (msg != NULL) ? msg : "") < 0)) {
+        return -1;
+    }
+    for (i = 0; i < count; i++, kv++) {
+        if ((_logr_buf_put(b, json ? "," : " ", 1) < 0) ||
+                (_logr_kv_key(b, json, kv->key, kv->len) < 0)) {
+            return -1;
+        }
+        switch (kv->type) {
+        case _LOGR_KV_STR:
+            if (kv->s != NULL) {
+                retval = _logr_kv_cstr(b, json, kv->s);
+            } else {
+                retval = _logr_buf_puts(b, json ? "null" : "");
+            }
+            break;
+        case _LOGR_KV_INT:
+            retval = _logr_buf_putd(b, kv->i);
+            break;
+        case _LOGR_KV_BOOL:
+            retval = _logr_buf_puts(b, kv->i ? "true" : "false");
+            break;
+        case _LOGR_KV_DOUBLE:
+            if (json && (kv->d - kv->d != 0)) {
+                /* NaN and the infinities have no JSON form */
+                retval = _logr_buf_puts(b, "null");
+            } else {
+                snprintf(tmp, sizeof(tmp), "%.15g", kv->d);
+                retval = _logr_buf_puts(b, tmp);
+            }
+            break;
+        default:
+            return _logr_errno(EINVAL);
+        }
+        if (retval < 0) {
+            return -1;
+        }
+    }
+    if (_logr_buf_puts(b, json ? "}\n" : "\n") < 0) {
+        return -1;
+    }
+    return b->len - start;
+}
+
+/* write(2) all of p, retrying on short writes and signals. */
+static int
+_logr_write(int fd, const char *p, size_t n)
+{
+    ssize_t retval;
+
+    while (n > 0) {
+        retval = write(fd, p, n);
+        if (retval < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        p += retval;
+        n -= retval;
+    }
+    return 0;
+}
+
+#ifdef LOGR_IO_URING
+/*
+ * io_uring writer.
+ *
+ * Entries are copied into one of a few buffers registered with the kernel
+ * and queued as a write on a ring owned by the logger.  A write queued
+ * while others are in flight is marked IOSQE_IO_DRAIN, so it only starts
+ * once they have completed: the file stays in order without the caller
+ * waiting.  Completions are collected on the next write and a buffer is
+ * reused once its write is done.  The ring is only used with logr->lock
+ * held.
+ */
+#define LOGR_URING_BUFS 8
+#define LOGR_URING_SYNC (~(uint64_t)0)  /* user_data of fdatasync requests */
+
+struct logr_uring {
+    int fd;                   /* of the ring */
+    unsigned int flags;       /* LOGR_IO_URING_xxx in effect */
+    bool fixed;               /* the buffers are registered */
+    unsigned int pending;     /* requests queued but not completed */
+    int error;                /* of a failed request, reported once */
+    unsigned int next;        /* buffer to fill next */
+    bool busy[LOGR_URING_BUFS];
+    size_t len[LOGR_URING_BUFS];
+    size_t off[LOGR_URING_BUFS]; /* of len, written already */
+    int file[LOGR_URING_BUFS];   /* descriptor the buffer goes to */
+    char *mem;                /* the buffers, LOGR_BATCH_SIZE bytes each */
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;            /* may be sq_ring */
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_flags;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+static logr_t *logr_urings;
+static pthread_mutex_t logr_urings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread bool logr_tls_uring;    /* this thread queued writes */
+static pthread_key_t logr_uring_key;
+static pthread_once_t logr_uring_once = PTHREAD_ONCE_INIT;
+
+/*
+ * The kernel fails or cancels the requests of a thread that exits, so a
+ * thread that queued writes waits for them first.
+ */
+static void
+_logr_uring_exit(void *unused)
+{
+    logr_t *l;
+
+    pthread_mutex_lock(&logr_urings_lock);
+    for (l = logr_urings; l != NULL; l = l->uring_next) {
+        logr_lock(l);
+        _logr_uring_wait(l);
+        logr_unlock(l);
+    }
+    pthread_mutex_unlock(&logr_urings_lock);
+}
+
+static void
+_logr_uring_init(void)
+{
+    pthread_key_create(&logr_uring_key, _logr_uring_exit);
+}
+
+static int
+_logr_uring_enter(struct logr_uring *u, unsigned int min_complete,
+                  unsigned int flags)
+{
+    unsigned int submit;
+
+    submit = *u->sq_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    if (u->flags & LOGR_IO_URING_SQPOLL) {
+        /* the kernel thread submits, it may only need waking up */
+        submit = 0;
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(u->sq_flags, __ATOMIC_RELAXED) &
+                IORING_SQ_NEED_WAKEUP) {
+            flags |= IORING_ENTER_SQ_WAKEUP;
+        }
+        if (flags == 0) {
+            return 0;
+        }
+    }
+    return (int)syscall(__NR_io_uring_enter, u->fd, submit, min_complete,
+                        flags, NULL, 0);
+}
+
+static void
+_logr_uring_free(struct logr_uring *u)
+{
+    int tmp = errno;
+
+    if (u->sqes != NULL) {
+        munmap(u->sqes, u->sqes_size);
+    }
+    if ((u->cq_ring != NULL) && (u->cq_ring != u->sq_ring)) {
+        munmap(u->cq_ring, u->cq_ring_size);
+    }
+    if (u->sq_ring != NULL) {
+        munmap(u->sq_ring, u->sq_ring_size);
+    }
+    if (u->fd >= 0) {
+        close(u->fd);
+    }
+    free(u->mem);
+    free(u);
+    errno = tmp;
+}
+
+/* Whether the kernel knows the requests used here. */
+static bool
+_logr_uring_probe(int fd)
+{
+    struct io_uring_probe *p;
+    size_t n = IORING_OP_LAST;
+    bool ok;
+
+    p = (struct io_uring_probe *)calloc(1, sizeof(struct io_uring_probe) +
+                                        n * sizeof(struct io_uring_probe_op));
+    if (p == NULL) {
+        return false;
+    }
+    ok = (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, p,
+                  n) == 0) &&
+        (p->last_op >= IORING_OP_WRITE) &&
+        (p->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED) &&
+        (p->ops[IORING_OP_WRITE_FIXED].flags & IO_URING_OP_SUPPORTED) &&
+        (p->ops[IORING_OP_FSYNC].flags & IO_URING_OP_SUPPORTED);
+    free(p);
+    return ok;
+}
+
+static void *
+_logr_uring_map(int fd, size_t size, off_t offset)
+{
+    void *p;
+
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+             fd, offset);
+    return (p == MAP_FAILED) ? NULL : p;
+}
+
+static struct logr_uring *
+_logr_uring_alloc(unsigned int flags)
+{
+    struct io_uring_params p;
+    struct iovec iov[LOGR_URING_BUFS];
+    struct logr_uring *u;
+    char *ring;
+    int i;
+
+    u = (struct logr_uring *)calloc(1, sizeof(struct logr_uring));
+    if (u == NULL) {
+        return NULL;
+    }
+    u->flags = flags;
+
+    for (;;) {
+        memset(&p, 0, sizeof(p));
+        if (u->flags & LOGR_IO_URING_SQPOLL) {
+            p.flags = IORING_SETUP_SQPOLL;
+            p.sq_thread_idle = 1000;
+        }
+        u->fd = (int)syscall(__NR_io_uring_setup, 2 * LOGR_URING_BUFS, &p);
+        if ((u->fd >= 0) && (p.flags & IORING_SETUP_SQPOLL) &&
+                !(p.features & IORING_FEAT_SQPOLL_NONFIXED)) {
+            /* older kernels only poll registered files */
+            close(u->fd);
+            u->fd = -1;
+        }
+        if ((u->fd >= 0) || !(u->flags & LOGR_IO_URING_SQPOLL)) {
+            break;
+        }
+        /* not allowed to poll, submitting with a system call still works */
+        u->flags &= ~LOGR_IO_URING_SQPOLL;
+    }
+    if ((u->fd < 0) || !(p.features & IORING_FEAT_NODROP) ||
+            !(p.features & IORING_FEAT_RW_CUR_POS) ||
+            !_logr_uring_probe(u->fd)) {
+        if ((u->fd >= 0) || (errno != ENOMEM)) {
+            errno = ENOTSUP;
+        }
+        goto fail;
+    }
+
+    u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    u->cq_ring_size = p.cq_off.cqes +
+        p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_ring_size > u->sq_ring_size) {
+            u->sq_ring_size = u->cq_ring_size;
+        }
+        u->sq_ring = _logr_uring_map(u->fd, u->sq_ring_size,
+                                     IORING_OFF_SQ_RING);
+        u->cq_ring = u->sq_ring;
+    } else {
+        u->sq_ring = _logr_uring_map(u->fd, u->sq_ring_size,
+                                     IORING_OFF_SQ_RING);
+        u->cq_ring = _logr_uring_map(u->fd, u->cq_ring_size,
+                                     IORING_OFF_CQ_RING);
+    }
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = (struct io_uring_sqe *)_logr_uring_map(u->fd, u->sqes_size,
+                                                     IORING_OFF_SQES);
+    if ((u->sq_ring == NULL) || (u->cq_ring == NULL) || (u->sqes == NULL)) {
+        goto fail;
+    }
+    ring = (char *)u->sq_ring;
+    u->sq_head = (unsigned int *)(ring + p.sq_off.head);
+    u->sq_tail = (unsigned int *)(ring + p.sq_off.tail);
+    u->sq_mask = (unsigned int *)(ring + p.sq_off.ring_mask);
+    u->sq_flags = (unsigned int *)(ring + p.sq_off.flags);
+    u->sq_array = (unsigned int *)(ring + p.sq_off.array);
+    ring = (char *)u->cq_ring;
+    u->cq_head = (unsigned int *)(ring + p.cq_off.head);
+    u->cq_tail = (unsigned int *)(ring + p.cq_off.tail);
+    u->cq_mask = (unsigned int *)(ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+
+    u->mem = (char *)malloc(LOGR_URING_BUFS * LOGR_BATCH_SIZE);
+    if (u->mem == NULL) {
+        goto fail;
+    }
+    for (i = 0; i < LOGR_URING_BUFS; i++) {
+        iov[i].iov_base = u->mem + i * LOGR_BATCH_SIZE;
+        iov[i].iov_len = LOGR_BATCH_SIZE;
+    }
+    /* plain writes still work when the memory lock limit is too low */
+    u->fixed = (syscall(__NR_io_uring_register, u->fd,
+                        IORING_REGISTER_BUFFERS, iov, LOGR_URING_BUFS) == 0);
+    return u;
+
+fail:
+    _logr_uring_free(u);
+    return NULL;
+}
+
+static int _logr_uring_submit(struct logr_uring *u, int fd, unsigned int i);
+
+/*
+ * Collect completed requests, waiting until no more than left are still
+ * pending.
+ */
+static int
+_logr_uring_reap(struct logr_uring *u, unsigned int left)
+{
+    struct io_uring_cqe *cqe;
+    unsigned int head, tail, i;
+    int res;
+
+    for (;;) {
+        head = *u->cq_head;
+        tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            cqe = &u->cqes[head & *u->cq_mask];
+            res = cqe->res;
+            u->pending--;
+            /* a linked fdatasync is cancelled when its write failed */
+            if ((res < 0) && (res != -ECANCELED) && (u->error == 0)) {
+                u->error = -res;
+            }
+            if (cqe->user_data == LOGR_URING_SYNC) {
+                continue;
+            }
+            i = cqe->user_data;
+            if (res < 0) {
+                u->busy[i] = false;
+                continue;
+            }
+            u->off[i] += res;
+            if (u->off[i] == u->len[i]) {
+                u->busy[i] = false;
+            } else if (res == 0) {
+                u->busy[i] = false;
+                if (u->error == 0) {
+                    u->error = EIO;
+                }
+            } else {
+                /*
+                 * Regular files fall short when they are out of space or
+                 * the write was interrupted: write the rest, as
+                 * _logr_write() does, after what is in flight already.
+                 * It stays queued if submitting fails, for the next call.
+                 */
+                (void)_logr_uring_submit(u, u->file[i], i);
+            }
+        }
+        __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+
+        if (u->pending <= left) {
+            return 0;
+        }
+        if ((_logr_uring_enter(u, 1, IORING_ENTER_GETEVENTS) < 0) &&
+                (errno != EINTR)) {
+            return -1;
+        }
+    }
+}
+
+/*
+ * Queue a write of what buffer i holds past off[i] to fd, followed by
+ * fdatasync if asked.
+ */
+static int
+_logr_uring_submit(struct logr_uring *u, int fd, unsigned int i)
+{
+    unsigned int tail = *u->sq_tail;
+    unsigned int mask = *u->sq_mask;
+    struct io_uring_sqe *sqe;
+
+    sqe = &u->sqes[tail & mask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = u->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->flags = (u->pending != 0) ? IOSQE_IO_DRAIN : 0;
+    sqe->fd = fd;
+    sqe->off = (uint64_t)-1;  /* the file position, O_APPEND anyway */
+    sqe->addr = (uintptr_t)(u->mem + i * LOGR_BATCH_SIZE + u->off[i]);
+    sqe->len = u->len[i] - u->off[i];
+    sqe->buf_index = i;
+    sqe->user_data = i;
+    u->sq_array[tail & mask] = tail & mask;
+    tail++;
+    u->pending++;
+
+    if (u->flags & LOGR_IO_URING_DATASYNC) {
+        sqe->flags |= IOSQE_IO_LINK;
+        sqe = &u->sqes[tail & mask];
+        memset(sqe, 0, sizeof(struct io_uring_sqe));
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fd = fd;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        sqe->user_data = LOGR_URING_SYNC;
+        u->sq_array[tail & mask] = tail & mask;
+        tail++;
+        u->pending++;
+    }
+    u->busy[i] = true;
+    u->file[i] = fd;
+    __atomic_store_n(u->sq_tail, tail, __ATOMIC_RELEASE);
+
+    /* requests left in the ring by a failure go with the next call */
+    while (_logr_uring_enter(u, 0, 0) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Queue n bytes for writing to fd, only waiting when every buffer is in
+ * flight.  Also fails if an earlier write did.
+ */
+static int
+_logr_uring_write(struct logr_uring *u, int fd, const char *p, size_t n)
+{
+    unsigned int i;
+    size_t len;
+
+    if (!logr_tls_uring) {
+        pthread_once(&logr_uring_once, _logr_uring_init);
+        pthread_setspecific(logr_uring_key, (void *)1);
+        logr_tls_uring = true;
+    }
+    if (_logr_uring_reap(u, u->pending) < 0) {
+        return -1;
+    }
+    while (n > 0) {
+        i = u->next;
+        while (u->busy[i]) {
+            /* writes complete in order, so this buffer is next */
+            if (_logr_uring_reap(u, u->pending - 1) < 0) {
+                return -1;
+            }
+        }
+        len = (n < LOGR_BATCH_SIZE) ? n : LOGR_BATCH_SIZE;
+        memcpy(u->mem + i * LOGR_BATCH_SIZE, p, len);
+        u->len[i] = len;
+        u->off[i] = 0;
+        if (_logr_uring_submit(u, fd, i) < 0) {
+            return -1;
+        }
+        u->next = (i + 1) % LOGR_URING_BUFS;
+        p += len;
+        n -= len;
+    }
+    if (u->error != 0) {
+        errno = u->error;
+        u->error = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/* Wait for every queued write.  Must be called with logr->lock. */
+static int
+_logr_uring_wait(logr_t *logr)
+{
+    struct logr_uring *u = logr->uring;
+
+    if (u == NULL) {
+        return 0;
+    }
+    if (_logr_uring_reap(u, 0) < 0) {
+        return -1;
+    }
+    if (u->error != 0) {
+        errno = u->error;
+        u->error = 0;
+        return -1;
+    }
+    return 0;
+}
+
+/* Complete the writes of every logger and go back to write(2) at exit. */
+static void
+_logr_uring_atexit(void)
+{
+    struct logr_uring *u;
+    logr_t *l;
+
+    pthread_mutex_lock(&logr_urings_lock);
+    for (l = logr_urings; l != NULL; l = l->uring_next) {
+        logr_lock(l);
+        _logr_uring_wait(l);
+        u = l->uring;
+        l->uring = NULL;
+        logr_unlock(l);
+        if (u != NULL) {
+            _logr_uring_free(u);
+        }
+    }
+    logr_urings = NULL;
+    pthread_mutex_unlock(&logr_urings_lock);
+}
+#else
+static int
+_logr_uring_wait(logr_t *logr)
+{
+    return 0;
+}
+#endif
+
+
+#ifndef __WIN32
+/*
+ * Memory mapped output.
+ *
+ * The file is grown map_extent bytes at a time with posix_fallocate() and
+ * the part being written is mapped, so entries are appended with memcpy()
+ * alone.  The preallocated tail reads as NUL bytes and is cut off with
+ * ftruncate() when the file is closed or rotated.  If the process dies
+ * first the NUL bytes remain; they are trimmed when a logger next maps the
+ * file.
+ */
+static logr_t *logr_maps;
+static pthread_mutex_t logr_maps_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Where the data ends in a file of size bytes with a NUL tail. */
+static off_t
+_logr_map_recover(int fd, off_t size)
+{
+    char buf[4096];
+    off_t pos = size;
+    size_t chunk, len;
+
+    while (pos > 0) {
+        chunk = (pos < (off_t)sizeof(buf)) ? (size_t)pos : sizeof(buf);
+        if (pread(fd, buf, chunk, pos - chunk) != (ssize_t)chunk) {
+            /* leave the file alone */
+            return size;
+        }
+        for (len = chunk; (len > 0) && (buf[len - 1] == '\0'); len--)
+            ;
+        if (len > 0) {
+            return pos - chunk + len;
+        }
+        pos -= chunk;
+    }
+    return 0;
+}
+
+/* Unmap the file and cut off its tail.  Must be called with logr->lock. */
+static void
+_logr_unmap(logr_t *logr)
+{
+    if (logr->map != NULL) {
+        munmap(logr->map, logr->map_extent);
+        logr->map = NULL;
+    }
+    if (logr->mapped) {
+        if ((logr->fd >= 0) && (ftruncate(logr->fd, logr->map_pos) != 0)) {
+            /* the tail stays until the file is mapped again */
+        }
+        logr->mapped = false;
+    }
+}
+
+/* Reopen logr->fd for reading too, as mapping it requires. */
+static int
+_logr_map_fd(logr_t *logr)
+{
+    struct stat a, b;
+    int fd, flags;
+
+    flags = fcntl(logr->fd, F_GETFL);
+    if (flags < 0) {
+        return -1;
+    }
+    if ((flags & O_ACCMODE) == O_RDWR) {
+        return 0;
+    }
+    fd = open(logr->path, O_RDWR | O_APPEND);
+    if (fd < 0) {
+        return -1;
+    }
+    /* the same file, under the same descriptor number */
+    if ((fstat(fd, &a) != 0) || (fstat(logr->fd, &b) != 0) ||
+            (a.st_dev != b.st_dev) || (a.st_ino != b.st_ino) ||
+            (dup2(fd, logr->fd) < 0)) {
+        close(fd);
+        return _logr_errno(EBADF);
+    }
+    close(fd);
+    return 0;
+}
+
+/* Map the extent of the file that map_pos falls in. */
+static int
+_logr_map(logr_t *logr)
+{
+    off_t page = sysconf(_SC_PAGESIZE);
+    struct stat st;
+    off_t off;
+    void *p;
+    int retval;
+
+    if (logr->map != NULL) {
+        munmap(logr->map, logr->map_extent);
+        logr->map = NULL;
+    }
+    if (!logr->mapped) {
+        /* writes through the ring would land after the preallocation */
+        if ((_logr_uring_wait(logr) < 0) || (_logr_map_fd(logr) < 0) ||
+                (fstat(logr->fd, &st) != 0)) {
+            return -1;
+        }
+        logr->map_pos = _logr_map_recover(logr->fd, st.st_size);
+        logr->size = logr->map_pos;
+        logr->mapped = true;
+    }
+
+    off = logr->map_pos & ~(page - 1);
+    retval = posix_fallocate(logr->fd, off, logr->map_extent);
+    if (retval != 0) {
+        return _logr_errno(retval);
+    }
+    p = mmap(NULL, logr->map_extent, PROT_READ | PROT_WRITE, MAP_SHARED,
+             logr->fd, off);
+    if (p == MAP_FAILED) {
+        return -1;
+    }
+    logr->map = (char *)p;
+    logr->map_off = off;
+    return 0;
+}
+
+/* Copy n bytes to the end of the file.  Must be called with logr->lock. */
+static int
+_logr_map_write(logr_t *logr, const char **p, size_t *n)
+{
+    off_t end;
+    size_t len;
+
+    while (*n > 0) {
+        end = logr->map_off + (off_t)logr->map_extent;
+        if ((logr->map == NULL) || (logr->map_pos == end)) {
+            if (_logr_map(logr) < 0) {
+                return -1;
+            }
+            end = logr->map_off + (off_t)logr->map_extent;
+        }
+        len = (end - logr->map_pos < (off_t)*n) ?
+            (size_t)(end - logr->map_pos) : *n;
+        memcpy(logr->map + (logr->map_pos - logr->map_off), *p, len);
+        logr->map_pos += len;
+        *p += len;
+        *n -= len;
+    }
+    return 0;
+}
+
+/* Trim the files of all mapped loggers when the process exits. */
+static void
+_logr_map_atexit(void)
+{
+    logr_t *l;
+
+    pthread_mutex_lock(&logr_maps_lock);
+    for (l = logr_maps; l != NULL; l = l->map_next) {
+        logr_lock(l);
+        _logr_unmap(l);
+        l->map_extent = 0;
+        logr_unlock(l);
+    }
+    logr_maps = NULL;
+    pthread_mutex_unlock(&logr_maps_lock);
+}
+#else
+static void
+_logr_unmap(logr_t *logr)
+{
+}
+#endif
+
+/* Write out n bytes of entries.  Must be called with logr->lock. */
+static int
+_logr_send(logr_t *logr, const char *p, size_t n)
+{
+#ifndef __WIN32
+    if ((logr->map_extent != 0) && logr->regular && !logr->binary &&
+            !logr->map_failed) {
+        if (_logr_map_write(logr, &p, &n) == 0) {
+            return 0;
+        }
+        /* e.g. out of space, don't try again until the next file */
+        logr->map_failed = true;
+    }
+    /* what the mapping didn't take goes after the data, not the tail */
+    _logr_unmap(logr);
+#endif
+#ifdef LOGR_IO_URING
+    if ((logr->uring != NULL) && logr->regular) {
+        return _logr_uring_write(logr->uring, logr->fd, p, n);
+    }
+#endif
+    return _logr_write((logr->fd >= 0) ? logr->fd : STDERR_FILENO, p, n);
+}
+
+int
+logr_set_mmap(logr_t *logr, size_t extent)
+{
+#ifdef __WIN32
+    if (extent == 0) {
+        return 0;
+    }
+    return _logr_errno(ENOTSUP);
+#else
+    static bool registered = false;
+    size_t page = sysconf(_SC_PAGESIZE);
+    logr_t **pl;
+
+    if (logr == NULL) {
+        return _logr_errno(EINVAL);
+    }
+    extent = (extent + page - 1) & ~(page - 1);
+
+    pthread_mutex_lock(&logr_maps_lock);
+    for (pl = &logr_maps; *pl != NULL; pl = &(*pl)->map_next) {
+        if (*pl == logr) {
+            *pl = logr->map_next;
+            break;
+        }
+    }
+    if (extent != 0) {
+        if (!registered) {
+            atexit(_logr_map_atexit);
+            registered = true;
+        }
+        logr->map_next = logr_maps;
+        logr_maps = logr;
+    }
+
+    logr_lock(logr);
+    _logr_unmap(logr);
+    logr->map_extent = extent;
+    logr->map_failed = false;
+    logr_unlock(logr);
+    pthread_mutex_unlock(&logr_maps_lock);
+    return 0;
+#endif
+}
+
+int
+logr_set_io_uring(logr_t *logr, int enable, unsigned int flags)
+{
+#ifdef LOGR_IO_URING
+    static bool registered = false;
+    struct logr_uring *u = NULL, *old;
+    logr_t **pl;
+    int retval;
+
+    if (logr == NULL) {
+        return _logr_errno(EINVAL);
+    }
+    if (enable) {
+        u = _logr_uring_alloc(flags);
+        if (u == NULL) {
+            return -1;
+        }
+    }
+
+    pthread_mutex_lock(&logr_urings_lock);
+    for (pl = &logr_urings; *pl != NULL; pl = &(*pl)->uring_next) {
+        if (*pl == logr) {
+            *pl = logr->uring_next;
+            break;
+        }
+    }
+    if (u != NULL) {
+        if (!registered) {
+            atexit(_logr_uring_atexit);
+            registered = true;
+        }
+        logr->uring_next = logr_urings;
+        logr_urings = logr;
+    }
+
+    logr_lock(logr);
+    retval = _logr_uring_wait(logr);
+    old = logr->uring;
+    logr->uring = u;
+    logr_unlock(logr);
+    pthread_mutex_unlock(&logr_urings_lock);
+
+    if (old != NULL) {
+        _logr_uring_free(old);
+    }
+    return retval;
+#else
+    if (logr == NULL) {
+        return _logr_errno(EINVAL);
+    }
+    if (!enable) {
+        return 0;
+    }
+    return _logr_errno(ENOTSUP);
+#endif
+}
+
+#ifndef __WIN32
+/*
+ * Housekeeping of rotated files (closing, renaming generations) is handed
+ * to a background thread so writers only pay for one rename and one open.
+ * Jobs run in the order they were queued.
+ */
+struct logr_job {
+    struct logr_job *next;
+    void (*run)(struct logr_job *);
+};
+
+struct logr_rotation {
+    struct logr_job job;
+    logr_t *logr;             /* counts what fails, see logr_free */
+    int fd;                   /* descriptor of the rotated file */
+    int count;                /* generations to keep */
+    int compress;             /* gzip level for path.1, 0 for none */
+    time_t start;             /* period the file was written in */
+    char *name_fmt;           /* strftime suffix, NULL for numbered files */
+    char *path;
+    char *tmp;                /* where the rotated file was moved to */
+};
+
+static pthread_mutex_t logr_janitor_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t logr_janitor_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t logr_janitor_idle = PTHREAD_COND_INITIALIZER;
+static pthread_t logr_janitor_thread;
+static bool logr_janitor_running = false;
+static bool logr_janitor_busy = false;
+static struct logr_job *logr_jobs, **logr_jobs_tail = &logr_jobs;
+
+static void *
+_logr_janitor(void *unused)
+{
+    struct logr_job *job;
+
+#ifdef __linux__
+    /* Only housekeeping runs here; don't compete with the application. */
+    (void)setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+#endif
+
+    pthread_mutex_lock(&logr_janitor_lock);
+    for (;;) {
+        while (logr_jobs == NULL) {
+            logr_janitor_busy = false;
+            pthread_cond_broadcast(&logr_janitor_idle);
+            pthread_cond_wait(&logr_janitor_cond, &logr_janitor_lock);
+        }
+        job = logr_jobs;
+        logr_jobs = job->next;
+        if (logr_jobs == NULL) {
+            logr_jobs_tail = &logr_jobs;
+        }
+        logr_janitor_busy = true;
+        pthread_mutex_unlock(&logr_janitor_lock);
+
+        job->run(job);
+
+        pthread_mutex_lock(&logr_janitor_lock);
+    }
+    return NULL;
+}
+
+/*
+ * Wait for the queued jobs to be done.  Registered with atexit() so that
+ * the process doesn't exit with rotations half done.
+ */
+static void
+_logr_janitor_wait(void)
+{
+    pthread_mutex_lock(&logr_janitor_lock);
+    while ((logr_jobs != NULL) || logr_janitor_busy) {
+        pthread_cond_wait(&logr_janitor_idle, &logr_janitor_lock);
+    }
+    pthread_mutex_unlock(&logr_janitor_lock);
+}
+
+/* Queue a job for the background thread.  Returns -1 if it can't run. */
+static int
+_logr_janitor_add(struct logr_job *job)
+{
+    int retval;
+
+    pthread_mutex_lock(&logr_janitor_lock);
+    if (!logr_janitor_running) {
+        retval = pthread_create(&logr_janitor_thread, NULL, _logr_janitor,
+                                NULL);
+        if (retval != 0) {
+            pthread_mutex_unlock(&logr_janitor_lock);
+            return _logr_errno(retval);
+        }
+        pthread_detach(logr_janitor_thread);
+        atexit(_logr_janitor_wait);
+        logr_janitor_running = true;
+    }
+    job->next = NULL;
+    *logr_jobs_tail = job;
+    logr_jobs_tail = &job->next;
+    logr_janitor_busy = true;
+    pthread_cond_signal(&logr_janitor_cond);
+    pthread_mutex_unlock(&logr_janitor_lock);
+    return 0;
+}
+
+#ifdef HAVE_ZLIB
+/*
+ * Compress 'src' into 'src.gz' and remove 'src'.  The output is written
+ * under a temporary name first so a generation is always either complete
+ * or still uncompressed.
+ */
+static int
+_logr_gzip(const char *src, int level)
+{
+    char dst[strlen(src) + strlen(LOGR_GZ_EXT) + 1];
+    char part[sizeof(dst) + strlen(".part")];
+    char buf[16 * 1024];
+    char mode[8];
+    gzFile gz;
+    ssize_t n;
+    int in, out;
+
+    sprintf(dst, "%s%s", src, LOGR_GZ_EXT);
+    sprintf(part, "%s.part", dst);
+    sprintf(mode, "wb%d", level);
+
+    in = open(src, O_RDONLY);
+    if (in < 0) {
+        return -1;
+    }
+    out = open(part, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    if (out < 0) {
+        close(in);
+        return -1;
+    }
+    gz = gzdopen(out, mode);
+    if (gz == NULL) {
+        close(out);
+        goto fail;
+    }
+    while ((n = read(in, buf, sizeof(buf))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            gzclose(gz);
+            goto fail;
+        }
+        if (gzwrite(gz, buf, n) != n) {
+            gzclose(gz);
+            goto fail;
+        }
+    }
+    if (gzclose(gz) != Z_OK) {
+        goto fail;
+    }
+    close(in);
+
+    if (rename(part, dst) != 0) {
+        unlink(part);
+        return -1;
+    }
+    unlink(src);
+    return 0;
+
+fail:
+    close(in);
+    unlink(part);
+    return -1;
+}
+#endif
+
+struct logr_generation {
+    time_t mtime;
+    char *name;
+};
+
+static int
+_logr_generation_cmp(const void *a, const void *b)
+{
+    const struct logr_generation *x = a, *y = b;
+
+    if (x->mtime != y->mtime) {
+        return (x->mtime < y->mtime) ? -1 : 1;
+    }
+    return strcmp(x->name, y->name);
+}
+
+/*
+ * Remove all but the 'keep' newest files named after 'path' and the
+ * strftime suffix 'fmt', by turning every conversion into a wildcard.
+ * Returns -1 if any of them couldn't be removed.
+ */
+static int
+_logr_prune(const char *path, const char *fmt, int keep)
+{
+    char pattern[strlen(path) + strlen(fmt) + 2];
+    struct logr_generation *gen;
+    struct stat st;
+    glob_t g;
+    char *p;
+    size_t i, n = 0;
+    int retval = 0;
+
+    p = pattern + sprintf(pattern, "%s", path);
+    while (*fmt != '\0') {
+        if (*fmt == '%' && fmt[1] != '\0') {
+            fmt++;
+            if ((*fmt == 'E' || *fmt == 'O') && fmt[1] != '\0') {
+                fmt++;
+            }
+            *p++ = '*';
+            fmt++;
+        } else {
+            *p++ = *fmt++;
+        }
+    }
+    strcpy(p, "*");
+
+    switch (glob(pattern, 0, NULL, &g)) {
+    case 0:
+        break;
+    case GLOB_NOMATCH:
+        return 0;
+    default:
+        return -1;
+    }
+    gen = malloc(g.gl_pathc * sizeof(struct logr_generation));
+    if (gen == NULL) {
+        globfree(&g);
+        return -1;
+    }
+    for (i = 0; i < g.gl_pathc; i++) {
+        char *name = g.gl_pathv[i];
+        size_t len = strlen(name);
+
+        if ((strcmp(name, path) == 0) ||
+                (strstr(name + strlen(path), ".rotating.") != NULL) ||
+                ((len > 5) && (strcmp(name + len - 5, ".part") == 0)) ||
+                (stat(name, &st) != 0)) {
+            continue;
+        }
+        gen[n].mtime = st.st_mtime;
+        gen[n].name = name;
+        n++;
+    }
+    qsort(gen, n, sizeof(struct logr_generation), _logr_generation_cmp);
+    for (i = 0; i + keep < n; i++) {
+        if (unlink(gen[i].name) != 0) {
+            retval = -1;
+        }
+    }
+    free(gen);
+    globfree(&g);
+    return retval;
+}
+
+/*
+ * Move the rotated file to path + strftime(name_fmt) for the period it
+ * was written in.  Further rotations in the same period (because of the
+ * size threshold) get a .1, .2, ... suffix.  Returns -1 if any step
+ * failed.
+ */
+static int
+_logr_rotation_named(struct logr_rotation *r)
+{
+    char name[strlen(r->path) + 256 + MAX_ROTATE_EXT_LEN +
+              strlen(LOGR_GZ_EXT) + 1];
+    char gz[sizeof(name)];
+    struct tm tm;
+    size_t n;
+    int i, retval = 0;
+
+    _logr_localtime(r->start, &tm);
+    n = sprintf(name, "%s", r->path);
+    n += strftime(name + n, 256, r->name_fmt, &tm);
+
+    for (i = 1; i <= MAX_ROTATE_FILES; i++) {
+        sprintf(gz, "%s%s", name, LOGR_GZ_EXT);
+        if (!_logr_exists(name) && !_logr_exists(gz)) {
+            break;
+        }
+        sprintf(name + n, ".%d", i);
+    }
+
+    if (_logr_rename(r->tmp, name) != 0) {
+        return -1;
+    }
+#ifdef HAVE_ZLIB
+    if ((r->compress != 0) && (_logr_gzip(name, r->compress) < 0)) {
+        retval = -1;
+    }
+#endif
+    if (_logr_prune(r->path, r->name_fmt, r->count) < 0) {
+        retval = -1;
+    }
+    return retval;
+}
+
+static void
+_logr_rotation_run(struct logr_job *job)
+{
+    struct logr_rotation *r = (struct logr_rotation *)job;
+    int retval = 0;
+
+    close(r->fd);
+    if ((r->count > 0) && (r->name_fmt != NULL)) {
+        retval = _logr_rotation_named(r);
+    } else if (r->count > 0) {
+        retval = _logr_shift(r->path, r->count, r->tmp);
+#ifdef HAVE_ZLIB
+        if (r->compress != 0) {
+            char first[strlen(r->path) + MAX_ROTATE_EXT_LEN + 1];
+
+            sprintf(first, "%s.1", r->path);
+            if (_logr_gzip(first, r->compress) < 0) {
+                retval = -1;
+            }
+        }
+#endif
+    } else {
+        retval = unlink(r->tmp);
+    }
+    if (retval != 0) {
+        _logr_count(&_logr_stripe(r->logr)->rotate_errors, 1);
+    }
+    free(r);
+}
+
+/*
+ * Swap in a fresh file: move the current one aside, open a new one under
+ * the original name and switch the descriptor.  Renaming the generations
+ * is left to the background thread.  Must be called with logr->lock.
+ */
+static int
+_logr_rotate_swap(logr_t *logr)
+{
+    const struct logr_cfg *cfg = _logr_cfg(logr);
+    struct logr_rotation *r;
+    size_t len = strlen(logr->path);
+    size_t fmt_len = 0;
+    int fd;
+
+    if (cfg->rotate_name != NULL) {
+        fmt_len = strlen(cfg->rotate_name) + 1;
+    }
+    r = (struct logr_rotation *)malloc(sizeof(struct logr_rotation) +
+                                       2 * len + 48 + fmt_len);
+    if (r == NULL) {
+        return -1;
+    }
+    r->path = strcpy((char *)(r + 1), logr->path);
+    r->tmp = r->path + len + 1;
+    r->name_fmt = NULL;
+    if (cfg->rotate_name != NULL) {
+        r->name_fmt = strcpy(r->tmp + len + 48, cfg->rotate_name);
+    }
+    sprintf(r->tmp, "%s.rotating.%ld.%u", logr->path, (long)getpid(),
+            ++logr->rotate_seq);
+
+    if (rename(logr->path, r->tmp) != 0) {
+        free(r);
+        return -1;
+    }
+    fd = _logr_openfd(logr->path);
+    if (fd < 0) {
+        rename(r->tmp, logr->path);
+        free(r);
+        return -1;
+    }
+
+    if (logr->rotate_file_count < cfg->rotated_file_max) {
+        logr->rotate_file_count++;
+    }
+    r->job.run = _logr_rotation_run;
+    r->logr = logr;
+    r->fd = logr->fd;
+    r->count = (r->name_fmt != NULL) ? cfg->rotated_file_max
+                                     : logr->rotate_file_count;
+    r->compress = cfg->compress;
+    r->start = logr->rotate_start;
+    logr->fd = fd;
+    logr->size = 0;
+
+    if (_logr_janitor_add(&r->job) < 0) {
+        /* Never compress on the caller's thread; path.1 stays as it is. */
+        r->compress = 0;
+        _logr_rotation_run(&r->job);
+    }
+    return 0;
+}
+#endif
+
+static int
+_logr_rotate(logr_t *logr)
+{
+    /* the old file must be complete before it is renamed or compressed */
+    _logr_uring_wait(logr);
+    _logr_unmap(logr);
+#ifndef __WIN32
+    logr->map_failed = false;
+#endif
+    logr->bin_fresh = true;
+#ifndef __WIN32
+    if (_logr_rotate_swap(logr) == 0) {
+        logr->rotations++;
+        return 0;
+    }
+#endif
+    close(logr->fd);    // Have to close before rename for win32
+    if (_logr_rotatelog(logr) < 0) {
+        logr->rotate_errors++;
+    }
+    logr->fd = _logr_openfd(logr->path);
+    logr->size = 0;
+    if (logr->fd < 0) {
+        /* entries go to stderr until the file can be reopened */
+        logr->rotate_errors++;
+        return -1;
+    }
+    logr->rotations++;
+    return 0;
+}
+
+/* Rotate the log file once it has grown past the threshold. */
+static int
+_logr_check_rotate(logr_t *logr)
+{
+    off_t threshold = _logr_cfg(logr)->threshold;
+
+    if (logr->path != NULL) {
+        if ((threshold != 0) && (logr->size > threshold) &&
+                 (logr->path != NULL)) {
+            return _logr_rotate(logr);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Rotate the log file if the entry stamped 'sec' is the first of a new
+ * period.  Called before the entry is appended to b, so that whatever
+ * logr->out and b hold still goes to the old period's file, however long
+ * it waited in the buffer or a queue.  Must be called with logr->lock.
+ */
+static int
+_logr_check_rotate_time(logr_t *logr, struct logr_buf *b, time_t sec)
+{
+    int retval = 0;
+
+    if ((logr->rotate_at == 0) || (sec < logr->rotate_at)) {
+        return 0;
+    }
+    if ((b != &logr->out) && (_logr_commit(logr, &logr->out) < 0)) {
+        retval = -1;
+    }
+    if (_logr_commit(logr, b) < 0) {
+        retval = -1;
+    }
+    if ((logr->path != NULL) && (logr->size != 0) &&
+            (_logr_rotate(logr) < 0)) {
+        retval = -1;
+    }
+    _logr_rotate_period(logr, sec);
+    return retval;
+}
+
+/*
+ * Write out a buffer of complete entries with a single write(2) and rotate
+ * if the file has grown too large.  Must be called with logr->lock.
+ */
+static int
+_logr_commit(logr_t *logr, struct logr_buf *b)
+{
+    int retval = 0;
+
+    if (b->len != 0) {
+        if (logr->binary && (_logr_bin_prologue(logr) < 0)) {
+            retval = -1;
+        }
+        if (_logr_send(logr, b->data, b->len) < 0) {
+            logr->write_errors++;
+            retval = -1;
+        } else {
+            logr->bytes += b->len;
+        }
+        logr->flushes++;
+        logr->size += b->len;
+        b->len = 0;
+    }
+    if (_logr_check_rotate(logr) < 0) {
+        retval = -1;
+    }
+    return retval;
+}
+
+#ifndef __WIN32
+/*
+ * Syslog sink.
+ *
+ * Entries are sent straight to the daemon's unix datagram socket, one
+ * datagram each, from a non-blocking socket.  When the daemon falls behind
+ * datagrams are kept in a backlog of length-prefixed records and sent with
+ * sendmmsg(2) once it catches up; when the backlog is full entries are
+ * dropped and counted instead.  Everything here runs with logr->lock.
+ */
+#define LOGR_SYSLOG_BACKLOG (256 * 1024)
+#define LOGR_SYSLOG_BATCH 64
+
+struct logr_syslog {
+    logr_t *logr;             /* whose statistics count what is lost */
+    char *path;               /* as given to logr_add_syslog, may be NULL */
+    struct sockaddr_un addr;
+    char *ident;
+    int facility;
+    unsigned int flags;
+    int sock;                 /* -1 while not connected */
+    time_t retry;             /* no connection attempt before this */
+    char host[256];
+    struct logr_buf dgram;    /* the datagram being built */
+    struct logr_buf backlog;  /* uint32_t length, datagram, ... */
+    size_t head;              /* backlog sent so far */
+    unsigned long dropped;    /* entries not yet reported as lost */
+};
+
+/* Whether a send failed because the daemon went away, not because busy. */
+static inline bool
+_logr_syslog_gone(int err)
+{
+    return (err == ECONNREFUSED) || (err == ENOTCONN) ||
+           (err == ECONNRESET) || (err == ENOENT) || (err == EPIPE) ||
+           (err == EDESTADDRREQ);
+}
+
+static void
+_logr_syslog_close(struct logr_syslog *sl)
+{
+    if (sl->sock >= 0) {
+        close(sl->sock);
+        sl->sock = -1;
+    }
+}
+
+/* Connect, unless an attempt failed less than a second ago. */
+static int
+_logr_syslog_connect(struct logr_syslog *sl)
+{
+    time_t now = time(NULL);
+    int fd;
+
+    if (sl->sock >= 0) {
+        return 0;
+    }
+    if (now < sl->retry) {
+        return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        sl->retry = now + 1;
+        return -1;
+    }
+    if ((fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) ||
+            (fcntl(fd, F_SETFL, O_NONBLOCK) < 0) ||
+            (connect(fd, (struct sockaddr *)&sl->addr,
+                     sizeof(sl->addr)) < 0)) {
+        close(fd);
+        sl->retry = now + 1;
+        return -1;
+    }
+    sl->sock = fd;
+    return 0;
+}
+
+/* Build the datagram for rec, whose message is msg, in sl->dgram. */
+static int
+_logr_syslog_build(struct logr_syslog *sl, const struct logr_record *rec,
+                   const char *msg, size_t len)
+{
+    struct logr_buf *b = &sl->dgram;
+    long pid = (rec->pid != 0) ? rec->pid : getpid();
+    int level = (rec->level < LOGR_EMERG) ? LOGR_EMERG :
+                (rec->level > LOGR_DEBUG) ? LOGR_DEBUG : rec->level;
+    char tmp[64];
+    uint64_t le;
+    struct tm tm;
+    int i;
+
+    /* the daemon terminates records itself */
+    while ((len > 0) && (msg[len - 1] == '\n')) {
+        len--;
+    }
+    b->len = 0;
+
+    if (sl->flags & LOGR_SYSLOG_JOURNAL) {
+        if ((_logr_buf_puts(b, "PRIORITY=") < 0) ||
+                (_logr_buf_putd(b, level) < 0) ||
+                (_logr_buf_puts(b, "\nSYSLOG_FACILITY=") < 0) ||
+                (_logr_buf_putd(b, sl->facility >> 3) < 0) ||
+                (_logr_buf_puts(b, "\nSYSLOG_PID=") < 0) ||
+                (_logr_buf_putd(b, pid) < 0) ||
+                (_logr_buf_puts(b, "\n") < 0)) {
+            return -1;
+        }
+        if ((sl->ident != NULL) &&
+                ((_logr_buf_puts(b, "SYSLOG_IDENTIFIER=") < 0) ||
+                 (_logr_buf_puts(b, sl->ident) < 0) ||
+                 (_logr_buf_puts(b, "\n") < 0))) {
+            return -1;
+        }
+        if ((rec->file != NULL) &&
+                ((_logr_buf_puts(b, "CODE_FILE=") < 0) ||
+                 (_logr_buf_puts(b, rec->file) < 0) ||
+                 (_logr_buf_puts(b, "\nCODE_LINE=") < 0) ||
+                 (_logr_buf_putd(b, rec->line) < 0) ||
+                 (_logr_buf_puts(b, "\n") < 0))) {
+            return -1;
+        }
+        if ((rec->func != NULL) &&
+                ((_logr_buf_puts(b, "CODE_FUNC=") < 0) ||
+                 (_logr_buf_puts(b, rec->func) < 0) ||
+                 (_logr_buf_puts(b, "\n") < 0))) {
+            return -1;
+        }
+        if (memchr(msg, '\n', len) == NULL) {
+            if (_logr_buf_puts(b, "MESSAGE=") < 0) {
+                return -1;
+            }
+        } else {
+            /* multi-line values are sent as a little endian length */
+            for (i = 0, le = len; i < 8; i++, le >>= 8) {
+                tmp[i] = (char)(le & 0xff);
+            }
+            if ((_logr_buf_puts(b, "MESSAGE\n") < 0) ||
+                    (_logr_buf_put(b, tmp, 8) < 0)) {
+                return -1;
+            }
+        }
+        if ((_logr_buf_put(b, msg, len) < 0) ||
+                (_logr_buf_puts(b, "\n") < 0)) {
+            return -1;
+        }
+        return 0;
+    }
+
+    /* <PRI>1 TIMESTAMP HOSTNAME APP-NAME PROCID MSGID SD MSG */
+    gmtime_r(&rec->ts.tv_sec, &tm);
+    snprintf(tmp, sizeof(tmp), "<%d>1 %04d-%02d-%02dT%02d:%02d:%02d.%06ldZ ",
+             sl->facility | level, tm.tm_year + 1900, tm.tm_mon + 1,
+             tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+             rec->ts.tv_nsec / 1000);
+    if ((_logr_buf_puts(b, tmp) < 0) ||
+            (_logr_buf_puts(b, sl->host) < 0) ||
+            (_logr_buf_puts(b, " ") < 0) ||
+            (_logr_buf_puts(b, (sl->ident != NULL) ? sl->ident : "-") < 0) ||
+            (_logr_buf_puts(b, " ") < 0) ||
+            (_logr_buf_putd(b, pid) < 0) ||
+            (_logr_buf_puts(b, " - - ") < 0) ||
+            (_logr_buf_put(b, msg, len) < 0)) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Count an entry lost: reported to the daemon later and in the logger's
+ * statistics, as a write error too if sending it failed.
+ */
+static void
+_logr_syslog_lost(struct logr_syslog *sl, bool failed)
+{
+    sl->dropped++;
+    _logr_count(&_logr_stripe(sl->logr)->dropped, 1);
+    if (failed) {
+        sl->logr->write_errors++;
+    }
+}
+
+/* Keep sl->dgram for later, or drop it if the backlog is full. */
+static int
+_logr_syslog_hold(struct logr_syslog *sl)
+{
+    uint32_t len = sl->dgram.len;
+
+    if (sl->backlog.len - sl->head + sizeof(len) + len > LOGR_SYSLOG_BACKLOG) {
+        _logr_syslog_lost(sl, false);
+        return _logr_errno(EAGAIN);
+    }
+    if (sl->head != 0) {
+        memmove(sl->backlog.data, sl->backlog.data + sl->head,
+                sl->backlog.len - sl->head);
+        sl->backlog.len -= sl->head;
+        sl->head = 0;
+    }
+    if ((_logr_buf_put(&sl->backlog, (char *)&len, sizeof(len)) < 0) ||
+            (_logr_buf_put(&sl->backlog, sl->dgram.data, len) < 0)) {
+        _logr_syslog_lost(sl, false);
+        return -1;
+    }
+    return 0;
+}
+
+/* Send as much of the backlog as the daemon takes, a batch per call. */
+static void
+_logr_syslog_flush(struct logr_syslog *sl)
+{
+    struct iovec iov[LOGR_SYSLOG_BATCH];
+#ifdef HAVE_SENDMMSG
+    struct mmsghdr msg[LOGR_SYSLOG_BATCH];
+#endif
+    size_t pos;
+    uint32_t len;
+    int i, n, sent;
+    bool reconnected = false;
+
+    while ((sl->head < sl->backlog.len) &&
+            (_logr_syslog_connect(sl) == 0)) {
+        for (n = 0, pos = sl->head;
+                (n < LOGR_SYSLOG_BATCH) && (pos < sl->backlog.len); n++) {
+            memcpy(&len, sl->backlog.data + pos, sizeof(len));
+            iov[n].iov_base = sl->backlog.data + pos + sizeof(len);
+            iov[n].iov_len = len;
+            pos += sizeof(len) + len;
+        }
+#ifdef HAVE_SENDMMSG
+        memset(msg, 0, n * sizeof(msg[0]));
+        for (i = 0; i < n; i++) {
+            msg[i].msg_hdr.msg_iov = &iov[i];
+            msg[i].msg_hdr.msg_iovlen = 1;
+        }
+        sent = sendmmsg(sl->sock, msg, n, 0);
+#else
+        for (sent = 0; sent < n; sent++) {
+            if (send(sl->sock, iov[sent].iov_base, iov[sent].iov_len, 0) < 0) {
+                break;
+            }
+        }
+        if ((sent == 0) && (n != 0)) {
+            sent = -1;
+        }
+#endif
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK) ||
+                    (errno == ENOBUFS)) {
+                break;
+            }
+            if (_logr_syslog_gone(errno)) {
+                /* the daemon restarted, its new socket may be there */
+                _logr_syslog_close(sl);
+                if (reconnected) {
+                    sl->retry = time(NULL) + 1;
+                    break;
+                }
+                reconnected = true;
+                continue;
+            }
+            /* this one can't be sent at all, e.g. too big */
+            _logr_syslog_lost(sl, true);
+            sent = 1;
+        }
+        for (i = 0; i < sent; i++) {
+            sl->head += sizeof(len) + iov[i].iov_len;
+        }
+    }
+    if (sl->head == sl->backlog.len) {
+        sl->head = sl->backlog.len = 0;
+    }
+}
+
+/* Send, or hold back, the entry rec whose message is msg. */
+static int
+_logr_syslog_send(struct logr_syslog *sl, const struct logr_record *rec,
+                  const char *msg, size_t len)
+{
+    struct logr_record note = { 0 };
+    char text[64];
+    int retry;
+
+    _logr_syslog_flush(sl);
+
+    /* report what was lost once there is room again */
+    if ((sl->dropped != 0) && (sl->backlog.len == 0) && (sl->sock >= 0)) {
+        note.level = LOGR_WARNING;
+        _logr_now(&note.ts);
+        snprintf(text, sizeof(text), "*** logr: %lu entries dropped ***",
+                 sl->dropped);
+        if ((_logr_syslog_build(sl, &note, text, strlen(text)) == 0) &&
+                (send(sl->sock, sl->dgram.data, sl->dgram.len, 0) >= 0)) {
+            sl->dropped = 0;
+        }
+    }
+
+    if (_logr_syslog_build(sl, rec, msg, len) < 0) {
+        return -1;
+    }
+    if (sl->backlog.len != 0) {
+        return _logr_syslog_hold(sl);
+    }
+    for (retry = 1; _logr_syslog_connect(sl) == 0; ) {
+        if (send(sl->sock, sl->dgram.data, sl->dgram.len, 0) >= 0) {
+            return 0;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (!_logr_syslog_gone(errno)) {
+            break;
+        }
+        _logr_syslog_close(sl);
+        if (retry-- == 0) {
+            sl->retry = time(NULL) + 1;
+            break;
+        }
+    }
+    if ((sl->sock >= 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) &&
+            (errno != ENOBUFS)) {
+        _logr_syslog_lost(sl, true);
+        return -1;
+    }
+    return _logr_syslog_hold(sl);
+}
+
+static void
+_logr_syslog_free(struct logr_syslog *sl)
+{
+    _logr_syslog_flush(sl);
+    _logr_syslog_close(sl);
+    free(sl->path);
+    free(sl->ident);
+    free(sl->dgram.data);
+    free(sl->backlog.data);
+    free(sl);
+}
+#endif
+
+/* Whether any sink takes entries of this level.  With logr->lock. */
+static inline bool
+_logr_sinks_want(logr_t *logr, int level)
+{
+    size_t i;
+
+    for (i = 0; i < logr->nsinks; i++) {
+        if (level <= logr->sinks[i].level) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Write a rendered entry to the sinks taking its level.  The message
+ * starts at p + msg, after the prefix.  Must be called with logr->lock.
+ */
+static int
+_logr_fanout(logr_t *logr, const struct logr_record *rec, const char *p,
+             size_t n, size_t msg)
+{
+    struct logr_sink *s;
+    size_t i;
+    int retval = 0;
+
+    for (i = 0; i < logr->nsinks; i++) {
+        s = &logr->sinks[i];
+        if (rec->level > s->level) {
+            continue;
+        }
+#ifndef __WIN32
+        if (s->syslog != NULL) {
+            if (_logr_syslog_send(s->syslog, rec, p + msg, n - msg) < 0) {
+                retval = -1;
+            }
+            continue;
+        }
+#endif
+        if (_logr_write(s->fd, p, n) < 0) {
+            logr->write_errors++;
+            retval = -1;
+        }
+    }
+    return retval;
+}
+
+int
+logr_add_sink(logr_t *logr, int fd, int level)
+{
+    struct logr_sink *sinks;
+    size_t i;
+
+    if ((logr == NULL) || (fd < 0)) {
+        return _logr_errno(EINVAL);
+    }
+
+    logr_lock(logr);
+    for (i = 0; i < logr->nsinks; i++) {
+        if (logr->sinks[i].fd == fd) {
+            logr->sinks[i].level = level;
+            logr_unlock(logr);
+            return 0;
+        }
+    }
+    sinks = (struct logr_sink *)realloc(logr->sinks, (logr->nsinks + 1) *
+                                        sizeof(struct logr_sink));
+    if (sinks == NULL) {
+        logr_unlock(logr);
+        return _logr_errno(ENOMEM);
+    }
+    sinks[logr->nsinks].fd = fd;
+    sinks[logr->nsinks].level = level;
+    sinks[logr->nsinks].syslog = NULL;
+    logr->sinks = sinks;
+    logr->nsinks++;
+    logr_unlock(logr);
+    return 0;
+}
+
+int
+logr_remove_sink(logr_t *logr, int fd)
+{
+    size_t i;
+
+    if (logr == NULL) {
+        return _logr_errno(EINVAL);
+    }
+
+    logr_lock(logr);
+    for (i = 0; i < logr->nsinks; i++) {
+        if ((logr->sinks[i].fd == fd) && (logr->sinks[i].syslog == NULL)) {
+            logr->sinks[i] = logr->sinks[--logr->nsinks];
+            logr_unlock(logr);
+            return 0;
+        }
+    }
+    logr_unlock(logr);
+    return _logr_errno(ENOENT);
+}
+
+int
+logr_add_syslog(logr_t *logr, const char *path, const char *ident,
+                int facility, int level, unsigned int flags)
+{
+#ifdef __WIN32
+    return _logr_errno(ENOTSUP);
+#else
+    struct logr_syslog *sl;
+    struct logr_sink *sinks;
+    const char *addr;
+
+    if ((logr == NULL) || (facility & ~(0x7f << 3)) ||
+            (flags & ~LOGR_SYSLOG_JOURNAL)) {
+        return _logr_errno(EINVAL);
+    }
+    addr = (path != NULL) ? path :
+           (flags & LOGR_SYSLOG_JOURNAL) ? LOGR_JOURNAL_PATH : _PATH_LOG;
+
+    sl = (struct logr_syslog *)calloc(1, sizeof(struct logr_syslog));
+    if (sl == NULL) {
+        return _logr_errno(ENOMEM);
+    }
+    sl->logr = logr;
+    sl->sock = -1;
+    sl->facility = facility;
+    sl->flags = flags;
+    sl->addr.sun_family = AF_UNIX;
+    if (strlen(addr) >= sizeof(sl->addr.sun_path)) {
+        free(sl);
+        return _logr_errno(ENAMETOOLONG);
+    }
+    strcpy(sl->addr.sun_path, addr);
+    if ((gethostname(sl->host, sizeof(sl->host) - 1) < 0) ||
+            (sl->host[0] == '\0')) {
+        strcpy(sl->host, "-");
+    }
+    if (((path != NULL) && ((sl->path = strdup(path)) == NULL)) ||
+            ((ident != NULL) && ((sl->ident = strdup(ident)) == NULL))) {
+        _logr_syslog_free(sl);
+        return _logr_errno(ENOMEM);
+    }
+
+    logr_lock(logr);
+    sinks = (struct logr_sink *)realloc(logr->sinks, (logr->nsinks + 1) *
+                                        sizeof(struct logr_sink));
+    if (sinks == NULL) {
+        logr_unlock(logr);
+        _logr_syslog_free(sl);
+        return _logr_errno(ENOMEM);
+    }
+    sinks[logr->nsinks].fd = -1;
+    sinks[logr->nsinks].level = level;
+    sinks[logr->nsinks].syslog = sl;
+    logr->sinks = sinks;
+    logr->nsinks++;
+    /* a daemon that isn't there yet is retried on the first entry */
+    _logr_syslog_connect(sl);
+    logr_unlock(logr);
+    return 0;
+#endif
+}
+
+int
+logr_remove_syslog(logr_t *logr, const char *path)
+{
+#ifdef __WIN32
+    return _logr_errno(ENOTSUP);
+#else
+    struct logr_syslog *sl;
+    size_t i;
+    bool found = false;
+
+    if (logr == NULL) {
+        return _logr_errno(EINVAL);
+    }
+
+    logr_lock(logr);
+    for (i = 0; i < logr->nsinks; ) {
+        sl = logr->sinks[i].syslog;
+        if ((sl != NULL) && ((path == NULL) || ((sl->path != NULL) &&
+                                                 !strcmp(sl->path, path)))) {
+            logr->sinks[i] = logr->sinks[--logr->nsinks];
+            _logr_syslog_free(sl);
+            found = true;
+        } else {
+            i++;
+        }
+    }
+    logr_unlock(logr);
+    return found ? 0 : _logr_errno(ENOENT);
+#endif
+}
+
+/* Append one pre-formatted record to b.  Must be called with logr->lock. */
+static int
+_logr_emit(logr_t *logr, const struct logr_record *rec, struct logr_buf *b)
+{
+    size_t start;
+    int n;
+
+    _logr_check_rotate_time(logr, b, rec->ts.tv_sec);
+    start = b->len;
+    if (rec->kv == LOGR_KV_RAW) {
+        n = 0;
+    } else if (rec->kv) {
+        n = _logr_kv_prefix(rec, logr, b);
+    } else {
+        n = _logr_util_prefix(rec, logr, b);
+    }
+    /* b may hold other entries, leave no part of this one behind */
+    if ((n < 0) || (_logr_buf_put(b, rec->msg, rec->len) < 0)) {
+        b->len = start;
+        return -1;
+    }
+    /* structured entries only make sense whole */
+    if ((logr->nsinks != 0) && (rec->kv != LOGR_KV_RAW) &&
+            (_logr_fanout(logr, rec, b->data + start, b->len - start,
+                          rec->kv ? 0 : n) < 0)) {
+        return -1;
+    }
+    return n + rec->len;
+}
+
+/*
+ * Whether the entries in b must be written now: the last entry was severe
+ * enough, the buffer is full or the file is about to cross the rotation
+ * threshold.  Must be called with logr->lock.
+ */
+static inline bool
+_logr_flush_due(logr_t *logr, const struct logr_buf *b, int level)
+{
+    size_t limit = logr->buffer_size;
+
+    if ((logr->flush_bytes != 0) && (logr->flush_bytes < limit)) {
+        limit = logr->flush_bytes;
+    }
+    return (level <= logr->flush_level) || (b->len >= limit) ||
+        ((_logr_cfg(logr)->threshold != 0) &&
+         (logr->size + (off_t)b->len > _logr_cfg(logr)->threshold));
+}
+
+#ifndef __WIN32
+/*
+ * Service thread writing out the buffers of loggers with a flush interval
+ * and reporting repeats whose dedup window is over.  One thread is shared
+ * by all loggers and started on first use.  A logger's settings don't
+ * change while it is on the list.
+ */
+static pthread_mutex_t logr_timer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t logr_timer_cond;
+static pthread_t logr_timer_thread;
+static bool logr_timer_running = false;
+static logr_t *logr_timers;
+
+static inline void
+_logr_ts_add_ms(struct timespec *ts, unsigned int ms)
+{
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (long)(ms % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+static inline bool
+_logr_ts_before(const struct timespec *a, const struct timespec *b)
+{
+    return (a->tv_sec < b->tv_sec) ||
+        ((a->tv_sec == b->tv_sec) && (a->tv_nsec < b->tv_nsec));
+}
+
+static void *
+_logr_timer(void *unused)
+{
+    struct timespec now, next;
+    logr_t *l;
+
+    pthread_mutex_lock(&logr_timer_lock);
+    for (;;) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        next = now;
+        _logr_ts_add_ms(&next, 1000);
+
+        for (l = logr_timers; l != NULL; l = l->timer_next) {
+            if (l->buffered && (l->flush_ms != 0)) {
+                if (!_logr_ts_before(&now, &l->flush_due)) {
+                    logr_lock(l);
+                    _logr_commit(l, &l->out);
+                    logr_unlock(l);
+                    l->flush_due = now;
+                    _logr_ts_add_ms(&l->flush_due, l->flush_ms);
+                }
+                if (_logr_ts_before(&l->flush_due, &next)) {
+                    next = l->flush_due;
+                }
+            }
+            if (l->dedup_ms != 0) {
+                if (!_logr_ts_before(&now, &l->dedup_due)) {
+                    l->dedup_due = now;
+                    _logr_ts_add_ms(&l->dedup_due, _logr_dedup_expire(l));
+                }
+                if (_logr_ts_before(&l->dedup_due, &next)) {
+                    next = l->dedup_due;
+                }
+            }
+        }
+        pthread_cond_timedwait(&logr_timer_cond, &logr_timer_lock, &next);
+    }
+    return NULL;
+}
+
+/* Whether the timer thread has anything to do for logr. */
+static inline bool
+_logr_timer_wanted(logr_t *logr)
+{
+    return (logr->buffered && (logr->flush_ms != 0)) ||
+           (logr->dedup_ms != 0);
+}
+
+static void
+_logr_timer_remove(logr_t *logr)
+{
+    logr_t **pl;
+
+    pthread_mutex_lock(&logr_timer_lock);
+    for (pl = &logr_timers; *pl != NULL; pl = &(*pl)->timer_next) {
+        if (*pl == logr) {
+            *pl = logr->timer_next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&logr_timer_lock);
+}
+
+static int
+_logr_timer_add(logr_t *logr)
+{
+    pthread_condattr_t attr;
+    logr_t *l;
+    int retval;
+
+    pthread_mutex_lock(&logr_timer_lock);
+    if (!logr_timer_running) {
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&logr_timer_cond, &attr);
+        pthread_condattr_destroy(&attr);
+        retval = pthread_create(&logr_timer_thread, NULL, _logr_timer, NULL);
+        if (retval != 0) {
+            pthread_cond_destroy(&logr_timer_cond);
+            pthread_mutex_unlock(&logr_timer_lock);
+            return _logr_errno(retval);
+        }
+        pthread_detach(logr_timer_thread);
+        logr_timer_running = true;
+    }
+
+    for (l = logr_timers; l != NULL; l = l->timer_next) {
+        if (l == logr) {
+            break;
+        }
+    }
+    if (l == NULL) {
+        logr->timer_next = logr_timers;
+        logr_timers = logr;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &logr->flush_due);
+    logr->dedup_due = logr->flush_due;
+    _logr_ts_add_ms(&logr->flush_due, logr->flush_ms);
+    _logr_ts_add_ms(&logr->dedup_due, logr->dedup_ms);
+    pthread_cond_signal(&logr_timer_cond);
+    pthread_mutex_unlock(&logr_timer_lock);
+    return 0;
+}
+#endif
+
+static logr_t *logr_flushes;
+static pthread_mutex_t logr_flushes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Write out what every buffered logger holds when the process exits. */
+static void
+_logr_flush_atexit(void)
+{
+    logr_t *l;
+
+    pthread_mutex_lock(&logr_flushes_lock);
+    for (l = logr_flushes; l != NULL; l = l->flush_next) {
+        logr_flush(l);
+    }
+    pthread_mutex_unlock(&logr_flushes_lock);
+}
+
+int
+logr_set_flush_policy(logr_t *logr, int level, size_t bytes,
+                      unsigned int interval_ms)
+{
+    static bool registered = false;
+    logr_t **pl;
+
+    if (logr == NULL) {
+        return _logr_errno(EINVAL);
+    }
+#ifdef __WIN32
+    if (interval_ms != 0) {
+        return _logr_errno(ENOTSUP);
+    }
+#else
+    _logr_timer_remove(logr);
+#endif
+
+    pthread_mutex_lock(&logr_flushes_lock);
+    for (pl = &logr_flushes; *pl != NULL; pl = &(*pl)->flush_next) {
+        if (*pl == logr) {
+            *pl = logr->flush_next;
+            break;
+        }
+    }
+    if (level != LOGR_FLUSH_ALWAYS) {
+        if (!registered) {
+            atexit(_logr_flush_atexit);
+            registered = true;
+        }
+        logr->flush_next = logr_flushes;
+        logr_flushes = logr;
+    }
+
+    logr_lock(logr);
+    logr->flush_level = level;
+    logr->flush_ms = interval_ms;
+    logr->flush_bytes = bytes;
+    logr->buffered = (level != LOGR_FLUSH_ALWAYS);
+    if (!logr->buffered) {
+        _logr_commit(logr, &logr->out);
+    }
+    logr_unlock(logr);
+    pthread_mutex_unlock(&logr_flushes_lock);
+
+#ifndef __WIN32
+    if (_logr_timer_wanted(logr)) {
+        return _logr_timer_add(logr);
+    }
+#endif
+    return 0;
+}
+
+int
+logr_set_buffer_size(logr_t *logr, size_t size)
+{
+    if ((logr == NULL) || (size == 0)) {
+        return _logr_errno(EINVAL);
+    }
+
+    logr_lock(logr);
+    _logr_commit(logr, &logr->out);
+    logr->buffer_size = size;
+    logr_unlock(logr);
+    return 0;
+}
+
+int
+logr_flush(logr_t *logr)
+{
+#ifndef __WIN32
+    size_t i;
+#endif
+    int retval;
+
+    if (logr == NULL) {
+        return _logr_errno(EINVAL);
+    }
+
+    logr = __atomic_load_n(&logr->target, __ATOMIC_ACQUIRE);
+    _logr_dedup_flush(logr);
+    logr_lock(logr);
+    retval = _logr_commit(logr, &logr->out);
+    if (_logr_uring_wait(logr) < 0) {
+        retval = -1;
+    }
+#ifndef __WIN32
+    for (i = 0; i < logr->nsinks; i++) {
+        if (logr->sinks[i].syslog != NULL) {
+            _logr_syslog_flush(logr->sinks[i].syslog);
+        }
+    }
+#endif
+    logr_unlock(logr);
+    return retval;
+}
+
+int
+logr_get_stats(logr_t *logr, struct logr_stats *stats)
+{
+    struct logr_stripe *st;
+    int i;
+
+    if ((logr == NULL) || (stats == NULL)) {
+        return _logr_errno(EINVAL);
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    for (i = 0; i < LOGR_STRIPES; i++) {
+        st = &logr->stripes[i];
+        stats->emitted += __atomic_load_n(&st->emitted, __ATOMIC_RELAXED);
+        stats->filtered += __atomic_load_n(&st->filtered, __ATOMIC_RELAXED);
+        stats->dropped += __atomic_load_n(&st->dropped, __ATOMIC_RELAXED);
+        stats->lock_wait_ns += __atomic_load_n(&st->lock_wait_ns,
+                                               __ATOMIC_RELAXED);
+        stats->rotate_errors += __atomic_load_n(&st->rotate_errors,
+                                                __ATOMIC_RELAXED);
+    }
+    logr_lock(logr);
+    stats->bytes = logr->bytes;
+    stats->flushes = logr->flushes;
+    stats->rotations = logr->rotations;
+    stats->rotate_errors += logr->rotate_errors;
+    stats->write_errors = logr->write_errors;
+    logr_unlock(logr);
+    return 0;
+}
+
+#ifndef __WIN32
+/* Set for good once a crash handler runs, see _logr_crash_flush. */
+static int logr_crashing;
+
+/*
+ * Stop the writer or merge thread for good once a crash handler runs,
+ * before it renders or writes anything more.  Its batch is left to the
+ * handler, and logr->lock is let go of for it.  With logr->lock.
+ */
+static void
+_logr_crash_park(logr_t *logr)
+{
+    if (__atomic_load_n(&logr_crashing, __ATOMIC_ACQUIRE)) {
+        logr_unlock(logr);
+        for (;;) {
+            pause();
+        }
+    }
+}
+
+/* Write one queued record, batching writes.  With logr->lock. */
+static void
+_logr_drain_one(logr_t *logr, const struct logr_qrec *qr, struct logr_buf *b)
+{
+    struct logr_record rec;
+    int n;
+
+    rec.file = qr->file;
+    rec.line = qr->line;
+    rec.func = qr->func;
+    rec.pretty_func = qr->pretty_func;
+    rec.level = qr->level;
+    rec.ts = qr->ts;
+    rec.pid = 0;
+    rec.kv = qr->kv;
+    rec.msg = (const char *)(qr + 1);
+    rec.len = qr->len;
+    n = _logr_emit(logr, &rec, b);
+
+    /* batch entries into large writes but rotate at the same point */
+    if (logr->buffered ? _logr_flush_due(logr, b, rec.level) :
+        ((b->len >= LOGR_BATCH_SIZE) ||
+         ((n > 0) && (_logr_cfg(logr)->threshold != 0) &&
+          (logr->size + (off_t)b->len > _logr_cfg(logr)->threshold)))) {
+        _logr_commit(logr, b);
+    }
+}
+
+static void
+_logr_drain_dropped(struct logr_buf *b, unsigned long dropped)
+{
+    if (dropped != 0) {
+        _logr_buf_puts(b, "*** logr: ");
+        _logr_buf_putd(b, dropped);
+        _logr_buf_puts(b, " records dropped ***\n");
+    }
+}
+
+/*
+ * Drain 'used' bytes from the ring starting at 'head'.  The region belongs
+ * to the writer until q->head is advanced so producers never touch it.
+ */
+static void
+_logr_drain(logr_t *logr, struct logr_queue *q, size_t head, size_t used,
+            unsigned long dropped)
+{
+    struct logr_qrec *qr;
+    struct logr_buf *b;
+    size_t done = 0;
+
+    logr_lock(logr);
+    b = logr->buffered ? &logr->out : _logr_tls();
+    q->batch = logr->buffered ? NULL : b;
+    while (done < used) {
+        if ((head == q->size) || ((qr = (void *)(q->buf + head))->size == 0)) {
+            /* wrap marker: the rest of the ring is unused */
+            done += q->size - head;
+            head = 0;
+            continue;
+        }
+
+        _logr_crash_park(logr);
+        _logr_drain_one(logr, qr, b);
+
+        head += qr->size;
+        done += qr->size;
+        __atomic_store_n(&q->drained, done, __ATOMIC_RELEASE);
+    }
+
+    _logr_crash_park(logr);
+    _logr_drain_dropped(b, dropped);
+    if (!logr->buffered) {
+        _logr_commit(logr, b);
+    }
+    logr_unlock(logr);
+}
+
+static void *
+_logr_writer(void *arg)
+{
+    logr_t *logr = (logr_t *)arg;
+    struct logr_queue *q = logr->queue;
+    size_t head, used;
+    unsigned long dropped;
+
+    pthread_mutex_lock(&q->lock);
+    for (;;) {
+        while ((q->used == 0) && (q->dropped == 0) && !q->stop) {
+            pthread_cond_wait(&q->cond, &q->lock);
+        }
+        if ((q->used == 0) && (q->dropped == 0)) {
+            break;
+        }
+        head = q->head;
+        used = q->used;
+        dropped = q->dropped;
+        q->dropped = 0;
+        pthread_mutex_unlock(&q->lock);
+
+        _logr_drain(logr, q, head, used, dropped);
+
+        pthread_mutex_lock(&q->lock);
+        q->head = (head + used) % q->size;
+        q->used -= used;
+        __atomic_store_n(&q->drained, 0, __ATOMIC_RELEASE);
+    }
+    q->head = q->tail = 0;
+    pthread_mutex_unlock(&q->lock);
+
+    /* nothing may be left behind in the flush policy buffer */
+    logr_lock(logr);
+    _logr_crash_park(logr);
+    _logr_commit(logr, &logr->out);
+    logr_unlock(logr);
+    return NULL;
+}
+
+/*
+ * Reserve 'need' contiguous bytes in the ring.  Called with q->lock.
+ * Returns the offset of the reservation or -1 if the ring is full.
+ */
+static long
+_logr_reserve(struct logr_queue *q, size_t need)
+{
+    size_t pos;
+
+    if (q->used == 0) {
+        q->head = q->tail = 0;
+    }
+
+    if ((q->tail > q->head) || (q->used == 0)) {
+        if (need <= q->size - q->tail) {
+            pos = q->tail;
+        } else if (need <= q->head) {
+            /* not enough room at the end, wrap around */
+            if (q->tail < q->size) {
+                ((struct logr_qrec *)(q->buf + q->tail))->size = 0;
+            }
+            q->used += q->size - q->tail;
+            pos = 0;
+        } else {
+            return -1;
+        }
+    } else if (need <= q->head - q->tail) {
+        pos = q->tail;
+    } else {
+        return -1;
+    }
+
+    q->tail = pos + need;
+    q->used += need;
+    return pos;
+}
+
+/* Queue a record whose message is already rendered. */
+static int
+_logr_enqueue_rec(logr_t *logr, struct logr_queue *q,
+                  const struct logr_record *rec)
+{
+    struct logr_qrec *qr;
+    struct logr_buf b = { NULL, 0, 0 };
+    size_t need;
+    long pos;
+    int n;
+
+    need = LOGR_QALIGN(sizeof(struct logr_qrec) + rec->len);
+
+    pthread_mutex_lock(&q->lock);
+    if (!q->active) {
+        /* asynchronous mode was switched off underneath us */
+        pthread_mutex_unlock(&q->lock);
+        logr_lock(logr);
+        n = _logr_emit(logr, rec, &b);
+        if (_logr_commit(logr, &b) < 0) {
+            n = -1;
+        }
+        logr_unlock(logr);
+        free(b.data);
+        return n;
+    }
+
+    pos = (need <= q->size) ? _logr_reserve(q, need) : -1;
+    if (pos < 0) {
+        q->dropped++;
+        pthread_mutex_unlock(&q->lock);
+        _logr_count(&_logr_stripe(logr)->dropped, 1);
+        return _logr_errno(EAGAIN);
+    }
+
+    qr = (struct logr_qrec *)(q->buf + pos);
+    qr->size = need;
+    qr->level = rec->level;
+    qr->line = rec->line;
+    qr->kv = rec->kv;
+    qr->file = rec->file;
+    qr->func = rec->func;
+    qr->pretty_func = rec->pretty_func;
+    qr->ts = rec->ts;
+    qr->len = rec->len;
+    memcpy(qr + 1, rec->msg, rec->len);
+
+    if (q->used == need) {
+        /* the ring was empty so the writer may be sleeping */
+        pthread_cond_signal(&q->cond);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return rec->len;
+}
+
+static int
+_logr_enqueue(logr_t *logr, struct logr_queue *q, struct logr_record *rec,
+              const char *fmt, va_list ap)
+{
+    struct logr_buf *msg = _logr_tls();
+
+    if (_logr_buf_vprintf(msg, fmt, ap) < 0) {
+        return -1;
+    }
+    rec->msg = msg->data;
+    rec->len = msg->len;
+    return _logr_enqueue_rec(logr, q, rec);
+}
+
+/* Stop the writer thread after it has drained the queue. */
+static void
+_logr_async_stop(struct logr_queue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    if (!q->active) {
+        pthread_mutex_unlock(&q->lock);
+        return;
+    }
+    __atomic_store_n(&q->active, false, __ATOMIC_RELAXED);
+    q->stop = true;
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+
+    pthread_join(q->thread, NULL);
+
+    pthread_mutex_lock(&q->lock);
+    free(q->buf);
+    q->buf = NULL;
+    q->size = 0;
+    pthread_mutex_unlock(&q->lock);
+}
+
+static struct logr_queue *logr_queues;
+static pthread_mutex_t logr_queues_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Flush every asynchronous logger when the process exits. */
+static void
+_logr_async_atexit(void)
+{
+    struct logr_queue *q;
+
+    pthread_mutex_lock(&logr_queues_lock);
+    for (q = logr_queues; q != NULL; q = q->next) {
+        _logr_async_stop(q);
+    }
+    pthread_mutex_unlock(&logr_queues_lock);
+}
+
+static struct logr_queue *
+_logr_queue_alloc(logr_t *logr)
+{
+    static bool registered = false;
+    struct logr_queue *q;
+
+    q = (struct logr_queue *)calloc(1, sizeof(struct logr_queue));
+    if (q == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->cond, NULL);
+
+    pthread_mutex_lock(&logr_queues_lock);
+    if (!registered) {
+        atexit(_logr_async_atexit);
+        registered = true;
+    }
+    q->next = logr_queues;
+    logr_queues = q;
+    pthread_mutex_unlock(&logr_queues_lock);
+
+    __atomic_store_n(&logr->queue, q, __ATOMIC_RELEASE);
+    return q;
+}
+
+static void
+_logr_queue_free(struct logr_queue *q)
+{
+    struct logr_queue **pq;
+
+    _logr_async_stop(q);
+
+    pthread_mutex_lock(&logr_queues_lock);
+    for (pq = &logr_queues; *pq != NULL; pq = &(*pq)->next) {
+        if (*pq == q) {
+            *pq = q->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&logr_queues_lock);
+
+    pthread_cond_destroy(&q->cond);
+    pthread_mutex_destroy(&q->lock);
+    free(q);
+}
+#endif
+
+int
+logr_set_async(logr_t *logr, size_t queue_bytes)
+{
+#ifdef __WIN32
+    return _logr_errno(ENOTSUP);
+#else
+    struct logr_queue *q;
+    char *buf = NULL;
+    int retval;
+
+    if (logr == NULL) {
+        return _logr_errno(EINVAL);
+    }
+
+    if (queue_bytes != 0) {
+        if (queue_bytes < LOGR_MIN_QUEUE_SIZE) {
+            queue_bytes = LOGR_MIN_QUEUE_SIZE;
+        }
+        queue_bytes = queue_bytes & ~((size_t)7);
+        buf = (char *)malloc(queue_bytes);
+        if (buf == NULL) {
+            return _logr_errno(ENOMEM);
+        }
+    }
+
+    q = logr->queue;
+    if (q == NULL) {
+        if (queue_bytes == 0) {
+            return 0;
+        }
+        q = _logr_queue_alloc(logr);
+        if (q == NULL) {
+            free(buf);
+            return _logr_errno(ENOMEM);
+        }
+    }
+
+    /* drain and stop any previous writer, then restart with the new ring */
+    _logr_async_stop(q);
+    if (queue_bytes == 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&q->lock);
+    q->buf = buf;
+    q->size = queue_bytes;
+    q->head = q->tail = q->used = 0;
+    q->stop = false;
+    retval = pthread_create(&q->thread, NULL, _logr_writer, logr);
+    if (retval != 0) {
+        q->buf = NULL;
+        q->size = 0;
+        pthread_mutex_unlock(&q->lock);
+        free(buf);
+        return _logr_errno(retval);
+    }
+    __atomic_store_n(&q->active, true, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+#endif
+}
+
+#ifndef __WIN32
+/*
+ * Sharded logging.
+ *
+ * Every thread formats its messages into a ring of its own, so producers
+ * share nothing but the sequence counter.  A merge thread repeatedly takes
+ * the record with the lowest sequence number off the rings, adds the
+ * prefix and writes it, keeping the file in the order the calls were
+ * made.  Rings are single producer, single consumer and lock free.
+ */
+struct logr_shard {
+    struct logr_shard *next;  /* in the set, changed with set->lock */
+    char *buf;
+    size_t size;              /* a power of two */
+    uint64_t head;            /* consumed, written by the merge thread */
+    uint64_t tail;            /* published, written by the owning thread */
+    unsigned long dropped;
+    int refs;                 /* the owning thread and the set */
+    int writing;              /* the owner is between enter and publish */
+    bool dead;                /* the set was stopped */
+};
+
+struct logr_shards {
+    uint64_t seq __attribute__((aligned(64)));
+    logr_t *logr __attribute__((aligned(64)));
+    pthread_mutex_t lock;
+    pthread_cond_t cond;      /* wakes the merge thread */
+    pthread_t thread;
+    struct logr_shard *list;
+    size_t shard_size;
+    int sleeping;
+    bool active;
+    bool stop;
+    struct logr_shards *next; /* list of sets stopped at exit */
+    struct logr_buf *batch;   /* the merger's, see _logr_crash_flush */
+};
+
+/* A thread's rings, one per sharded logger it has used. */
+struct logr_shard_ref {
+    struct logr_shard_ref *next;
+    struct logr_shards *set;
+    struct logr_shard *shard;
+};
+
+static __thread struct logr_shard_ref *logr_tls_shards;
+static pthread_key_t logr_shard_key;
+static pthread_once_t logr_shard_once = PTHREAD_ONCE_INIT;
+
+static struct logr_shards *logr_shard_sets;
+static pthread_mutex_t logr_shard_sets_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+_logr_shard_release(struct logr_shard *s)
+{
+    if (__atomic_sub_fetch(&s->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(s->buf);
+        free(s);
+    }
+}
+
+/* Thread exit: the merge thread frees the rings once they are empty. */
+static void
+_logr_shard_exit(void *arg)
+{
+    struct logr_shard_ref *r, *next;
+
+    for (r = logr_tls_shards; r != NULL; r = next) {
+        next = r->next;
+        _logr_shard_release(r->shard);
+        free(r);
+    }
+    logr_tls_shards = NULL;
+}
+
+static void
+_logr_shard_init(void)
+{
+    pthread_key_create(&logr_shard_key, _logr_shard_exit);
+}
+
+/* Find or create this thread's ring for the set. */
+static struct logr_shard *
+_logr_shard_get(struct logr_shards *set)
+{
+    struct logr_shard_ref *r, **pr = &logr_tls_shards;
+    struct logr_shard *s;
+
+    while ((r = *pr) != NULL) {
+        if (__atomic_load_n(&r->shard->dead, __ATOMIC_RELAXED)) {
+            *pr = r->next;
+            _logr_shard_release(r->shard);
+            free(r);
+            continue;
+        }
+        if (r->set == set) {
+            return r->shard;
+        }
+        pr = &r->next;
+    }
+
+    pthread_once(&logr_shard_once, _logr_shard_init);
+    r = (struct logr_shard_ref *)malloc(sizeof(struct logr_shard_ref));
+    s = (struct logr_shard *)calloc(1, sizeof(struct logr_shard));
+    if (s != NULL) {
+        /* checked again below, the set may restart with another size */
+        s->size = __atomic_load_n(&set->shard_size, __ATOMIC_RELAXED);
+    }
+    if ((r == NULL) || (s == NULL) ||
+            ((s->buf = (char *)malloc(s->size)) == NULL)) {
+        free(r);
+        free(s);
+        return NULL;
+    }
+    s->refs = 2;
+
+    pthread_mutex_lock(&set->lock);
+    if (!set->active || (s->size != set->shard_size)) {
+        pthread_mutex_unlock(&set->lock);
+        free(s->buf);
+        free(s);
+        free(r);
+        return NULL;
+    }
+    s->next = set->list;
+    __atomic_store_n(&set->list, s, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&set->lock);
+
+    r->set = set;
+    r->shard = s;
+    r->next = logr_tls_shards;
+    logr_tls_shards = r;
+    pthread_setspecific(logr_shard_key, r);
+    return s;
+}
+
+/*
+ * Claim this thread's ring for one entry.  Returns NULL if the set is
+ * being stopped, and the entry must be written directly.
+ */
+static struct logr_shard *
+_logr_shard_enter(struct logr_shards *set)
+{
+    struct logr_shard *s = _logr_shard_get(set);
+
+    if (s == NULL) {
+        return NULL;
+    }
+    /* pairs with the fence in _logr_shards_stop() */
+    __atomic_store_n(&s->writing, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&s->dead, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&s->writing, 0, __ATOMIC_RELEASE);
+        return NULL;
+    }
+    return s;
+}
+
+/* Done writing to s, wake the writer if it sleeps. */
+static void
+_logr_shard_leave(struct logr_shards *set, struct logr_shard *s)
+{
+    /* also orders the tail store before reading set->sleeping */
+    __atomic_store_n(&s->writing, 0, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&set->sleeping, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&set->lock);
+        pthread_cond_signal(&set->cond);
+        pthread_mutex_unlock(&set->lock);
+    }
+}
+
+/* Append a record whose message is already rendered to s, then leave it. */
+static int
+_logr_shard_put(struct logr_shards *set, struct logr_shard *s,
+                const struct logr_record *rec)
+{
+    struct logr_qrec *qr;
+    uint64_t head, tail = s->tail;
+    size_t need, pos, skip = 0;
+    int retval = rec->len;
+
+    need = LOGR_QALIGN(sizeof(struct logr_qrec) + rec->len);
+
+    head = __atomic_load_n(&s->head, __ATOMIC_ACQUIRE);
+    pos = tail & (s->size - 1);
+    if (s->size - pos < need) {
+        /* records don't wrap, skip the rest of the ring */
+        skip = s->size - pos;
+    }
+    if ((need > s->size) || (tail + skip + need - head > s->size)) {
+        __atomic_add_fetch(&s->dropped, 1, __ATOMIC_RELAXED);
+        _logr_count(&_logr_stripe(set->logr)->dropped, 1);
+        retval = _logr_errno(EAGAIN);
+        goto out;
+    }
+    if (skip != 0) {
+        if (skip >= sizeof(struct logr_qrec)) {
+            ((struct logr_qrec *)(s->buf + pos))->size = 0;
+        }
+        tail += skip;
+        pos = 0;
+    }
+
+    qr = (struct logr_qrec *)(s->buf + pos);
+    qr->size = need;
+    qr->level = rec->level;
+    qr->line = rec->line;
+    qr->kv = rec->kv;
+    qr->file = rec->file;
+    qr->func = rec->func;
+    qr->pretty_func = rec->pretty_func;
+    qr->ts = rec->ts;
+    qr->len = rec->len;
+    memcpy(qr + 1, rec->msg, rec->len);
+    qr->seq = __atomic_fetch_add(&set->seq, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->tail, tail + need, __ATOMIC_RELEASE);
+
+out:
+    _logr_shard_leave(set, s);
+    return retval;
+}
+
+static int
+_logr_shard_log(struct logr_shards *set, struct logr_shard *s,
+                struct logr_record *rec, const char *fmt, va_list ap)
+{
+    struct logr_buf *msg = _logr_tls();
+
+    if (_logr_buf_vprintf(msg, fmt, ap) < 0) {
+        _logr_shard_leave(set, s);
+        return -1;
+    }
+    rec->msg = msg->data;
+    rec->len = msg->len;
+    return _logr_shard_put(set, s, rec);
+}
+
+/* The oldest record in the ring, or NULL if it is empty. */
+static struct logr_qrec *
+_logr_shard_peek(struct logr_shard *s)
+{
+    uint64_t tail = __atomic_load_n(&s->tail, __ATOMIC_ACQUIRE);
+    struct logr_qrec *qr;
+    size_t pos;
+
+    while (s->head != tail) {
+        pos = s->head & (s->size - 1);
+        qr = (struct logr_qrec *)(s->buf + pos);
+        if ((s->size - pos < sizeof(struct logr_qrec)) || (qr->size == 0)) {
+            __atomic_store_n(&s->head, s->head + s->size - pos,
+                             __ATOMIC_RELEASE);
+            continue;
+        }
+        return qr;
+    }
+    return NULL;
+}
+
+/*
+ * Write records in sequence order for as long as the next one is
+ * available.  Returns the number written, or -1 if the next sequence
+ * number was taken but isn't published yet.
+ */
+static int
+_logr_merge(struct logr_shards *set, uint64_t *next)
+{
+    logr_t *logr = set->logr;
+    struct logr_shard *s, *best;
+    struct logr_qrec *qr, *min;
+    unsigned long dropped = 0;
+    struct logr_buf *b;
+    int n = 0;
+
+    logr_lock(logr);
+    b = logr->buffered ? &logr->out : _logr_tls();
+    set->batch = logr->buffered ? NULL : b;
+    for (;;) {
+        best = NULL;
+        min = NULL;
+        for (s = __atomic_load_n(&set->list, __ATOMIC_ACQUIRE); s != NULL;
+                s = s->next) {
+            qr = _logr_shard_peek(s);
+            if ((qr != NULL) && ((min == NULL) || (qr->seq < min->seq))) {
+                best = s;
+                min = qr;
+            }
+        }
+        if ((min == NULL) || (min->seq != *next)) {
+            if ((min != NULL) && (n == 0)) {
+                n = -1;
+            }
+            break;
+        }
+        /* consecutive records from the same thread need no search */
+        do {
+            _logr_crash_park(logr);
+            _logr_drain_one(logr, min, b);
+            __atomic_store_n(&best->head, best->head + min->size,
+                             __ATOMIC_RELEASE);
+            (*next)++;
+            n++;
+            min = _logr_shard_peek(best);
+        } while ((min != NULL) && (min->seq == *next));
+    }
+
+    _logr_crash_park(logr);
+    for (s = __atomic_load_n(&set->list, __ATOMIC_ACQUIRE); s != NULL;
+            s = s->next) {
+        dropped += __atomic_exchange_n(&s->dropped, 0, __ATOMIC_RELAXED);
+    }
+    _logr_drain_dropped(b, dropped);
+    if (!logr->buffered) {
+        _logr_commit(logr, b);
+    }
+    logr_unlock(logr);
+    return n;
+}
+
+/* Free the rings of threads which have exited, once they are empty. */
+static void
+_logr_shards_reap(struct logr_shards *set)
+{
+    struct logr_shard *s, **ps;
+
+    pthread_mutex_lock(&set->lock);
+    for (ps = &set->list; (s = *ps) != NULL; ) {
+        if ((__atomic_load_n(&s->refs, __ATOMIC_ACQUIRE) == 1) &&
+                (_logr_shard_peek(s) == NULL)) {
+            *ps = s->next;
+            _logr_shard_release(s);
+            continue;
+        }
+        ps = &s->next;
+    }
+    pthread_mutex_unlock(&set->lock);
+}
+
+static bool
+_logr_shards_empty(struct logr_shards *set)
+{
+    struct logr_shard *s;
+
+    for (s = __atomic_load_n(&set->list, __ATOMIC_ACQUIRE); s != NULL;
+            s = s->next) {
+        if ((_logr_shard_peek(s) != NULL) ||
+                (__atomic_load_n(&s->dropped, __ATOMIC_RELAXED) != 0)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void *
+_logr_merger(void *arg)
+{
+    struct logr_shards *set = (struct logr_shards *)arg;
+    logr_t *logr = set->logr;
+    struct timespec ts;
+    uint64_t next = 0;
+    int n;
+
+    for (;;) {
+        n = _logr_merge(set, &next);
+        if (n > 0) {
+            continue;
+        }
+        if (n < 0) {
+            /* a thread is between taking a number and publishing */
+            sched_yield();
+            continue;
+        }
+
+        _logr_shards_reap(set);
+        pthread_mutex_lock(&set->lock);
+        if (set->stop) {
+            pthread_mutex_unlock(&set->lock);
+            if (_logr_shards_empty(set)) {
+                break;
+            }
+            continue;
+        }
+        __atomic_store_n(&set->sleeping, 1, __ATOMIC_SEQ_CST);
+        if (_logr_shards_empty(set)) {
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += 1;
+            pthread_cond_timedwait(&set->cond, &set->lock, &ts);
+        }
+        __atomic_store_n(&set->sleeping, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&set->lock);
+    }
+
+    /* nothing may be left behind in the flush policy buffer */
+    logr_lock(logr);
+    _logr_crash_park(logr);
+    _logr_commit(logr, &logr->out);
+    logr_unlock(logr);
+    return NULL;
+}
+
+/* Write out everything queued and stop the merge thread. */
+static void
+_logr_shards_stop(struct logr_shards *set)
+{
+    struct logr_shard *s, *next;
+
+    pthread_mutex_lock(&set->lock);
+    if (!set->active) {
+        pthread_mutex_unlock(&set->lock);
+        return;
+    }
+    __atomic_store_n(&set->active, false, __ATOMIC_RELAXED);
+    for (s = set->list; s != NULL; s = s->next) {
+        __atomic_store_n(&s->dead, true, __ATOMIC_RELAXED);
+    }
+
+    /*
+     * Wait for threads which got in before the rings were closed.  The
+     * lock keeps the merge thread from reaping rings under the walk;
+     * writers don't take it until they have left their ring.
+     */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (s = set->list; s != NULL; s = s->next) {
+        while (__atomic_load_n(&s->writing, __ATOMIC_ACQUIRE)) {
+            sched_yield();
+        }
+    }
+
+    set->stop = true;
+    pthread_cond_signal(&set->cond);
+    pthread_mutex_unlock(&set->lock);
+    pthread_join(set->thread, NULL);
+
+    for (s = set->list; s != NULL; s = next) {
+        next = s->next;
+        _logr_shard_release(s);
+    }
+    set->list = NULL;
+}
+
+static void
+_logr_shards_atexit(void)
+{
+    struct logr_shards *set;
+
+    pthread_mutex_lock(&logr_shard_sets_lock);
+    for (set = logr_shard_sets; set != NULL; set = set->next) {
+        _logr_shards_stop(set);
+    }
+    pthread_mutex_unlock(&logr_shard_sets_lock);
+}
+
+static struct logr_shards *
+_logr_shards_alloc(logr_t *logr)
+{
+    static bool registered = false;
+    struct logr_shards *set;
+
+    set = (struct logr_shards *)calloc(1, sizeof(struct logr_shards));
+    if (set == NULL) {
+        return NULL;
+    }
+    set->logr = logr;
+    pthread_mutex_init(&set->lock, NULL);
+    pthread_cond_init(&set->cond, NULL);
+
+    pthread_mutex_lock(&logr_shard_sets_lock);
+    if (!registered) {
+        atexit(_logr_shards_atexit);
+        registered = true;
+    }
+    set->next = logr_shard_sets;
+    logr_shard_sets = set;
+    pthread_mutex_unlock(&logr_shard_sets_lock);
+
+    __atomic_store_n(&logr->shards, set, __ATOMIC_RELEASE);
+    return set;
+}
+
+static void
+_logr_shards_free(struct logr_shards *set)
+{
+    struct logr_shards **ps;
+
+    _logr_shards_stop(set);
+
+    pthread_mutex_lock(&logr_shard_sets_lock);
+    for (ps = &logr_shard_sets; *ps != NULL; ps = &(*ps)->next) {
+        if (*ps == set) {
+            *ps = set->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&logr_shard_sets_lock);
+
+    pthread_cond_destroy(&set->cond);
+    pthread_mutex_destroy(&set->lock);
+    free(set);
+}
+#endif
+
+int
+logr_set_sharded(logr_t *logr, size_t shard_bytes)
+{
+#ifdef __WIN32
+    return _logr_errno(ENOTSUP);
+#else
+    struct logr_shards *set;
+    size_t size = LOGR_MIN_QUEUE_SIZE;
+    int retval;
+
+    if (logr == NULL) {
+        return _logr_errno(EINVAL);
+    }
+    while (size < shard_bytes) {
+        size *= 2;
+    }
+
+    set = logr->shards;
+    if (set == NULL) {
+        if (shard_bytes == 0) {
+            return 0;
+        }
+        set = _logr_shards_alloc(logr);
+        if (set == NULL) {
+            return _logr_errno(ENOMEM);
+        }
+    }
+
+    /* drain and stop the previous rings, then start over */
+    _logr_shards_stop(set);
+    if (shard_bytes == 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&set->lock);
+    __atomic_store_n(&set->shard_size, size, __ATOMIC_RELAXED);
+    set->seq = 0;
+    set->stop = false;
+    retval = pthread_create(&set->thread, NULL, _logr_merger, set);
+    if (retval != 0) {
+        pthread_mutex_unlock(&set->lock);
+        return _logr_errno(retval);
+    }
+    __atomic_store_n(&set->active, true, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&set->lock);
+    return 0;
+#endif
+}
+
+/*
+ * Flight recorder, see logr_set_flight_recorder.
+ *
+ * A ring of fixed size slots, each holding a queued record cut to fit.
+ * Writers take record number n by bumping next and never wait: the stamp
+ * of a slot is odd while a record is written into it and even once done,
+ * and readers copy a slot out and keep it only if the stamp was the same
+ * before and after.  A writer finding its slot still being written, by a
+ * writer the whole ring behind, drops its record.
+ */
+#define LOGR_FLIGHT_SLOT 512
+
+struct logr_flight_slot {
+    uint64_t stamp;           /* 2n + 1 while record n is written, 2n + 2 */
+    struct logr_qrec qr;      /* followed by the message */
+};
+
+#define LOGR_FLIGHT_MSG (LOGR_FLIGHT_SLOT - sizeof(struct logr_flight_slot))
+
+struct logr_flight {
+    unsigned int level;       /* most verbose level kept */
+    int dump_level;           /* entries this severe dump the ring first */
+    size_t count;             /* slots, a power of two */
+    uint64_t next;            /* records ever put */
+    uint64_t dumped;          /* ... of which were dumped */
+    struct logr_flight *retired; /* rings replaced, freed by logr_free */
+    char *slots;
+};
+
+/* The slot for a new record, or NULL if it is busy. */
+static struct logr_flight_slot *
+_logr_flight_claim(struct logr_flight *fl, const struct logr_record *rec)
+{
+    uint64_t n = __atomic_fetch_add(&fl->next, 1, __ATOMIC_RELAXED);
+    struct logr_flight_slot *s;
+    uint64_t stamp;
+
+    s = (struct logr_flight_slot *)
+        (fl->slots + (n & (fl->count - 1)) * LOGR_FLIGHT_SLOT);
+    stamp = __atomic_load_n(&s->stamp, __ATOMIC_RELAXED);
+    if ((stamp & 1) ||
+            !__atomic_compare_exchange_n(&s->stamp, &stamp, 2 * n + 1, false,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    s->qr.size = LOGR_FLIGHT_SLOT;
+    s->qr.level = rec->level;
+    s->qr.line = rec->line;
+    s->qr.kv = rec->kv;
+    s->qr.file = rec->file;
+    s->qr.func = rec->func;
+    s->qr.pretty_func = rec->pretty_func;
+    s->qr.ts = rec->ts;
+    s->qr.seq = n;
+    return s;
+}
+
+/* Finish the record in s, n bytes long before cutting it to fit. */
+static void
+_logr_flight_publish(struct logr_flight_slot *s, long n)
+{
+    char *msg = (char *)(&s->qr + 1);
+
+    if (n < 0) {
+        n = 0;
+    } else if ((size_t)n >= LOGR_FLIGHT_MSG) {
+        n = LOGR_FLIGHT_MSG - 1;
+        msg[n - 1] = '\n';
+    }
+    s->qr.len = n;
+    __atomic_store_n(&s->stamp, 2 * s->qr.seq + 2, __ATOMIC_RELEASE);
+}
+
+static void
+_logr_flight_vprintf(struct logr_flight *fl, const struct logr_record *rec,
+                     const char *fmt, va_list ap)
+{
+    struct logr_flight_slot *s = _logr_flight_claim(fl, rec);
+
+    if (s != NULL) {
+        _logr_flight_publish(s, vsnprintf((char *)(&s->qr + 1),
+                                          LOGR_FLIGHT_MSG, fmt, ap));
+    }
+}
+
+/* Keep a record whose message is already rendered. */
+static void
+_logr_flight_put(struct logr_flight *fl, const struct logr_record *rec)
+{
+    struct logr_flight_slot *s = _logr_flight_claim(fl, rec);
+    size_t len = rec->len;
+
+    if (s == NULL) {
+        return;
+    }
+    if (len > LOGR_FLIGHT_MSG) {
+        len = LOGR_FLIGHT_MSG;
+    }
+    memcpy(&s->qr + 1, rec->msg, len);
+    _logr_flight_publish(s, rec->len);
+}
+
+/*
+ * Copy record n into copy, a LOGR_FLIGHT_SLOT sized buffer.  Returns false
+ * if it was overwritten or is being written.  Async-signal-safe.
+ */
+static bool
+_logr_flight_get(struct logr_flight *fl, uint64_t n,
+                 struct logr_flight_slot *copy)
+{
+    struct logr_flight_slot *s;
+    uint64_t stamp;
+
+    s = (struct logr_flight_slot *)
+        (fl->slots + (n & (fl->count - 1)) * LOGR_FLIGHT_SLOT);
+    stamp = __atomic_load_n(&s->stamp, __ATOMIC_ACQUIRE);
+    if (stamp != 2 * n + 2) {
+        return false;
+    }
+    memcpy(copy, s, LOGR_FLIGHT_SLOT);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return (__atomic_load_n(&s->stamp, __ATOMIC_RELAXED) == stamp) &&
+        (copy->qr.len < LOGR_FLIGHT_MSG);
+}
+
+/* Free fl and the rings it replaced. */
+static void
+_logr_flight_free(struct logr_flight *fl)
+{
+    struct logr_flight *next;
+
+    for (; fl != NULL; fl = next) {
+        next = fl->retired;
+        free(fl->slots);
+        free(fl);
+    }
+}
+
+/* The records not dumped yet, as [*start, return value). */
+static uint64_t
+_logr_flight_take(struct logr_flight *fl, uint64_t *start)
+{
+    uint64_t end = __atomic_load_n(&fl->next, __ATOMIC_ACQUIRE);
+
+    *start = __atomic_exchange_n(&fl->dumped, end, __ATOMIC_ACQ_REL);
+    if ((*start > end) || (end - *start > fl->count)) {
+        *start = (end > fl->count) ? end - fl->count : 0;
+    }
+    return end;
+}
+
+/* Whether the entries of logr go through a queue or shards. */
+static inline bool
+_logr_queued(logr_t *logr)
+{
+#ifndef __WIN32
+    struct logr_queue *q = __atomic_load_n(&logr->queue, __ATOMIC_ACQUIRE);
+    struct logr_shards *set = __atomic_load_n(&logr->shards,
+                                              __ATOMIC_ACQUIRE);
+
+    return ((q != NULL) && __atomic_load_n(&q->active, __ATOMIC_RELAXED)) ||
+           ((set != NULL) && __atomic_load_n(&set->active, __ATOMIC_RELAXED));
+#else
+    return false;
+#endif
+}
+
+/* Add a marker line to b, or queue it if b is NULL. */
+static int
+_logr_flight_marker(logr_t *logr, struct logr_buf *b, const char *line)
+{
+    struct logr_record rec = {
+        .level = LOGR_DEBUG, .kv = LOGR_KV_RAW, .msg = line,
+        .len = strlen(line)
+    };
+
+    if (b != NULL) {
+        return _logr_buf_put(b, rec.msg, rec.len);
+    }
+    _logr_now(&rec.ts);
+    return _logr_put(logr, &rec);
+}
+
+/*
+ * Write the records not dumped yet to logr, which writes for itself.  With
+ * a queue or shards they are queued like any entry, after those queued
+ * already.
+ */
+static int
+_logr_flight_dump(logr_t *logr, struct logr_flight *fl)
+{
+    union {
+        struct logr_flight_slot s;
+        char buf[LOGR_FLIGHT_SLOT];
+    } copy;
+    struct logr_record rec;
+    struct logr_buf *b = NULL;
+    uint64_t n, end;
+    unsigned long count = 0;
+    char line[64];
+    int retval = 0;
+
+    if (__atomic_load_n(&logr->binary, __ATOMIC_RELAXED)) {
+        return _logr_errno(ENOTSUP);
+    }
+    end = _logr_flight_take(fl, &n);
+    if (n == end) {
+        return 0;
+    }
+
+    if (!_logr_queued(logr)) {
+        logr_lock(logr);
+        b = logr->buffered ? &logr->out : _logr_tls();
+    }
+    if (_logr_flight_marker(logr, b, "*** logr: flight recorder ***\n") < 0) {
+        retval = -1;
+    }
+    for (; n < end; n++) {
+        if (!_logr_flight_get(fl, n, &copy.s)) {
+            continue;
+        }
+        rec.file = copy.s.qr.file;
+        rec.line = copy.s.qr.line;
+        rec.func = copy.s.qr.func;
+        rec.pretty_func = copy.s.qr.pretty_func;
+        rec.level = copy.s.qr.level;
+        rec.ts = copy.s.qr.ts;
+        rec.pid = 0;
+        rec.kv = copy.s.qr.kv;
+        rec.msg = (const char *)(&copy.s.qr + 1);
+        rec.len = copy.s.qr.len;
+        count++;
+        if (b == NULL) {
+            if (_logr_put(logr, &rec) < 0) {
+                retval = -1;
+            }
+            continue;
+        }
+        _logr_emit(logr, &rec, b);
+        if (!logr->buffered && (b->len >= LOGR_BATCH_SIZE)) {
+            _logr_commit(logr, b);
+        }
+    }
+    snprintf(line, sizeof(line),
+             "*** logr: end of flight recorder, %lu entries ***\n", count);
+    if (_logr_flight_marker(logr, b, line) < 0) {
+        retval = -1;
+    }
+    if (b != NULL) {
+        if (_logr_commit(logr, b) < 0) {
+            retval = -1;
+        }
+        logr_unlock(logr);
+    }
+    return retval;
+}
+
+/*
+ * The level the macros test lets through what the flight recorder keeps
+ * as well.  With logr->cfg_lock.
+ */
+static void
+_logr_update_gate(logr_t *logr)
+{
+    unsigned int gate = logr->level;
+
+    if ((logr->flight != NULL) && (logr->flight->level > gate)) {
+        gate = logr->flight->level;
+    }
+    __atomic_store_n(&logr->gate, gate, __ATOMIC_RELAXED);
+}
+
+static void
+_logr_store_level(logr_t *logr, unsigned int level)
+{
+    pthread_mutex_lock(&logr->cfg_lock);
+    __atomic_store_n(&logr->level, level, __ATOMIC_RELAXED);
+    _logr_update_gate(logr);
+    pthread_mutex_unlock(&logr->cfg_lock);
+}
+
+int
+logr_set_flight_recorder(logr_t *logr, size_t records, int level,
+                         int dump_level)
+{
+    struct logr_flight *fl = NULL;
+    size_t count = 1;
+
+    if ((logr == NULL) || (level < 0) || (level > LOGR_DEBUG) ||
+            (records > ((size_t)-1 >> 1) / LOGR_FLIGHT_SLOT)) {
+        return _logr_errno(EINVAL);
+    }
+
+    if (records != 0) {
+        while (count < records) {
+            count <<= 1;
+        }
+        fl = (struct logr_flight *)calloc(1, sizeof(struct logr_flight));
+        if (fl == NULL) {
+            return _logr_errno(ENOMEM);
+        }
+        fl->slots = (char *)calloc(count, LOGR_FLIGHT_SLOT);
+        if (fl->slots == NULL) {
+            free(fl);
+            return _logr_errno(ENOMEM);
+        }
+        fl->level = level;
+        fl->dump_level = dump_level;
+        fl->count = count;
+    }
+
+    /* callers may be using the old ring, it stays until logr_free() */
+    pthread_mutex_lock(&logr->cfg_lock);
+    if (logr->flight != NULL) {
+        logr->flight->retired = logr->flight_retired;
+        logr->flight_retired = logr->flight;
+    }
+    __atomic_store_n(&logr->flight, fl, __ATOMIC_RELEASE);
+    _logr_update_gate(logr);
+    pthread_mutex_unlock(&logr->cfg_lock);
+    return 0;
+}
+
+int
+logr_flight_dump(logr_t *logr)
+{
+    struct logr_flight *fl;
+
+    if (logr == NULL) {
+        return _logr_errno(EINVAL);
+    }
+    fl = __atomic_load_n(&logr->flight, __ATOMIC_ACQUIRE);
+    if (fl == NULL) {
+        return 0;
+    }
+    return _logr_flight_dump(__atomic_load_n(&logr->target, __ATOMIC_ACQUIRE),
+                             fl);
+}
+
+#ifndef __WIN32
+/*
+ * Crash flush, see logr_set_crash_flush.
+ *
+ * The handler runs on a thread that may have crashed holding any lock and
+ * in the middle of malloc(), so it allocates nothing and calls nothing
+ * but write(2) and friends.  It sets logr_crashing, which parks the writer
+ * and merge threads, and then waits for each logger's lock holder to let
+ * go of it, keeping others out, so that no entry is written twice or
+ * torn.
+ */
+#define LOGR_CRASH_LOGGERS 64
+#define LOGR_CRASH_WAIT_MS 2000
+
+static const int logr_crash_signals[] = { SIGSEGV, SIGBUS, SIGABRT, SIGFPE };
+#define LOGR_CRASH_SIGNALS \
+    (sizeof(logr_crash_signals) / sizeof(logr_crash_signals[0]))
+
+static logr_t *logr_crash_loggers[LOGR_CRASH_LOGGERS];
+static struct sigaction logr_crash_prev[LOGR_CRASH_SIGNALS];
+static bool logr_crash_installed = false;
+static pthread_mutex_t logr_crash_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+_logr_crash_put(char **p, const char *end, const char *s, size_t n)
+{
+    if (n > (size_t)(end - *p)) {
+        n = end - *p;
+    }
+    memcpy(*p, s, n);
+    *p += n;
+}
+
+static void
+_logr_crash_putd(char **p, const char *end, long long v, int width)
+{
+    char digits[24];
+    int n = 0;
+    bool neg = (v < 0);
+
+    do {
+        digits[sizeof(digits) - ++n] = '0' + (neg ? -(v % 10) : v % 10);
+        v /= 10;
+    } while ((v != 0) || (n < width));
+    if (neg) {
+        digits[sizeof(digits) - ++n] = '-';
+    }
+    _logr_crash_put(p, end, digits + sizeof(digits) - n, n);
+}
+
+/* A UTC ISO 8601 timestamp, strftime() isn't async-signal-safe. */
+static void
+_logr_crash_time(char **p, const char *end, time_t sec)
+{
+    /* days to civil date, after Howard Hinnant */
+    long long z = sec / 86400 + 719468, rem = sec % 86400;
+    long long era = z / 146097, doe = z - era * 146097;
+    long long yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    long long doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    long long mp = (5 * doy + 2) / 153;
+    long long day = doy - (153 * mp + 2) / 5 + 1;
+    long long month = (mp < 10) ? mp + 3 : mp - 9;
+
+    _logr_crash_putd(p, end, yoe + era * 400 + (month <= 2), 4);
+    _logr_crash_put(p, end, "-", 1);
+    _logr_crash_putd(p, end, month, 2);
+    _logr_crash_put(p, end, "-", 1);
+    _logr_crash_putd(p, end, day, 2);
+    _logr_crash_put(p, end, "T", 1);
+    _logr_crash_putd(p, end, rem / 3600, 2);
+    _logr_crash_put(p, end, ":", 1);
+    _logr_crash_putd(p, end, rem / 60 % 60, 2);
+    _logr_crash_put(p, end, ":", 1);
+    _logr_crash_putd(p, end, rem % 60, 2);
+    _logr_crash_put(p, end, "Z", 1);
+}
+
+/*
+ * Write a record still waiting in a queue or ring, running the prefix
+ * program without anything unsafe: the timestamp comes out in UTC and a
+ * user prefix function is skipped.
+ */
+static void
+_logr_crash_rec(logr_t *logr, int fd, const struct logr_qrec *qr)
+{
+    const struct logr_cfg *cfg = _logr_cfg(logr);
+    const struct logr_op *op, *end;
+    char buf[LOGR_BUF_SIZE], *p = buf;
+    const char *s;
+
+    if (qr->kv == LOGR_KV_JSON) {
+        /* the body carries the closing brace */
+        _logr_crash_put(&p, buf + sizeof(buf), "{", 1);
+    } else if (!qr->kv && (cfg->ops.prefix == NULL) && (cfg->prefix != NULL)) {
+        end = cfg->prefix->op + cfg->prefix->count;
+        for (op = cfg->prefix->op; op < end; op++) {
+            s = NULL;
+            switch (op->code) {
+            case LOGR_OP_LITERAL:
+                _logr_crash_put(&p, buf + sizeof(buf), op->str, op->len);
+                break;
+            case LOGR_OP_FILE:
+                s = qr->file;
+                break;
+            case LOGR_OP_FUNC:
+                s = qr->func;
+                break;
+            case LOGR_OP_PRETTY:
+                s = qr->pretty_func;
+                break;
+            case LOGR_OP_LEVEL_S:
+                s = logr_util_priority(logr, qr->level);
+                break;
+            case LOGR_OP_LINE:
+                _logr_crash_putd(&p, buf + sizeof(buf), qr->line, 0);
+                break;
+            case LOGR_OP_LEVEL_D:
+                _logr_crash_putd(&p, buf + sizeof(buf), qr->level, 0);
+                break;
+            case LOGR_OP_PID:
+                _logr_crash_putd(&p, buf + sizeof(buf), getpid(), 0);
+                break;
+            case LOGR_OP_TIMESTAMP_S:
+                _logr_crash_time(&p, buf + sizeof(buf), qr->ts.tv_sec);
+                break;
+            case LOGR_OP_TIMESTAMP_D:
+            case LOGR_OP_TIMESTAMP_U:
+                _logr_crash_putd(&p, buf + sizeof(buf), qr->ts.tv_sec, 0);
+                break;
+            case LOGR_OP_MSEC:
+            case LOGR_OP_USEC:
+                if (buf + sizeof(buf) - p >= 6) {
+                    _logr_subsec(p, (op->code == LOGR_OP_MSEC) ? 3 : 6,
+                                 &qr->ts);
+                    p += (op->code == LOGR_OP_MSEC) ? 3 : 6;
+                }
+                break;
+            }
+            if (s != NULL) {
+                _logr_crash_put(&p, buf + sizeof(buf), s, strlen(s));
+            }
+        }
+    }
+    _logr_write(fd, buf, p - buf);
+    _logr_write(fd, (const char *)(qr + 1), qr->len);
+}
+
+/* Dump the flight recorder after everything else. */
+static void
+_logr_crash_flight(logr_t *logr, int fd)
+{
+    struct logr_flight *fl = __atomic_load_n(&logr->flight, __ATOMIC_ACQUIRE);
+    union {
+        struct logr_flight_slot s;
+        char buf[LOGR_FLIGHT_SLOT];
+    } copy;
+    char buf[64], *p = buf;
+    uint64_t n, end;
+    unsigned long count = 0;
+
+    if ((fl == NULL) || logr->binary) {
+        return;
+    }
+    end = _logr_flight_take(fl, &n);
+    if (n == end) {
+        return;
+    }
+    _logr_write(fd, "*** logr: flight recorder ***\n", 30);
+    for (; n < end; n++) {
+        if (_logr_flight_get(fl, n, &copy.s)) {
+            _logr_crash_rec(logr, fd, &copy.s.qr);
+            count++;
+        }
+    }
+    _logr_crash_put(&p, buf + sizeof(buf), "*** logr: end of flight recorder, ",
+                    34);
+    _logr_crash_putd(&p, buf + sizeof(buf), count, 0);
+    _logr_crash_put(&p, buf + sizeof(buf), " entries ***\n", 13);
+    _logr_write(fd, buf, p - buf);
+}
+
+static void
+_logr_crash_flush(logr_t *logr)
+{
+    int fd = (logr->fd >= 0) ? logr->fd : STDERR_FILENO;
+    struct logr_queue *q = __atomic_load_n(&logr->queue, __ATOMIC_ACQUIRE);
+    struct logr_shards *set;
+    struct logr_shard *s, *best;
+    struct logr_qrec *qr, *min;
+    size_t head, used, done, skip;
+    struct timespec ms = { 0, 1000000 };
+    int i, owner, self;
+
+    /*
+     * Keep other threads out, see logr_lock(), and wait for the holder
+     * of the lock to let go of it: the writer and merge threads do once
+     * they see logr_crashing, other threads hold it briefly.  Not if this
+     * thread crashed holding it, and not for ever in case the holder
+     * waits for something the crashed thread holds.  The mutex itself is
+     * left alone, none of the pthread calls are async-signal-safe.
+     */
+#ifdef __linux__
+    self = syscall(SYS_gettid);
+#else
+    self = logr_tid;
+#endif
+    __atomic_store_n(&logr->crash_busy, 1, __ATOMIC_SEQ_CST);
+    for (i = 0; i < LOGR_CRASH_WAIT_MS; i++) {
+        owner = __atomic_load_n(&logr->owner, __ATOMIC_SEQ_CST);
+        if ((owner == 0) || (owner == self)) {
+            break;
+        }
+        nanosleep(&ms, NULL);
+    }
+
+    /* the mapped pages are in the file already, cut off the tail */
+    if (logr->mapped && (ftruncate(logr->fd, logr->map_pos) != 0)) {
+        goto out;
+    }
+
+    /*
+     * Entries held back by the flush policy are rendered already.  Each
+     * buffer is emptied once written, in case a previous handler lets
+     * the process go on.
+     */
+    _logr_write(fd, logr->out.data, logr->out.len);
+    logr->out.len = 0;
+
+    /* so are those in the batch of a writer thread */
+    if ((q != NULL) && (q->batch != NULL)) {
+        _logr_write(fd, q->batch->data, q->batch->len);
+        q->batch->len = 0;
+    }
+    set = __atomic_load_n(&logr->shards, __ATOMIC_ACQUIRE);
+    if ((set != NULL) && (set->batch != NULL)) {
+        _logr_write(fd, set->batch->data, set->batch->len);
+        set->batch->len = 0;
+    }
+
+    if (q != NULL) {
+        head = q->head;
+        used = q->used;
+        skip = __atomic_load_n(&q->drained, __ATOMIC_ACQUIRE);
+        for (done = 0; done < used; ) {
+            if ((head == q->size) ||
+                    ((qr = (struct logr_qrec *)(q->buf + head))->size == 0)) {
+                done += q->size - head;
+                head = 0;
+                continue;
+            }
+            if ((qr->size < sizeof(*qr)) || (qr->size > q->size - head)) {
+                break;
+            }
+            /* the writer has this one in its batch or written */
+            if (done >= skip) {
+                _logr_crash_rec(logr, fd, qr);
+            }
+            head += qr->size;
+            done += qr->size;
+        }
+    }
+
+    if (set != NULL) {
+        for (;;) {
+            best = NULL;
+            min = NULL;
+            for (s = set->list; s != NULL; s = s->next) {
+                qr = _logr_shard_peek(s);
+                if ((qr != NULL) && ((min == NULL) || (qr->seq < min->seq))) {
+                    best = s;
+                    min = qr;
+                }
+            }
+            if (min == NULL) {
+                break;
+            }
+            _logr_crash_rec(logr, fd, min);
+            best->head += min->size;
+        }
+    }
+
+    _logr_crash_flight(logr, fd);
+out:
+    /* in case a previous handler lets the process go on */
+    __atomic_store_n(&logr->crash_busy, 0, __ATOMIC_RELEASE);
+}
+
+static void
+_logr_crash_signal(int sig, siginfo_t *info, void *ctx)
+{
+    static int entered = 0;
+    int tmp = errno;
+    logr_t *l;
+    size_t i;
+
+    /* only the first thread to crash flushes */
+    if (__atomic_exchange_n(&entered, 1, __ATOMIC_ACQ_REL) == 0) {
+        __atomic_store_n(&logr_crashing, 1, __ATOMIC_SEQ_CST);
+        for (i = 0; i < LOGR_CRASH_LOGGERS; i++) {
+            l = __atomic_load_n(&logr_crash_loggers[i], __ATOMIC_ACQUIRE);
+            if (l != NULL) {
+                _logr_crash_flush(l);
+            }
+        }
+    }
+
+    for (i = 0; i < LOGR_CRASH_SIGNALS; i++) {
+        if (logr_crash_signals[i] == sig) {
+            sigaction(sig, &logr_crash_prev[i], NULL);
+        }
+    }
+    errno = tmp;
+    /*
+     * A fault raised by the kernel happens again once this returns, now
+     * with the previous handler and the original details; anything else
+     * is sent again, to be delivered then.
+     */
+    if ((info == NULL) || (info->si_code <= 0)) {
+        raise(sig);
+    }
+}
+#endif
+
+int
+logr_set_crash_flush(logr_t *logr, int enable)
+{
+#ifdef __WIN32
+    return _logr_errno(ENOTSUP);
+#else
+    struct sigaction sa;
+    int i, slot = -1;
+
+    if (logr == NULL) {
+        return _logr_errno(EINVAL);
+    }
+
+    pthread_mutex_lock(&logr_crash_lock);
+    for (i = 0; i < LOGR_CRASH_LOGGERS; i++) {
+        if (logr_crash_loggers[i] == logr) {
+            if (!enable) {
+                __atomic_store_n(&logr_crash_loggers[i], NULL,
+                                 __ATOMIC_RELEASE);
+            }
+            pthread_mutex_unlock(&logr_crash_lock);
+            return 0;
+        }
+        if ((logr_crash_loggers[i] == NULL) && (slot < 0)) {
+            slot = i;
+        }
+    }
+    if (!enable) {
+        pthread_mutex_unlock(&logr_crash_lock);
+        return 0;
+    }
+    if (slot < 0) {
+        pthread_mutex_unlock(&logr_crash_lock);
+        return _logr_errno(ENOSPC);
+    }
+
+    if (!logr_crash_installed) {
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = _logr_crash_signal;
+        /* runs on the alternate stack, if any, after a stack overflow */
+        sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+        sigemptyset(&sa.sa_mask);
+        for (i = 0; i < (int)LOGR_CRASH_SIGNALS; i++) {
+            sigaction(logr_crash_signals[i], &sa, &logr_crash_prev[i]);
+        }
+        logr_crash_installed = true;
+    }
+    __atomic_store_n(&logr_crash_loggers[slot], logr, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&logr_crash_lock);
+    return 0;
+#endif
+}
+
+/*
+ * Binary logging.
+ *
+ * Instead of formatting, each entry stores the id of its call site, the
+ * level, the timestamp and the raw bytes of the printf arguments.  The
+ * call site (file, line, function and format string) is written once per
+ * file, and logr_decode() does the formatting later.
+ *
+ * The file is a sequence of records, each starting with its size and
+ * type.  Integers are in host byte order; the header records which order
+ * that is.  A header starts every file and may appear again further in,
+ * e.g. when another process appends to the file.  Call site ids are only
+ * valid until the next header.
+ */
+#define LOGR_BIN_MAGIC "logrbin1"
+#define LOGR_BIN_ORDER 0x01020304
+
+#define LOGR_BIN_HEADER 1
+#define LOGR_BIN_SITE   2
+#define LOGR_BIN_ENTRY  3
+
+struct logr_bin_header {
+    uint32_t size;
+    uint32_t type;
+    char magic[8];
+    uint32_t order;
+    uint32_t pid;
+    uint32_t prefix_len;      /* prefix format follows */
+    uint32_t ts_len;          /* then the timestamp format */
+};
+
+struct logr_bin_site {
+    uint32_t size;
+    uint32_t type;
+    uint32_t id;
+    int32_t line;
+    int32_t nargs;            /* -1 if entries hold the formatted message */
+    uint32_t file_len;        /* file, func, pretty_func and fmt follow */
+    uint32_t func_len;
+    uint32_t pretty_len;
+    uint32_t fmt_len;
+};
+
+struct logr_bin_entry {
+    uint32_t size;
+    uint32_t type;
+    uint32_t id;
+    int32_t level;
+    uint64_t ns;              /* CLOCK_REALTIME in nanoseconds */
+};
+
+/* Argument classes and how they are stored. */
+enum {
+    LOGR_ARG_NONE,            /* %% */
+    LOGR_ARG_INT,             /* int32_t */
+    LOGR_ARG_LONG,            /* int64_t for this and the rest */
+    LOGR_ARG_LLONG,
+    LOGR_ARG_INTMAX,
+    LOGR_ARG_SIZE,
+    LOGR_ARG_PTRDIFF,
+    LOGR_ARG_PTR,
+    LOGR_ARG_DOUBLE,          /* double */
+    LOGR_ARG_LDOUBLE,         /* stored as a double */
+    LOGR_ARG_STR,             /* uint32_t length and the bytes */
+    LOGR_ARG_BAD              /* not supported, format the message */
+};
+
+#define LOGR_PREC_STAR (-2)
+
+/* One conversion specification of a printf format. */
+struct logr_conv {
+    const char *start;        /* the '%' */
+    size_t len;
+    bool width_star;
+    bool prec_star;
+    int prec;                 /* -1 if none */
+    int type;
+};
+
+/*
+ * Find the next conversion in fmt.  Returns NULL when there are none
+ * left.  Conversions which can't be stored as raw arguments (%n, %m, wide
+ * characters, positional arguments) come back as LOGR_ARG_BAD.
+ */
+static const char *
+_logr_conv_next(const char *fmt, struct logr_conv *c)
+{
+    const char *p = strchr(fmt, '%');
+    const char *q;
+    int mod = 0;
+
+    if (p == NULL) {
+        return NULL;
+    }
+    c->start = p;
+    c->width_star = false;
+    c->prec_star = false;
+    c->prec = -1;
+    c->type = LOGR_ARG_BAD;
+    q = p + 1;
+
+    for (fmt = q; isdigit((unsigned char)*fmt); fmt++)
+        ;
+    if (*fmt == '$') {
+        c->len = fmt + 1 - p;
+        return p;
+    }
+
+    while ((*q != '\0') && (strchr("-+ #0'I", *q) != NULL)) {
+        q++;
+    }
+    if (*q == '*') {
+        c->width_star = true;
+        q++;
+    } else {
+        while (isdigit((unsigned char)*q)) {
+            q++;
+        }
+    }
+    if (*q == '.') {
+        q++;
+        if (*q == '*') {
+            c->prec_star = true;
+            q++;
+        } else {
+            c->prec = 0;
+            while (isdigit((unsigned char)*q)) {
+                c->prec = c->prec * 10 + (*q++ - '0');
+            }
+        }
+    }
+    switch (*q) {
+    case 'h':
+        q += (q[1] == 'h') ? 2 : 1;
+        break;
+    case 'l':
+        mod = (q[1] == 'l') ? LOGR_ARG_LLONG : LOGR_ARG_LONG;
+        q += (q[1] == 'l') ? 2 : 1;
+        break;
+    case 'q':
+    case 'L':
+        mod = LOGR_ARG_LLONG;
+        q++;
+        break;
+    case 'j':
+        mod = LOGR_ARG_INTMAX;
+        q++;
+        break;
+    case 'z':
+    case 'Z':
+        mod = LOGR_ARG_SIZE;
+        q++;
+        break;
+    case 't':
+        mod = LOGR_ARG_PTRDIFF;
+        q++;
+        break;
+    }
+
+    switch (*q) {
+    case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+        c->type = (mod != 0) ? mod : LOGR_ARG_INT;
+        break;
+    case 'c':
+        if (mod == 0) {
+            c->type = LOGR_ARG_INT;
+        }
+        break;
+    case 'e': case 'E': case 'f': case 'F':
+    case 'g': case 'G': case 'a': case 'A':
+        if (mod == 0 || mod == LOGR_ARG_LONG) {
+            c->type = LOGR_ARG_DOUBLE;
+        } else if (q[-1] == 'L') {
+            c->type = LOGR_ARG_LDOUBLE;
+        }
+        break;
+    case 's':
+        if (mod == 0) {
+            c->type = LOGR_ARG_STR;
+        }
+        break;
+    case 'p':
+        if (mod == 0) {
+            c->type = LOGR_ARG_PTR;
+        }
+        break;
+    case '%':
+        if (q == p + 1) {
+            c->type = LOGR_ARG_NONE;
+        }
+        break;
+    }
+    c->len = q + (*q != '\0') - p;
+    return p;
+}
+
+#define LOGR_BIN_SITES    4096  /* power of two */
+#define LOGR_BIN_MAX_ARGS 16
+
+#define LOGR_SITE_FREE  0
+#define LOGR_SITE_BUSY  1
+#define LOGR_SITE_READY 2
+
+struct logr_site {
+    int state;
+    uint32_t id;
+    uint32_t hash;            /* of fmt */
+    const char *fmt;          /* the key is fmt, file and line; a copy */
+    const char *file;
+    int line;
+    const char *func;
+    const char *pretty_func;
+    int nargs;                /* -1 to store the formatted message */
+    struct {
+        uint8_t type;
+        int16_t prec;         /* of strings, or LOGR_PREC_STAR */
+    } arg[LOGR_BIN_MAX_ARGS];
+};
+
+/*
+ * Call sites are found by the contents of their format string rather than
+ * its address: a wrapper around logr_vprintf() may pass a buffer that is
+ * reused for other formats or freed.  Each site keeps its own copy.  Slots
+ * are claimed with a CAS and never freed, so lookups don't lock.
+ */
+static struct logr_site logr_sites[LOGR_BIN_SITES];
+static uint32_t logr_site_ids;
+
+/* Used for everything once the table is full. */
+static struct logr_site logr_site_overflow = {
+    .state = LOGR_SITE_READY, .id = 0, .fmt = "", .file = "", .func = "",
+    .pretty_func = "", .nargs = -1
+};
+
+static void
+_logr_site_init(struct logr_site *s, const struct logr_record *rec,
+                const char *fmt, uint32_t hash)
+{
+    struct logr_conv c;
+    const char *p = fmt;
+    int n = 0;
+
+    s->hash = hash;
+    s->fmt = fmt;
+    s->file = rec->file;
+    s->line = rec->line;
+    s->func = rec->func;
+    s->pretty_func = rec->pretty_func;
+
+    while ((p = _logr_conv_next(p, &c)) != NULL) {
+        p += c.len;
+        if (c.type == LOGR_ARG_NONE) {
+            continue;
+        }
+        if ((c.type == LOGR_ARG_BAD) ||
+                (n + c.width_star + c.prec_star >= LOGR_BIN_MAX_ARGS)) {
+            n = -1;
+            break;
+        }
+        if (c.width_star) {
+            s->arg[n++].type = LOGR_ARG_INT;
+        }
+        if (c.prec_star) {
+            s->arg[n++].type = LOGR_ARG_INT;
+        }
+        s->arg[n].type = c.type;
+        s->arg[n++].prec = c.prec_star ? LOGR_PREC_STAR : c.prec;
+    }
+    s->nargs = n;
+    s->id = __atomic_add_fetch(&logr_site_ids, 1, __ATOMIC_RELAXED);
+}
+
+static struct logr_site *
+_logr_site(const struct logr_record *rec, const char *fmt)
+{
+    size_t len = strlen(fmt);
+    uint32_t hash = _logr_named_hash(fmt, len);
+    size_t h = hash * 31 + rec->line;
+    struct logr_site *s;
+    char *copy;
+    int state, i;
+
+    for (i = 0; i < LOGR_BIN_SITES; i++) {
+        s = &logr_sites[(h + i) & (LOGR_BIN_SITES - 1)];
+        state = __atomic_load_n(&s->state, __ATOMIC_ACQUIRE);
+        if (state == LOGR_SITE_FREE) {
+            copy = (char *)malloc(len + 1);
+            if (copy == NULL) {
+                break;
+            }
+            if (!__atomic_compare_exchange_n(&s->state, &state,
+                                             LOGR_SITE_BUSY, false,
+                                             __ATOMIC_ACQUIRE,
+                                             __ATOMIC_ACQUIRE)) {
+                free(copy);
+            } else {
+                memcpy(copy, fmt, len + 1);
+                _logr_site_init(s, rec, copy, hash);
+                __atomic_store_n(&s->state, LOGR_SITE_READY,
+                                 __ATOMIC_RELEASE);
+                return s;
+            }
+        }
+        while (state == LOGR_SITE_BUSY) {
+            state = __atomic_load_n(&s->state, __ATOMIC_ACQUIRE);
+        }
+        if ((s->hash == hash) && (s->line == rec->line) &&
+                (s->file == rec->file) && (strcmp(s->fmt, fmt) == 0)) {
+            return s;
+        }
+    }
+    return &logr_site_overflow;
+}
+
+/* Append the raw arguments described by the call site to b. */
+static int
+_logr_bin_args(const struct logr_site *s, struct logr_buf *b, va_list ap)
+{
+    int last = -1;          /* the previous int, for %.*s */
+    const char *str;
+    uint32_t len;
+    int32_t i32;
+    int64_t i64;
+    double d;
+    int i;
+
+    for (i = 0; i < s->nargs; i++) {
+        switch (s->arg[i].type) {
+        case LOGR_ARG_INT:
+            i32 = last = va_arg(ap, int);
+            if (_logr_buf_put(b, (char *)&i32, sizeof(i32)) < 0) {
+                return -1;
+            }
+            continue;
+        case LOGR_ARG_LONG:
+            i64 = va_arg(ap, long);
+            break;
+        case LOGR_ARG_LLONG:
+            i64 = va_arg(ap, long long);
+            break;
+        case LOGR_ARG_INTMAX:
+            i64 = va_arg(ap, intmax_t);
+            break;
+        case LOGR_ARG_SIZE:
+            i64 = va_arg(ap, size_t);
+            break;
+        case LOGR_ARG_PTRDIFF:
+            i64 = va_arg(ap, ptrdiff_t);
+            break;
+        case LOGR_ARG_PTR:
+            i64 = (uintptr_t)va_arg(ap, void *);
+            break;
+        case LOGR_ARG_DOUBLE:
+        case LOGR_ARG_LDOUBLE:
+            if (s->arg[i].type == LOGR_ARG_DOUBLE) {
+                d = va_arg(ap, double);
+            } else {
+                d = va_arg(ap, long double);
+            }
+            if (_logr_buf_put(b, (char *)&d, sizeof(d)) < 0) {
+                return -1;
+            }
+            continue;
+        case LOGR_ARG_STR:
+            str = va_arg(ap, const char *);
+            if (str == NULL) {
+                str = "(null)";
+            }
+            i32 = (s->arg[i].prec == LOGR_PREC_STAR) ? last : s->arg[i].prec;
+            len = (i32 >= 0) ? strnlen(str, i32) : strlen(str);
+            if ((_logr_buf_put(b, (char *)&len, sizeof(len)) < 0) ||
+                    (_logr_buf_put(b, str, len) < 0)) {
+                return -1;
+            }
+            continue;
+        default:
+            return _logr_errno(EINVAL);
+        }
+        if (_logr_buf_put(b, (char *)&i64, sizeof(i64)) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Add the definition of a call site to the logger, once.  With logr->lock. */
+static int
+_logr_bin_define(logr_t *logr, const struct logr_site *s)
+{
+    struct logr_bin_site r;
+    struct logr_buf *b = &logr->bin_sites;
+    size_t n = s->id / 8 + 1;
+    uint8_t *seen;
+
+    if (n > logr->bin_seen_size) {
+        n = (n + 63) & ~(size_t)63;
+        seen = (uint8_t *)realloc(logr->bin_seen, n);
+        if (seen == NULL) {
+            return _logr_errno(ENOMEM);
+        }
+        memset(seen + logr->bin_seen_size, 0, n - logr->bin_seen_size);
+        logr->bin_seen = seen;
+        logr->bin_seen_size = n;
+    }
+    if (logr->bin_seen[s->id / 8] & (1 << (s->id % 8))) {
+        return 0;
+    }
+
+    r.type = LOGR_BIN_SITE;
+    r.id = s->id;
+    r.line = s->line;
+    r.nargs = s->nargs;
+    r.file_len = strlen(s->file);
+    r.func_len = strlen(s->func);
+    r.pretty_len = strlen(s->pretty_func);
+    r.fmt_len = strlen(s->fmt);
+    r.size = sizeof(r) + r.file_len + r.func_len + r.pretty_len + r.fmt_len;
+    if (_logr_buf_grow(b, r.size) < 0) {
+        return -1;
+    }
+    _logr_buf_put(b, (char *)&r, sizeof(r));
+    _logr_buf_put(b, s->file, r.file_len);
+    _logr_buf_put(b, s->func, r.func_len);
+    _logr_buf_put(b, s->pretty_func, r.pretty_len);
+    _logr_buf_put(b, s->fmt, r.fmt_len);
+
+    logr->bin_seen[s->id / 8] |= 1 << (s->id % 8);
+    return 0;
+}
+
+/*
+ * Write what has to precede new entries: a header and all call sites for
+ * a new file, otherwise the sites defined since the last write.  Called
+ * from _logr_commit() so that it follows the output through rotations.
+ */
+static int
+_logr_bin_prologue(logr_t *logr)
+{
+    const struct logr_cfg *cfg = _logr_cfg(logr);
+    const char *prefix = (cfg->prefix_fmt != NULL) ? cfg->prefix_fmt : "";
+    const char *ts = (cfg->tsfmt != NULL) ? cfg->tsfmt->spec :
+                                            LOGR_DEFAULT_DATE_FORMAT;
+    struct logr_bin_header h;
+    struct logr_buf b = { 0 };
+    int retval = 0;
+
+    if (logr->bin_fresh) {
+        /* not _logr_tls(), it may hold the entries being written */
+        h.type = LOGR_BIN_HEADER;
+        memcpy(h.magic, LOGR_BIN_MAGIC, sizeof(h.magic));
+        h.order = LOGR_BIN_ORDER;
+        h.pid = getpid();
+        h.prefix_len = strlen(prefix);
+        h.ts_len = strlen(ts);
+        h.size = sizeof(h) + h.prefix_len + h.ts_len;
+        if ((_logr_buf_put(&b, (char *)&h, sizeof(h)) < 0) ||
+                (_logr_buf_put(&b, prefix, h.prefix_len) < 0) ||
+                (_logr_buf_put(&b, ts, h.ts_len) < 0)) {
+            free(b.data);
+            return -1;
+        }
+        retval = _logr_send(logr, b.data, b.len);
+        logr->size += b.len;
+        free(b.data);
+        logr->bin_fresh = false;
+        logr->bin_written = 0;
+    }
+    if (logr->bin_written < logr->bin_sites.len) {
+        if (_logr_send(logr, logr->bin_sites.data + logr->bin_written,
+                       logr->bin_sites.len - logr->bin_written) < 0) {
+            retval = -1;
+        }
+        logr->size += logr->bin_sites.len - logr->bin_written;
+        logr->bin_written = logr->bin_sites.len;
+    }
+    return retval;
+}
+
+/* logr_vxprintf() in binary mode: nothing is formatted. */
+static int
+_logr_bin_vprintf(logr_t *logr, const struct logr_record *rec,
+                  const char *fmt, va_list ap)
+{
+    struct logr_site *s = _logr_site(rec, fmt);
+    struct logr_buf *b = _logr_tls();
+    struct logr_buf t = { 0 };
+    struct logr_bin_entry e;
+    va_list aq;
+    int retval, pre;
+
+    if (_logr_buf_grow(b, sizeof(e)) < 0) {
+        return -1;
+    }
+    b->len = sizeof(e);
+    va_copy(aq, ap);
+    if (s->nargs < 0) {
+        retval = _logr_buf_vprintf(b, fmt, ap);
+    } else {
+        retval = _logr_bin_args(s, b, ap);
+    }
+    if (retval < 0) {
+        va_end(aq);
+        return -1;
+    }
+    e.size = b->len;
+    e.type = LOGR_BIN_ENTRY;
+    e.id = s->id;
+    e.level = rec->level;
+    e.ns = (uint64_t)rec->ts.tv_sec * 1000000000 + rec->ts.tv_nsec;
+    memcpy(b->data, &e, sizeof(e));
+
+    retval = e.size;
+    logr_lock(logr);
+    /* b already holds this entry, only what is buffered is older */
+    _logr_check_rotate_time(logr, &logr->out, rec->ts.tv_sec);
+    /* sinks get text */
+    if ((logr->nsinks != 0) && _logr_sinks_want(logr, rec->level) &&
+            (((pre = _logr_util_prefix(rec, logr, &t)) < 0) ||
+             (_logr_buf_vprintf(&t, fmt, aq) < 0) ||
+             (_logr_fanout(logr, rec, t.data, t.len, pre) < 0))) {
+        retval = -1;
+    }
+    va_end(aq);
+    free(t.data);
+    if (_logr_bin_define(logr, s) < 0) {
+        retval = -1;
+    } else if (logr->buffered) {
+        if (_logr_buf_put(&logr->out, b->data, b->len) < 0) {
+            retval = -1;
+        } else if (_logr_flush_due(logr, &logr->out, rec->level) &&
+                   (_logr_commit(logr, &logr->out) < 0)) {
+            retval = -1;
+        }
+    } else if (_logr_commit(logr, b) < 0) {
+        retval = -1;
+    }
+    logr_unlock(logr);
+    return retval;
+}
+
+/* _logr_bin_vprintf() with the arguments given here. */
+static int
+_logr_bin_printf(logr_t *logr, const struct logr_record *rec,
+                 const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = _logr_bin_vprintf(logr, rec, fmt, ap);
+    va_end(ap);
+    return n;
+}
+
+int
+logr_set_binary(logr_t *logr, int enable)
+{
+    if (logr == NULL) {
+        return _logr_errno(EINVAL);
+    }
+    logr_lock(logr);
+    _logr_commit(logr, &logr->out);
+    logr->bin_fresh = true;
+    __atomic_store_n(&logr->binary, enable != 0, __ATOMIC_RELAXED);
+    logr_unlock(logr);
+    return 0;
+}
+
+#ifndef __WIN32
+/* snprintf() a single conversion into b. */
+static int
+_logr_buf_printf(struct logr_buf *b, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = _logr_buf_vprintf(b, fmt, ap);
+    va_end(ap);
+    return n;
+}
+
+#define _LOGR_CONV_PRINTF(b, c, spec, w, pr, v)                         \
+    ((c).width_star ?                                                   \
+     ((c).prec_star ? _logr_buf_printf(b, spec, w, pr, v) :             \
+                      _logr_buf_printf(b, spec, w, v)) :                \
+     ((c).prec_star ? _logr_buf_printf(b, spec, pr, v) :                \
+                      _logr_buf_printf(b, spec, v)))
+
+static int
+_logr_bin_take(const char **p, const char *end, void *v, size_t n)
+{
+    if ((size_t)(end - *p) < n) {
+        return _logr_errno(EINVAL);
+    }
+    memcpy(v, *p, n);
+    *p += n;
+    return 0;
+}
+
+/* Format the message of an entry from its stored arguments into m. */
+static int
+_logr_bin_format(struct logr_buf *m, const char *fmt, const char *p,
+                 const char *end)
+{
+    struct logr_conv c;
+    char spec[64], *str;
+    int32_t w = 0, pr = 0, i32;
+    uint32_t len;
+    int64_t i64;
+    double d;
+    int retval;
+
+    while (_logr_conv_next(fmt, &c) != NULL) {
+        if (_logr_buf_put(m, fmt, c.start - fmt) < 0) {
+            return -1;
+        }
+        fmt = c.start + c.len;
+        if (c.type == LOGR_ARG_NONE) {
+            if (_logr_buf_put(m, "%", 1) < 0) {
+                return -1;
+            }
+            continue;
+        }
+        if ((c.type == LOGR_ARG_BAD) || (c.len >= sizeof(spec))) {
+            return _logr_errno(EINVAL);
+        }
+        memcpy(spec, c.start, c.len);
+        spec[c.len] = '\0';
+
+        if ((c.width_star && (_logr_bin_take(&p, end, &w, sizeof(w)) < 0)) ||
+                (c.prec_star && (_logr_bin_take(&p, end, &pr, sizeof(pr)) < 0))) {
+            return -1;
+        }
+        switch (c.type) {
+        case LOGR_ARG_INT:
+            if (_logr_bin_take(&p, end, &i32, sizeof(i32)) < 0) {
+                return -1;
+            }
+            retval = _LOGR_CONV_PRINTF(m, c, spec, w, pr, (int)i32);
+            break;
+        case LOGR_ARG_DOUBLE:
+        case LOGR_ARG_LDOUBLE:
+            if (_logr_bin_take(&p, end, &d, sizeof(d)) < 0) {
+                return -1;
+            }
+            if (c.type == LOGR_ARG_DOUBLE) {
+                retval = _LOGR_CONV_PRINTF(m, c, spec, w, pr, d);
+            } else {
+                retval = _LOGR_CONV_PRINTF(m, c, spec, w, pr, (long double)d);
+            }
+            break;
+        case LOGR_ARG_STR:
+            if ((_logr_bin_take(&p, end, &len, sizeof(len)) < 0) ||
+                    ((size_t)(end - p) < len)) {
+                return _logr_errno(EINVAL);
+            }
+            str = strndup(p, len);
+            if (str == NULL) {
+                return -1;
+            }
+            p += len;
+            retval = _LOGR_CONV_PRINTF(m, c, spec, w, pr, str);
+            free(str);
+            break;
+        default:
+            if (_logr_bin_take(&p, end, &i64, sizeof(i64)) < 0) {
+                return -1;
+            }
+            switch (c.type) {
+            case LOGR_ARG_LONG:
+                retval = _LOGR_CONV_PRINTF(m, c, spec, w, pr, (long)i64);
+                break;
+            case LOGR_ARG_LLONG:
+                retval = _LOGR_CONV_PRINTF(m, c, spec, w, pr, (long long)i64);
+                break;
+            case LOGR_ARG_INTMAX:
+                retval = _LOGR_CONV_PRINTF(m, c, spec, w, pr, (intmax_t)i64);
+                break;
+            case LOGR_ARG_SIZE:
+                retval = _LOGR_CONV_PRINTF(m, c, spec, w, pr, (size_t)i64);
+                break;
+            case LOGR_ARG_PTRDIFF:
+                retval = _LOGR_CONV_PRINTF(m, c, spec, w, pr, (ptrdiff_t)i64);
+                break;
+            default:
+                retval = _LOGR_CONV_PRINTF(m, c, spec, w, pr,
+                                           (void *)(uintptr_t)i64);
+                break;
+            }
+            break;
+        }
+        if (retval < 0) {
+            return -1;
+        }
+    }
+    return _logr_buf_puts(m, fmt);
+}
+
+#define LOGR_BIN_MAX_RECORD (64 * 1024 * 1024)
+
+/* A call site read back from a binary log. */
+struct logr_dsite {
+    int line;
+    int nargs;
+    char *file;
+    char *func;
+    char *pretty_func;
+    char *fmt;
+};
+
+static struct logr_dsite *
+_logr_dsite(const struct logr_bin_site *r)
+{
+    const char *p = (const char *)(r + 1);
+    struct logr_dsite *s;
+    char *q;
+
+    s = (struct logr_dsite *)malloc(sizeof(struct logr_dsite) +
+                                    r->size - sizeof(*r) + 4);
+    if (s == NULL) {
+        return NULL;
+    }
+    s->line = r->line;
+    s->nargs = r->nargs;
+    q = (char *)(s + 1);
+    s->file = q;
+    q = (char *)memcpy(q, p, r->file_len) + r->file_len;
+    *q++ = '\0';
+    p += r->file_len;
+    s->func = q;
+    q = (char *)memcpy(q, p, r->func_len) + r->func_len;
+    *q++ = '\0';
+    p += r->func_len;
+    s->pretty_func = q;
+    q = (char *)memcpy(q, p, r->pretty_len) + r->pretty_len;
+    *q++ = '\0';
+    p += r->pretty_len;
+    s->fmt = q;
+    q = (char *)memcpy(q, p, r->fmt_len) + r->fmt_len;
+    *q = '\0';
+    return s;
+}
+
+/* Write one decoded entry through the logger's normal output path. */
+static int
+_logr_output(logr_t *logr, const struct logr_record *rec)
+{
+    struct logr_buf *b;
+    int n;
+
+    logr_lock(logr);
+    b = logr->buffered ? &logr->out : _logr_tls();
+    n = _logr_emit(logr, rec, b);
+    if ((n >= 0) && (!logr->buffered || _logr_flush_due(logr, b, rec->level))) {
+        if (_logr_commit(logr, b) < 0) {
+            n = -1;
+        }
+    }
+    logr_unlock(logr);
+    return n;
+}
+#endif
+
+int
+logr_decode(logr_t *logr, int fd, unsigned int flags)
+{
+#ifdef __WIN32
+    return _logr_errno(ENOTSUP);
+#else
+    struct logr_buf r = { 0 }, m = { 0 };
+    struct logr_dsite **sites = NULL, *s, **tmp;
+    struct logr_bin_header *h;
+    struct logr_bin_site *rs;
+    struct logr_bin_entry *e;
+    struct logr_record rec;
+    size_t i, nsites = 0;
+    bool header = false;
+    long pid = 0;
+    int retval = 0;
+    uint32_t hdr[2];
+    FILE *in;
+
+    if (logr == NULL) {
+        return _logr_errno(EINVAL);
+    }
+    fd = dup(fd);
+    if (fd < 0) {
+        return -1;
+    }
+    in = fdopen(fd, "rb");
+    if (in == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    /* a truncated record at the end, e.g. after a crash, is ignored */
+    while (fread(hdr, sizeof(hdr), 1, in) == 1) {
+        if ((hdr[0] < sizeof(hdr)) || (hdr[0] > LOGR_BIN_MAX_RECORD) ||
+                (!header && (hdr[1] != LOGR_BIN_HEADER))) {
+            retval = _logr_errno(EINVAL);
+            break;
+        }
+        r.len = 0;
+        if (_logr_buf_put(&r, (char *)hdr, sizeof(hdr)) < 0 ||
+                _logr_buf_grow(&r, hdr[0]) < 0) {
+            retval = -1;
+            break;
+        }
+        if ((hdr[0] > sizeof(hdr)) &&
+                (fread(r.data + sizeof(hdr), hdr[0] - sizeof(hdr), 1, in) != 1)) {
+            break;
+        }
+
+        switch (hdr[1]) {
+        case LOGR_BIN_HEADER:
+            h = (struct logr_bin_header *)r.data;
+            if ((hdr[0] < sizeof(*h)) ||
+                    (memcmp(h->magic, LOGR_BIN_MAGIC, sizeof(h->magic)) != 0) ||
+                    (h->order != LOGR_BIN_ORDER) ||
+                    ((uint64_t)h->prefix_len + h->ts_len >
+                     hdr[0] - sizeof(*h))) {
+                retval = _logr_errno(EINVAL);
+                break;
+            }
+            header = true;
+            pid = h->pid;
+            for (i = 0; i < nsites; i++) {
+                free(sites[i]);
+                sites[i] = NULL;
+            }
+            m.len = 0;
+            if (_logr_buf_put(&m, (char *)(h + 1), h->prefix_len) < 0 ||
+                    _logr_buf_put(&m, "", 1) < 0 ||
+                    _logr_buf_put(&m, (char *)(h + 1) + h->prefix_len,
+                                  h->ts_len) < 0 ||
+                    _logr_buf_put(&m, "", 1) < 0) {
+                retval = -1;
+                break;
+            }
+            if (!(flags & LOGR_DECODE_KEEP_PREFIX) &&
+                    (logr_set_prefix_format(logr, m.data) < 0)) {
+                retval = -1;
+            }
+            if (!(flags & LOGR_DECODE_KEEP_TIMESTAMP) &&
+                    (logr_set_timestamp_format(logr,
+                                               m.data + h->prefix_len + 1) < 0)) {
+                retval = -1;
+            }
+            break;
+
+        case LOGR_BIN_SITE:
+            rs = (struct logr_bin_site *)r.data;
+            if ((hdr[0] < sizeof(*rs)) ||
+                    ((uint64_t)rs->file_len + rs->func_len + rs->pretty_len +
+                     rs->fmt_len != hdr[0] - sizeof(*rs)) ||
+                    (rs->nargs > LOGR_BIN_MAX_ARGS)) {
+                retval = _logr_errno(EINVAL);
+                break;
+            }
+            if (rs->id >= nsites) {
+                i = (rs->id + 64) & ~(size_t)63;
+                tmp = (struct logr_dsite **)realloc(sites, i * sizeof(*sites));
+                if (tmp == NULL) {
+                    retval = -1;
+                    break;
+                }
+                memset(tmp + nsites, 0, (i - nsites) * sizeof(*sites));
+                sites = tmp;
+                nsites = i;
+            }
+            s = _logr_dsite(rs);
+            if (s == NULL) {
+                retval = -1;
+                break;
+            }
+            free(sites[rs->id]);
+            sites[rs->id] = s;
+            break;
+
+        case LOGR_BIN_ENTRY:
+            e = (struct logr_bin_entry *)r.data;
+            if ((hdr[0] < sizeof(*e)) || (e->id >= nsites) ||
+                    ((s = sites[e->id]) == NULL)) {
+                retval = _logr_errno(EINVAL);
+                break;
+            }
+            if ((unsigned int)e->level > logr_get_level(logr)) {
+                break;
+            }
+            m.len = 0;
+            if (s->nargs < 0) {
+                retval = _logr_buf_put(&m, (char *)(e + 1),
+                                       hdr[0] - sizeof(*e));
+            } else {
+                retval = _logr_bin_format(&m, s->fmt, (char *)(e + 1),
+                                          r.data + hdr[0]);
+            }
+            if (retval < 0) {
+                break;
+            }
+            rec.file = s->file;
+            rec.line = s->line;
+            rec.func = s->func;
+            rec.pretty_func = s->pretty_func;
+            rec.level = e->level;
+            rec.ts.tv_sec = e->ns / 1000000000;
+            rec.ts.tv_nsec = e->ns % 1000000000;
+            rec.pid = pid;
+            rec.kv = 0;
+            rec.msg = m.data;
+            rec.len = m.len;
+            retval = (_logr_output(logr, &rec) < 0) ? -1 : 0;
+            break;
+
+        default:
+            /* written by a newer version, skip it */
+            break;
+        }
+        if (retval < 0) {
+            break;
+        }
+    }
+    if ((retval == 0) && ferror(in)) {
+        retval = -1;
+    }
+
+    for (i = 0; i < nsites; i++) {
+        free(sites[i]);
+    }
+    free(sites);
+    free(r.data);
+    free(m.data);
+    fclose(in);
+
+    logr_lock(logr);
+    _logr_commit(logr, &logr->out);
+    logr_unlock(logr);
+    return retval;
+#endif
+}
+
+/* Write a record whose message is already rendered, in any mode. */
+static int
+_logr_put(logr_t *logr, struct logr_record *rec)
+{
+    int n;
+#ifndef __WIN32
+    struct logr_queue *q;
+    struct logr_shards *set;
+    struct logr_shard *s;
+
+    set = __atomic_load_n(&logr->shards, __ATOMIC_ACQUIRE);
+    if ((set != NULL) && __atomic_load_n(&set->active, __ATOMIC_RELAXED) &&
+            ((s = _logr_shard_enter(set)) != NULL)) {
+        return _logr_shard_put(set, s, rec);
+    }
+
+    q = __atomic_load_n(&logr->queue, __ATOMIC_ACQUIRE);
+    if ((q != NULL) && __atomic_load_n(&q->active, __ATOMIC_RELAXED)) {
+        return _logr_enqueue_rec(logr, q, rec);
+    }
+#endif
+
+    /* rec->msg may be in the thread's buffer, so render into out */
+    logr_lock(logr);
+    n = _logr_emit(logr, rec, &logr->out);
+    if (!logr->buffered || _logr_flush_due(logr, &logr->out, rec->level)) {
+        if (_logr_commit(logr, &logr->out) < 0) {
+            n = -1;
+        }
+    }
+    logr_unlock(logr);
+    return n;
+}
+
+/*
+ * Suppression of repeated messages, see logr_set_dedup().
+ *
+ * Each call site has a slot holding a hash of its last message and when
+ * that was first logged.  A repeat within the window only bumps the
+ * slot's count, without formatting anything else or taking the lock; the
+ * timer thread reports the count when the window is over, or earlier the
+ * next different message from the site or a flush.
+ * Slots are claimed like binary call sites and never freed.  Threads
+ * racing on one site may fold a message into the wrong count, which only
+ * makes the report approximate.
+ */
+#define LOGR_DEDUP_SLOTS 1024 /* power of two */
+
+struct logr_dedup_slot {
+    int state;                /* LOGR_SITE_* */
+    const char *file;
+    int line;
+    const char *func;
+    const char *pretty_func;
+    int level;                /* of the message being repeated */
+    uint64_t hash;
+    uint64_t since;           /* ns, when the message was logged */
+    unsigned long repeats;
+};
+
+struct logr_dedup {
+    struct logr_dedup_slot slot[LOGR_DEDUP_SLOTS];
+};
+
+static struct logr_dedup_slot *
+_logr_dedup_slot(struct logr_dedup *d, const struct logr_record *rec)
+{
+    size_t h = ((uintptr_t)rec->file >> 3) * 31 + rec->line;
+    struct logr_dedup_slot *s;
+    int state, i;
+
+    for (i = 0; i < LOGR_DEDUP_SLOTS; i++) {
+        s = &d->slot[(h + i) & (LOGR_DEDUP_SLOTS - 1)];
+        state = __atomic_load_n(&s->state, __ATOMIC_ACQUIRE);
+        if ((state == LOGR_SITE_FREE) &&
+                __atomic_compare_exchange_n(&s->state, &state, LOGR_SITE_BUSY,
+                                            false, __ATOMIC_ACQUIRE,
+                                            __ATOMIC_ACQUIRE)) {
+            s->file = rec->file;
+            s->line = rec->line;
+            s->func = rec->func;
+            s->pretty_func = rec->pretty_func;
+            __atomic_store_n(&s->state, LOGR_SITE_READY, __ATOMIC_RELEASE);
+            return s;
+        }
+        while (state == LOGR_SITE_BUSY) {
+            state = __atomic_load_n(&s->state, __ATOMIC_ACQUIRE);
+        }
+        if ((s->file == rec->file) && (s->line == rec->line)) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+/* Log "last message repeated N times" for the site of s, if it was. */
+static int
+_logr_dedup_report(logr_t *logr, struct logr_dedup_slot *s,
+                   const struct timespec *ts)
+{
+    unsigned long n = __atomic_exchange_n(&s->repeats, 0, __ATOMIC_RELAXED);
+    struct logr_record rec = {
+        .file = s->file, .line = s->line, .func = s->func,
+        .pretty_func = s->pretty_func,
+        .level = __atomic_load_n(&s->level, __ATOMIC_RELAXED), .ts = *ts
+    };
+    char msg[64];
+
+    if (n == 0) {
+        return 0;
+    }
+    rec.len = snprintf(msg, sizeof(msg), "last message repeated %lu times\n",
+                       n);
+    rec.msg = msg;
+    return _logr_put(logr, &rec);
+}
+
+#ifndef __WIN32
+/*
+ * Report the repeats of every site whose window is over.  Returns the ms
+ * until the next window with repeats ends, or the window if none has any.
+ * Called from the timer thread.
+ */
+static unsigned int
+_logr_dedup_expire(logr_t *logr)
+{
+    struct logr_dedup *d = __atomic_load_n(&logr->dedup, __ATOMIC_ACQUIRE);
+    uint64_t window = (uint64_t)logr->dedup_ms * 1000000;
+    struct logr_dedup_slot *s;
+    uint64_t now, end, next;
+    struct timespec ts;
+    int i;
+
+    if (d == NULL) {
+        return logr->dedup_ms;
+    }
+    _logr_now(&ts);
+    now = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    next = now + window;
+    for (i = 0; i < LOGR_DEDUP_SLOTS; i++) {
+        s = &d->slot[i];
+        if ((__atomic_load_n(&s->state, __ATOMIC_ACQUIRE) !=
+                LOGR_SITE_READY) ||
+                (__atomic_load_n(&s->repeats, __ATOMIC_RELAXED) == 0)) {
+            continue;
+        }
+        end = __atomic_load_n(&s->since, __ATOMIC_RELAXED) + window;
+        if (end <= now) {
+            _logr_dedup_report(logr, s, &ts);
+        } else if (end < next) {
+            next = end;
+        }
+    }
+    return (next - now + 999999) / 1000000;
+}
+#endif
+
+/* Report every site with repeats not logged yet. */
+static void
+_logr_dedup_flush(logr_t *logr)
+{
+    struct logr_dedup *d = __atomic_load_n(&logr->dedup, __ATOMIC_ACQUIRE);
+    struct timespec ts;
+    int i;
+
+    if (d == NULL) {
+        return;
+    }
+    _logr_now(&ts);
+    for (i = 0; i < LOGR_DEDUP_SLOTS; i++) {
+        if (__atomic_load_n(&d->slot[i].state, __ATOMIC_ACQUIRE) ==
+                LOGR_SITE_READY) {
+            _logr_dedup_report(logr, &d->slot[i], &ts);
         }
-    } else if (STREQ("pid", field, size)) {
-        return (specifier == 'd') ? fprintf(f, "%d", getpid()) : 0;
-    } else if (STREQ("timestamp", field, size)) {
-        return _logr_timestamp(logr->timestamp_fmt, specifier, f);
     }
-    return 0;
 }
 
+/* logr_vxprintf() with de-duplication on. */
 static int
-logr_prefix(LOGR_XARGV, logr_t *logr, int level, FILE *f, const char *fmt)
+_logr_dedup_vprintf(logr_t *logr, struct logr_dedup *d, uint64_t window,
+                    struct logr_record *rec, const char *fmt, va_list ap)
 {
-    int retval, total = 0, n = 0;
-    const char *p = fmt, *field = NULL;
-    enum {
-        CHARACTER,        // plain format char
-        DIRECTIVE_SYMBOL, // %
-        FIELD,            // between {}
-        FIELD_CLOSE       // saw }, need specifier.
-    } state = CHARACTER;
+    uint64_t now, hash = 14695981039346656037ULL;
+    struct logr_dedup_slot *s;
+    struct logr_buf *b = _logr_tls();
+    size_t i;
 
-    for (; *p != 0; p++) {
-        switch (state) {
-        case CHARACTER:
-            if (*p == '%') {
-                state = DIRECTIVE_SYMBOL;
-            } else if (isprint((int)(*p)) || (*p == '\r') || (*p == '\n')) {
-                retval = fputc(*p, f);
-                if (retval < 0) {
-                    return -1;
-                }
-                total++;
-            } else {
-                _logr_fatal("*** invalid format character ***\n");
-            }
-            break;
-        case DIRECTIVE_SYMBOL:
-            if (*p == '%') {
-                retval = fputc(*p, f);
-                if (retval < 0) {
-                    return -1;
-                }
-                total++;
-                state = CHARACTER;
-            } else if (*p == '{') {
-                state = FIELD;
-                n = 0;
-            } else {
-                _logr_fatal("*** invalid directive ***\n");
-            }
-            break;
-        case FIELD:
-            if (*p == '}') {
-                state = FIELD_CLOSE;
-                break;
-            } else if (!_logr_field_char(*p)) {
-                _logr_fatal("*** invalid field character ***\n");
-            }
-            if (n == 0) {
-                field = p;
-            }
-            n++;
-            break;
-        case FIELD_CLOSE:
-            if (!_logr_specifier_char(*p)) {
-                _logr_fatal("*** invalid specifier ***\n");
-            }
-            if (n != 0) {
-                retval = logr_util_process(_XARGS, logr, level, f,
-                                           field, n, *p);
-                if (retval < 0) {
-                    return -1;
-                }
-                total += retval;
-            }
-            state = CHARACTER;
-            break;
-        }
+    if (_logr_buf_vprintf(b, fmt, ap) < 0) {
+        return -1;
     }
+    rec->msg = b->data;
+    rec->len = b->len;
 
-    if (state != CHARACTER) {
-        _logr_fatal("*** premature end of format ***\n");
+    s = _logr_dedup_slot(d, rec);
+    if (s != NULL) {
+        /* FNV-1a of the level and message */
+        hash = (hash ^ (unsigned int)rec->level) * 1099511628211ULL;
+        for (i = 0; i < rec->len; i++) {
+            hash = (hash ^ (unsigned char)rec->msg[i]) * 1099511628211ULL;
+        }
+        now = (uint64_t)rec->ts.tv_sec * 1000000000 + rec->ts.tv_nsec;
+        if ((__atomic_load_n(&s->hash, __ATOMIC_RELAXED) == hash) &&
+                (now - __atomic_load_n(&s->since, __ATOMIC_RELAXED) <
+                 window * 1000000)) {
+            __atomic_add_fetch(&s->repeats, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+        /* the repeats belong before this message */
+        if (_logr_dedup_report(logr, s, &rec->ts) < 0) {
+            return -1;
+        }
+        __atomic_store_n(&s->hash, hash, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->since, now, __ATOMIC_RELAXED);
+        __atomic_store_n(&s->level, rec->level, __ATOMIC_RELAXED);
     }
-
-    return total;
+    return _logr_put(logr, rec);
 }
 
-static inline int
-_logr_util_prefix(LOGR_XARGV, logr_t *logr, int level, FILE *f)
+int
+logr_set_dedup(logr_t *logr, unsigned int window_ms)
 {
-    if (logr->ops.prefix != NULL) {
-        return logr->ops.prefix(_XARGS, logr, level, f, logr->prefix_fmt);
+    struct logr_dedup *d;
+
+    if (logr == NULL) {
+        return _logr_errno(EINVAL);
+    }
+
+    if ((window_ms != 0) &&
+            (__atomic_load_n(&logr->dedup, __ATOMIC_ACQUIRE) == NULL)) {
+        d = (struct logr_dedup *)calloc(1, sizeof(struct logr_dedup));
+        if (d == NULL) {
+            return _logr_errno(ENOMEM);
+        }
+        logr_lock(logr);
+        if (logr->dedup == NULL) {
+            __atomic_store_n(&logr->dedup, d, __ATOMIC_RELEASE);
+            d = NULL;
+        }
+        logr_unlock(logr);
+        free(d);
     }
-    if (logr->prefix_fmt != NULL) {
-        return logr_prefix(_XARGS, logr, level, f, logr->prefix_fmt);
+#ifndef __WIN32
+    _logr_timer_remove(logr);
+#endif
+    __atomic_store_n(&logr->dedup_ms, window_ms, __ATOMIC_RELAXED);
+    if (window_ms == 0) {
+        /* the slots stay until logr_free(), callers may be using them */
+        _logr_dedup_flush(logr);
+    }
+#ifndef __WIN32
+    if (_logr_timer_wanted(logr)) {
+        return _logr_timer_add(logr);
     }
+#endif
     return 0;
 }
 
@@ -638,44 +7512,107 @@ int
 logr_vxprintf(LOGR_XARGV, logr_t *logr, int level, const char *fmt, va_list ap)
 {
     int n = 0, retval;
-    FILE *f;
+    struct logr_buf *b;
+    size_t start;
+    struct logr_record rec = {
+        .file = file, .line = line, .func = func, .pretty_func = pretty_func,
+        .level = level
+    };
+    struct logr_dedup *d;
+    struct logr_flight *fl;
+    unsigned int window;
+#ifndef __WIN32
+    struct logr_queue *q;
+    struct logr_shards *set;
+    struct logr_shard *s;
+#endif
 
     if (logr == NULL) {
         return 0;
     }
 
-    logr_lock(logr);
-
-    if (logr->level < level) {
-        logr_unlock(logr);
+    /* filtered entries never touch the lock */
+    if (level & _LOGR_FORCED) {
+        /* the call site was turned on, see logr_set_sites() */
+        rec.level = level &= ~_LOGR_FORCED;
+    } else if (__atomic_load_n(&logr->level, __ATOMIC_RELAXED) <
+               (unsigned int)level) {
+        /* unless the flight recorder keeps them */
+        fl = __atomic_load_n(&logr->flight, __ATOMIC_ACQUIRE);
+        if ((fl != NULL) && (fl->level >= (unsigned int)level)) {
+            _logr_now(&rec.ts);
+            _logr_flight_vprintf(fl, &rec, fmt, ap);
+        }
+        _logr_count(&_logr_stripe(logr)->filtered, 1);
         return 0;
     }
+    _logr_count(&_logr_stripe(logr)->emitted, 1);
+    fl = __atomic_load_n(&logr->flight, __ATOMIC_ACQUIRE);
+    /* a named logger without a file writes through an ancestor */
+    logr = __atomic_load_n(&logr->target, __ATOMIC_ACQUIRE);
+    _logr_now(&rec.ts);
+
+    /* what was filtered out before this entry goes before it */
+    if ((fl != NULL) && (level <= fl->dump_level)) {
+        _logr_flight_dump(logr, fl);
+    }
+
+    if (__atomic_load_n(&logr->binary, __ATOMIC_RELAXED)) {
+        return _logr_bin_vprintf(logr, &rec, fmt, ap);
+    }
+
+    window = __atomic_load_n(&logr->dedup_ms, __ATOMIC_RELAXED);
+    if ((window != 0) &&
+            ((d = __atomic_load_n(&logr->dedup, __ATOMIC_ACQUIRE)) != NULL)) {
+        return _logr_dedup_vprintf(logr, d, window, &rec, fmt, ap);
+    }
+
+#ifndef __WIN32
+    set = __atomic_load_n(&logr->shards, __ATOMIC_ACQUIRE);
+    if ((set != NULL) && __atomic_load_n(&set->active, __ATOMIC_RELAXED) &&
+            ((s = _logr_shard_enter(set)) != NULL)) {
+        return _logr_shard_log(set, s, &rec, fmt, ap);
+    }
+
+    q = __atomic_load_n(&logr->queue, __ATOMIC_ACQUIRE);
+    if ((q != NULL) && __atomic_load_n(&q->active, __ATOMIC_RELAXED)) {
+        return _logr_enqueue(logr, q, &rec, fmt, ap);
+    }
+#endif
 
-    f = (logr->f != NULL) ? logr->f : stderr;
+    logr_lock(logr);
 
-    retval = _logr_util_prefix(_XARGS, logr, level, f);
+    /*
+     * Render the whole entry and hand it to the kernel in one write, or
+     * append it to the logger's buffer until the flush policy says so.
+     */
+    b = logr->buffered ? &logr->out : _logr_tls();
+    _logr_check_rotate_time(logr, b, rec.ts.tv_sec);
+    start = b->len;
+    retval = _logr_util_prefix(&rec, logr, b);
     if (retval < 0) {
+        b->len = start;
         logr_unlock(logr);
         return -1;
     }
     n += retval;
 
-    n += vfprintf(f, fmt, ap);
-    logr->size += n;
-    fflush(f);
+    retval = _logr_buf_vprintf(b, fmt, ap);
+    if (retval < 0) {
+        b->len = start;
+        logr_unlock(logr);
+        return -1;
+    }
+    n += retval;
 
-    if (logr->path != NULL) {
-        if ((logr->threshold != 0) && (logr->size > logr->threshold) &&
-                 (logr->path != NULL)) {
-            fclose(logr->f);    // Have to close before rename for win32
-            _logr_rotatelog(logr);
-            logr->f = fopen(logr->path, "a");
-            logr->size = 0;
-            if (logr->f == NULL) {
-                // fixme
-                printf("Couldn't reopen log file %s\n", logr->path);
-                n = -1;
-            }
+    if ((logr->nsinks != 0) &&
+            (_logr_fanout(logr, &rec, b->data + start, b->len - start,
+                          n - retval) < 0)) {
+        n = -1;
+    }
+    if (!logr->buffered || _logr_flush_due(logr, b, level)) {
+        if (_logr_commit(logr, b) < 0) {
+            n = -1;
         }
     }
 
@@ -683,7 +7620,6 @@ logr_vxprintf(LOGR_XARGV, logr_t *logr, int level, const char *fmt, va_list ap)
     return n;
 }
 
-
 int
 logr_xprintf(LOGR_XARGV, logr_t *logr, int level, const char *fmt, ...)
 {
@@ -696,6 +7632,155 @@ logr_xprintf(LOGR_XARGV, logr_t *logr, int level, const char *fmt, ...)
     return n;
 }
 
+int
+logr_xkv(LOGR_XARGV, logr_t *logr, int level, const char *msg,
+         const struct logr_kv *kvs, size_t count)
+{
+    int n = 0, retval;
+    struct logr_buf *b, t = { NULL, 0, 0 };
+    size_t start;
+    struct logr_record rec = {
+        .file = file, .line = line, .func = func, .pretty_func = pretty_func,
+        .level = level
+    };
+    struct logr_flight *fl;
+    bool filtered = false;
+#ifndef __WIN32
+    struct logr_queue *q;
+    struct logr_shards *set;
+    struct logr_shard *s;
+#endif
+
+    if (logr == NULL) {
+        return 0;
+    }
+    fl = __atomic_load_n(&logr->flight, __ATOMIC_ACQUIRE);
+    if (level & _LOGR_FORCED) {
+        rec.level = level & ~_LOGR_FORCED;
+    } else if (__atomic_load_n(&logr->level, __ATOMIC_RELAXED) <
+               (unsigned int)level) {
+        _logr_count(&_logr_stripe(logr)->filtered, 1);
+        if ((fl == NULL) || (fl->level < (unsigned int)level)) {
+            return 0;
+        }
+        filtered = true;
+    }
+    if (!filtered) {
+        _logr_count(&_logr_stripe(logr)->emitted, 1);
+    }
+    logr = __atomic_load_n(&logr->target, __ATOMIC_ACQUIRE);
+    rec.kv = __atomic_load_n(&logr->kv_format, __ATOMIC_RELAXED);
+
+    /* as in logr_vxprintf(), but binary loggers can't dump the recorder */
+    if ((fl != NULL) && !__atomic_load_n(&logr->binary, __ATOMIC_RELAXED)) {
+        _logr_now(&rec.ts);
+        if (filtered) {
+            b = _logr_tls();
+            if (_logr_kv_body(b, rec.kv, msg, kvs, count) < 0) {
+                return -1;
+            }
+            rec.msg = b->data;
+            rec.len = b->len;
+            _logr_flight_put(fl, &rec);
+            return 0;
+        }
+        if (rec.level <= fl->dump_level) {
+            _logr_flight_dump(logr, fl);
+        }
+    }
+    if (filtered) {
+        return 0;
+    }
+
+    if (__atomic_load_n(&logr->binary, __ATOMIC_RELAXED)) {
+        /* binary entries have prefix fields of their own */
+        if ((_logr_kv_body(&t, LOGR_KV_LOGFMT, msg, kvs, count) < 0) ||
+                (_logr_buf_put(&t, "", 1) < 0)) {
+            n = -1;
+        } else {
+            /* already filtered and counted, maybe on a named logger */
+            _logr_now(&rec.ts);
+            n = _logr_bin_printf(logr, &rec, "%s", t.data);
+        }
+        free(t.data);
+        return n;
+    }
+    _logr_now(&rec.ts);
+
+#ifndef __WIN32
+    set = __atomic_load_n(&logr->shards, __ATOMIC_ACQUIRE);
+    if ((set != NULL) && __atomic_load_n(&set->active, __ATOMIC_RELAXED) &&
+            ((s = _logr_shard_enter(set)) != NULL)) {
+        b = _logr_tls();
+        if (_logr_kv_body(b, rec.kv, msg, kvs, count) < 0) {
+            _logr_shard_leave(set, s);
+            return -1;
+        }
+        rec.msg = b->data;
+        rec.len = b->len;
+        return _logr_shard_put(set, s, &rec);
+    }
+
+    q = __atomic_load_n(&logr->queue, __ATOMIC_ACQUIRE);
+    if ((q != NULL) && __atomic_load_n(&q->active, __ATOMIC_RELAXED)) {
+        b = _logr_tls();
+        if (_logr_kv_body(b, rec.kv, msg, kvs, count) < 0) {
+            return -1;
+        }
+        rec.msg = b->data;
+        rec.len = b->len;
+        return _logr_enqueue_rec(logr, q, &rec);
+    }
+#endif
+
+    logr_lock(logr);
+
+    /* as in logr_vxprintf(), with the pairs in place of the message */
+    b = logr->buffered ? &logr->out : _logr_tls();
+    _logr_check_rotate_time(logr, b, rec.ts.tv_sec);
+    start = b->len;
+    retval = _logr_kv_prefix(&rec, logr, b);
+    if (retval < 0) {
+        b->len = start;
+        logr_unlock(logr);
+        return -1;
+    }
+    n += retval;
+
+    retval = _logr_kv_body(b, rec.kv, msg, kvs, count);
+    if (retval < 0) {
+        b->len = start;
+        logr_unlock(logr);
+        return -1;
+    }
+    n += retval;
+
+    if ((logr->nsinks != 0) &&
+            (_logr_fanout(logr, &rec, b->data + start, b->len - start,
+                          0) < 0)) {
+        n = -1;
+    }
+    if (!logr->buffered || _logr_flush_due(logr, b, rec.level)) {
+        if (_logr_commit(logr, b) < 0) {
+            n = -1;
+        }
+    }
+
+    logr_unlock(logr);
+    return n;
+}
+
+int
+logr_set_kv_format(logr_t *logr, int format)
+{
+    if ((logr == NULL) ||
+            ((format != LOGR_KV_JSON) && (format != LOGR_KV_LOGFMT))) {
+        return _logr_errno(EINVAL);
+    }
+    __atomic_store_n(&logr->kv_format, format, __ATOMIC_RELAXED);
+    return 0;
+}
+
 int
 logr_emerg_(LOGR_XARGV, const char *fmt, ...)
 {
@@ -792,3 +7877,218 @@ logr_debug_(LOGR_XARGV, const char *fmt, ...)
     return n;
 }
 
+/* Count an entry the macros stopped at the level test. */
+void
+logr_filtered_(logr_t *logr)
+{
+    _logr_count(&_logr_stripe(logr)->filtered, 1);
+}
+
+/* Per-thread xorshift64* state for logr_printf_sampled(), 0 until seeded. */
+static __thread uint64_t logr_random_state;
+
+unsigned int
+logr_random_(void)
+{
+    uint64_t x = logr_random_state;
+    struct timespec ts;
+
+    if (x == 0) {
+        _logr_now(&ts);
+        x = ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec) ^
+            ((uintptr_t)&logr_random_state * 0x9e3779b97f4a7c15ULL);
+        if (x == 0) {
+            x = 1;
+        }
+    }
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    logr_random_state = x;
+    return (unsigned int)((x * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+/*
+ * The state of a logr_printf_per_sec() call site packs the current second
+ * above LOGR_RATE_BITS and the messages printed in it below.
+ */
+#define LOGR_RATE_BITS 20
+#define LOGR_RATE_MAX ((1U << LOGR_RATE_BITS) - 1)
+
+int
+logr_per_sec_(unsigned long long *state, unsigned int k)
+{
+    unsigned long long old, next, now;
+#ifdef __WIN32
+    now = time(NULL);
+#else
+    struct timespec ts;
+
+#ifdef CLOCK_MONOTONIC_COARSE
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    now = ts.tv_sec;
+#endif
+    if (k == 0) {
+        return 0;
+    }
+    if (k > LOGR_RATE_MAX) {
+        k = LOGR_RATE_MAX;
+    }
+
+    old = __atomic_load_n(state, __ATOMIC_RELAXED);
+    do {
+        if ((old >> LOGR_RATE_BITS) != now) {
+            next = (now << LOGR_RATE_BITS) | 1;
+        } else if ((old & LOGR_RATE_MAX) >= k) {
+            return 0;
+        } else {
+            next = old + 1;
+        }
+    } while (!__atomic_compare_exchange_n(state, &old, next, true,
+                                          __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+    return 1;
+}
+
+
+#ifdef LOGR_HAVE_SITES
+/*
+ * The call site arrays of the executable and of each shared object using
+ * logr, registered by the constructor logr.h adds to every object.
+ */
+struct logr_site_range {
+    struct logr_callsite *start;
+    struct logr_callsite *stop;
+};
+
+static pthread_mutex_t logr_callsites_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct logr_site_range *logr_callsites;
+static size_t logr_ncallsites, logr_callsites_size;
+
+void
+logr_register_sites_(struct logr_callsite *start, struct logr_callsite *stop)
+{
+    struct logr_site_range *r;
+    size_t i;
+
+    if ((start == NULL) || (start >= stop)) {
+        return;
+    }
+    pthread_mutex_lock(&logr_callsites_lock);
+    /* each translation unit of an object registers the same array */
+    for (i = 0; i < logr_ncallsites; i++) {
+        if (logr_callsites[i].start == start) {
+            break;
+        }
+    }
+    if (i == logr_ncallsites) {
+        if (logr_ncallsites == logr_callsites_size) {
+            r = (struct logr_site_range *)
+                realloc(logr_callsites, (logr_callsites_size + 8) * sizeof(*r));
+            if (r == NULL) {
+                /* the sites keep working, they can't be listed */
+                pthread_mutex_unlock(&logr_callsites_lock);
+                return;
+            }
+            logr_callsites = r;
+            logr_callsites_size += 8;
+        }
+        logr_callsites[logr_ncallsites].start = start;
+        logr_callsites[logr_ncallsites].stop = stop;
+        logr_ncallsites++;
+    }
+    pthread_mutex_unlock(&logr_callsites_lock);
+}
+
+void
+logr_unregister_sites_(struct logr_callsite *start, struct logr_callsite *stop)
+{
+    size_t i;
+
+    pthread_mutex_lock(&logr_callsites_lock);
+    for (i = 0; i < logr_ncallsites; i++) {
+        if (logr_callsites[i].start == start) {
+            logr_callsites[i] = logr_callsites[--logr_ncallsites];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&logr_callsites_lock);
+}
+
+int
+logr_list_sites(logr_site_func_t fn, void *arg)
+{
+    struct logr_callsite *c, site;
+    size_t i;
+    int n = 0;
+
+    if (fn == NULL) {
+        return _logr_errno(EINVAL);
+    }
+    pthread_mutex_lock(&logr_callsites_lock);
+    for (i = 0; i < logr_ncallsites; i++) {
+        for (c = logr_callsites[i].start; c < logr_callsites[i].stop; c++) {
+            site = *c;
+            site.mode = __atomic_load_n(&c->mode, __ATOMIC_RELAXED);
+            n++;
+            if (fn(&site, arg) != 0) {
+                pthread_mutex_unlock(&logr_callsites_lock);
+                return n;
+            }
+        }
+    }
+    pthread_mutex_unlock(&logr_callsites_lock);
+    return n;
+}
+
+/* Whether the file of a call site matches pattern, in full or by name. */
+static int
+_logr_site_file(const char *pattern, const char *file)
+{
+    const char *base = strrchr(file, '/');
+
+    return (fnmatch(pattern, file, 0) == 0) ||
+        ((base != NULL) && (fnmatch(pattern, base + 1, 0) == 0));
+}
+
+int
+logr_set_sites(const char *file, const char *func, int line, int mode)
+{
+    struct logr_callsite *c;
+    size_t i;
+    int n = 0;
+
+    if ((line < 0) || ((mode != LOGR_SITE_DEFAULT) &&
+                       (mode != LOGR_SITE_ON) && (mode != LOGR_SITE_OFF))) {
+        return _logr_errno(EINVAL);
+    }
+    pthread_mutex_lock(&logr_callsites_lock);
+    for (i = 0; i < logr_ncallsites; i++) {
+        for (c = logr_callsites[i].start; c < logr_callsites[i].stop; c++) {
+            if (((line == 0) || (c->line == line)) &&
+                    ((file == NULL) || _logr_site_file(file, c->file)) &&
+                    ((func == NULL) || (fnmatch(func, c->func, 0) == 0))) {
+                __atomic_store_n(&c->mode, mode, __ATOMIC_RELAXED);
+                n++;
+            }
+        }
+    }
+    pthread_mutex_unlock(&logr_callsites_lock);
+    return n;
+}
+#else
+int
+logr_list_sites(logr_site_func_t fn, void *arg)
+{
+    return _logr_errno(ENOTSUP);
+}
+
+int
+logr_set_sites(const char *file, const char *func, int line, int mode)
+{
+    return _logr_errno(ENOTSUP);
+}
+#endif
@@ -58,6 +58,75 @@ extern "C" {
  */
 #define LOGR_MAX_TIMESTAMP_SIZE 256
 
+/**
+ * Default size of the buffer holding entries back under a flush policy.
+ */
+#define LOGR_DEFAULT_BUFFER_SIZE (64 * 1024)
+
+/**
+ * Rotate the log file at the start of every hour.
+ * \see logr_set_rotate_interval
+ */
+#define LOGR_ROTATE_HOURLY 3600
+
+/**
+ * Rotate the log file at local midnight.
+ * \see logr_set_rotate_interval
+ */
+#define LOGR_ROTATE_DAILY 86400
+
+/**
+ * logr_decode() flag: keep the logger's prefix format instead of the one
+ * recorded in the file.
+ */
+#define LOGR_DECODE_KEEP_PREFIX    0x1
+
+/**
+ * logr_decode() flag: keep the logger's timestamp format instead of the
+ * one recorded in the file.
+ */
+#define LOGR_DECODE_KEEP_TIMESTAMP 0x2
+
+/**
+ * logr_set_io_uring() flag: follow every write with fdatasync(2), still
+ * without blocking the caller.
+ */
+#define LOGR_IO_URING_DATASYNC 0x1
+
+/**
+ * logr_set_io_uring() flag: let a kernel thread poll for writes, so that
+ * submitting one takes no system call at all.
+ */
+#define LOGR_IO_URING_SQPOLL   0x2
+
+/**
+ * logr_add_syslog() flag: speak the systemd journal's native protocol
+ * instead of RFC 5424.
+ */
+#define LOGR_SYSLOG_JOURNAL 0x1
+
+/**
+ * logr_set_kv_format() format: one JSON object per line (the default).
+ */
+#define LOGR_KV_JSON   1
+
+/**
+ * logr_set_kv_format() format: logfmt, key=value pairs.
+ */
+#define LOGR_KV_LOGFMT 2
+
+/**
+ * Flush level writing every entry immediately (the default).
+ * \see logr_set_flush_policy
+ */
+#define LOGR_FLUSH_ALWAYS 0x7fffffff
+
+/**
+ * Flush level never writing entries immediately because of their level.
+ * \see logr_set_flush_policy
+ */
+#define LOGR_FLUSH_NEVER (-1)
+
 /**
  * Maximum number of files for rotation.
  */
@@ -78,6 +147,18 @@ extern "C" {
 #define LOGR_INFO    6
 #define LOGR_DEBUG   7
 
+/**
+ * Highest level compiled into the program.
+ *
+ * Calls made through the logging macros with a level strictly greater than
+ * this value are removed at compile time; their arguments are never
+ * evaluated.  Define it before including logr.h, e.g. -DLOGR_COMPILE_LEVEL=6
+ * strips all <i>logr_debug</i> calls.
+ */
+#ifndef LOGR_COMPILE_LEVEL
+#define LOGR_COMPILE_LEVEL LOGR_DEBUG
+#endif
+
 /// @cond
 #define LOGR_XARGV \
     const char *file, int line, const char *func, const char *pretty_func
@@ -91,6 +172,130 @@ struct logr;
  */
 typedef struct logr logr_t;
 
+/// @cond
+/*
+ * The first member of struct logr is the most verbose level anything
+ * wants: the logger or its flight recorder.
+ */
+#define _LOGR_LEVEL(logr) \
+    __atomic_load_n((const unsigned int *)(logr), __ATOMIC_RELAXED)
+#define _LOGR_ON(logr, level) \
+    (((level) <= LOGR_COMPILE_LEVEL) && \
+     ((unsigned int)(level) <= _LOGR_LEVEL(logr)))
+    extern logr_t *const _logr_global;
+/// @endcond
+
+/**
+ * Call site modes.
+ * \see logr_set_sites
+ */
+#define LOGR_SITE_DEFAULT 0 /* logged if the logger's level allows it */
+#define LOGR_SITE_ON      1 /* always logged */
+#define LOGR_SITE_OFF     2 /* never logged */
+
+/**
+ * Descriptor of a call site of the logging macros, see logr_list_sites().
+ */
+struct logr_callsite {
+    const char *file;
+    const char *func;
+    int line;
+    int level;                /* -1 if not a constant */
+    int mode;                 /* LOGR_SITE_* */
+};
+
+/// @cond
+/* Passed along with the level by call sites turned on. */
+#define _LOGR_FORCED 0x100
+
+#if defined(__ELF__) && !defined(LOGR_NO_SITES) && !defined(__cplusplus)
+/*
+ * Every call site of the macros below puts a struct logr_callsite in the
+ * logr_sites section.  The linker gathers them into one array per
+ * executable or shared object, which each object registers when loaded.
+ * Not in C++: descriptors in inline functions and templates go to COMDAT
+ * groups, and g++ refuses to mix them with others in one section.
+ */
+#define LOGR_HAVE_SITES 1
+
+    extern struct logr_callsite __start_logr_sites[]
+        __attribute__((weak, visibility("hidden")));
+    extern struct logr_callsite __stop_logr_sites[]
+        __attribute__((weak, visibility("hidden")));
+    void logr_register_sites_(struct logr_callsite *start,
+                              struct logr_callsite *stop);
+    void logr_unregister_sites_(struct logr_callsite *start,
+                                struct logr_callsite *stop);
+
+static void __attribute__((constructor, used))
+_logr_sites_load(void)
+{
+    logr_register_sites_(__start_logr_sites, __stop_logr_sites);
+}
+
+static void __attribute__((destructor, used))
+_logr_sites_unload(void)
+{
+    logr_unregister_sites_(__start_logr_sites, __stop_logr_sites);
+}
+
+/*
+ * Whether this call site logs at lvl: 0, non-zero or _LOGR_FORCED when
+ * it was turned on.  A site turned off costs one load and branch.
+ */
+#define _LOGR_SITE(logr, lvl, level) ({                            \
+    static struct logr_callsite _logr_site                         \
+        __attribute__((section("logr_sites"), used)) = {           \
+        __FILE__, __FUNCTION__, __LINE__,                          \
+        __builtin_constant_p(level) ? (level) : -1,                \
+        LOGR_SITE_DEFAULT                                          \
+    };                                                             \
+    int _logr_mode = __atomic_load_n(&_logr_site.mode,             \
+                                     __ATOMIC_RELAXED);            \
+    (_logr_mode == LOGR_SITE_DEFAULT) ? _LOGR_ON(logr, lvl) :      \
+    ((_logr_mode == LOGR_SITE_ON) && ((lvl) <= LOGR_COMPILE_LEVEL)) ? \
+        _LOGR_FORCED : 0; })
+#else
+#define _LOGR_SITE(logr, lvl, level) _LOGR_ON(logr, lvl)
+#endif
+
+/*
+ * _LOGR_SITE() for the logging macros, counting what it stops for
+ * logr_get_stats() unless the level was compiled out.
+ */
+#define _LOGR_PASS(logr, lvl, level) ({                            \
+    int _logr_pass = _LOGR_SITE(logr, lvl, level);                 \
+    if (!_logr_pass && ((lvl) <= LOGR_COMPILE_LEVEL)) {            \
+        logr_filtered_(logr);                                      \
+    }                                                              \
+    _logr_pass; })
+    void logr_filtered_(logr_t *logr);
+
+#define _LOGR_CALL(level, fmt, args...) ({                         \
+    int _logr_n = 0, _logr_on = _LOGR_PASS(_logr_global, level, level); \
+    if (_logr_on) {                                                \
+        _logr_n = logr_xprintf(LOGR_XARGS, _logr_global,           \
+                               (level) | (_logr_on & _LOGR_FORCED), \
+                               fmt, ## args);                      \
+    }                                                              \
+    _logr_n; })
+/// @endcond
+
+/**
+ * Test whether a message of the given level would be printed.
+ *
+ * Useful to guard expensive computations that only feed a log message.
+ * The test is a single relaxed load; no lock is taken.  This routine is
+ * implemented as a macro.
+ *
+ * \param logr The logr_t instance to use.
+ * \param level Level for the message.
+ * \returns non-zero if the message would be printed or kept by the flight
+ * recorder.
+ */
+#define logr_enabled(logr, level) \
+    ((logr) != NULL && _LOGR_ON(logr, level))
+
 /**
  * Function type converting priority values to strings.
  * NOTE: priority functions MUST return a valid string;
@@ -150,6 +355,29 @@ typedef const char * (*logr_priority_func_t)(int);
  */
     logr_t *logr_getlogger();
 
+/**
+ * Returns the logger of the given name, creating it on first use.
+ *
+ * Names are made of components separated by dots, and a logger is the
+ * child of the one named by its name without the last component, e.g.
+ * "db.pool" is the parent of "db.pool.conn".  The global logger is the
+ * root of the tree and has the empty name.  Ancestors are created along
+ * with a logger.
+ *
+ * A named logger inherits the level of its parent until it is given one
+ * with logr_set_level(), and writes to the file (and sinks) of its parent
+ * until it opens one of its own with logr_open(), with the parent's
+ * settings.  Changes reach every descendant inheriting them at once; each
+ * logger holds its level, so the level check doesn't look at ancestors.
+ *
+ * Looking a logger up takes no lock.  Named loggers last as long as the
+ * process: logr_free() ignores them.
+ *
+ * \param name The dotted name, NULL or "" for the global logger.
+ * \returns The logger or NULL on error.
+ */
+    logr_t *logr_get_named(const char *name);
+
 /**
  * Allocate and initialize a logr_t instance.
  * Creates a logr_t instance and associates it with the file specified by the
@@ -173,25 +401,111 @@ typedef const char * (*logr_priority_func_t)(int);
  * Previously opened files are automatically closed, if applicable.
  *
  * \param logr The logr_t instance to use.
- * \param path The filepath of the log file, NULL for stderr.
+ * \param path The filepath of the log file, NULL for stderr or, for a named
+ *             logger, the file of its parent.
  * \returns 0 on success or -1 on error.
  */
     int logr_open(logr_t *logr, const char *path);
 
+/**
+ * Also write entries to another file descriptor.
+ *
+ * Besides its log file (or stderr), a logger can hand each entry to any
+ * number of sinks, e.g. errors to stderr while everything goes to a file.
+ * An entry is rendered once and the same bytes are written to the log and
+ * to every sink whose level is at least the entry's.  The logger's own
+ * level still applies first, so a sink can only receive fewer entries.
+ *
+ * Sinks are written with write(2) as each entry is rendered, whatever the
+ * flush policy, and are neither rotated nor closed by the logger.  In
+ * asynchronous and sharded modes that happens on the writer thread, so
+ * queued entries go to the sinks in place when they are written out.  In
+ * binary mode sinks still receive text.  Adding a descriptor that is
+ * already a sink changes its level.
+ *
+ * \param logr The logr_t instance to use.
+ * \param fd The file descriptor to write to, owned by the caller.
+ * \param level The lowest priority entry the sink receives, e.g.
+ * <i>LOGR_ERR</i>.
+ * \returns 0 on success or -1 on error.
+ */
+    int logr_add_sink(logr_t *logr, int fd, int level);
+
+/**
+ * Stop writing entries to a sink.
+ *
+ * Once this returns the logger no longer uses fd, which may be closed.
+ *
+ * \param logr The logr_t instance to use.
+ * \param fd The file descriptor given to logr_add_sink().
+ * \returns 0 on success or -1 on error, <i>ENOENT</i> if fd isn't a sink.
+ */
+    int logr_remove_sink(logr_t *logr, int fd);
+
+/**
+ * Also send entries to the local syslog daemon or the systemd journal.
+ *
+ * Works like logr_add_sink() but talks to the daemon's unix datagram
+ * socket directly rather than through syslog(3), so the logger's level,
+ * lock and flush policy apply instead of libc's.  Each entry becomes one
+ * datagram: an RFC 5424 message, or with <i>LOGR_SYSLOG_JOURNAL</i> a set
+ * of journal fields including the caller's file, line and function.  The
+ * logger's prefix is left out as the daemon records its own.  Log levels
+ * are syslog priorities.
+ *
+ * Sending never blocks.  Datagrams the daemon can't take yet are held
+ * back, up to 256KB, and later sent several per system call; beyond that
+ * entries are dropped and counted, and the count is reported once the
+ * daemon catches up.  A daemon that restarts is reconnected to, at most
+ * once a second while it is away.
+ *
+ * \param logr The logr_t instance to use.
+ * \param path The daemon's socket, NULL for /dev/log or, with
+ * <i>LOGR_SYSLOG_JOURNAL</i>, /run/systemd/journal/socket.
+ * \param ident The program name recorded with each entry, may be NULL.
+ * \param facility A facility from syslog.h, e.g. <i>LOG_USER</i>.
+ * \param level The lowest priority entry sent, e.g. <i>LOGR_INFO</i>.
+ * \param flags 0 or <i>LOGR_SYSLOG_JOURNAL</i>.
+ * \returns 0 on success or -1 on error.  Not connecting yet isn't one.
+ */
+    int logr_add_syslog(logr_t *logr, const char *path, const char *ident,
+                        int facility, int level, unsigned int flags);
+
+/**
+ * Stop sending entries to a syslog daemon.
+ *
+ * \param logr The logr_t instance to use.
+ * \param path The path given to logr_add_syslog(), or NULL to remove
+ * every syslog sink.
+ * \returns 0 on success or -1 on error, <i>ENOENT</i> if there is no such
+ * sink.
+ */
+    int logr_remove_syslog(logr_t *logr, const char *path);
+
 /**
  * Print formatted output to the log.
  *
  * When <i>level</i> is less than or equal to the level specified by
  * <i>logr_set_level</i>, then print the message to the log file.  This
- * routine is implemented as a macro wrapper around <i>logr_xprintf</i>.
+ * routine is implemented as a macro wrapper around <i>logr_xprintf</i>;
+ * the arguments are not evaluated when the level is disabled.
  *
  * \param logr The logr_t instance to use.
  * \param level Level for this message.
  * \param fmt <i>printf</i>-style format string.
  * \param args Variable arguments for <i>fmt</i>.
  */
-#define logr_printf(logr, level, fmt, args...) \
-    logr_xprintf(LOGR_XARGS, logr, level, fmt, ##args)
+#define logr_printf(logr, level, fmt, args...) ({                  \
+    logr_t *_logr_p = (logr);                                      \
+    int _logr_lvl = (level), _logr_n = 0, _logr_on;                \
+    _logr_on = (_logr_p != NULL) ?                                 \
+        _LOGR_PASS(_logr_p, _logr_lvl, level) : 0;                 \
+    if (_logr_on) {                                                \
+        _logr_n = logr_xprintf(LOGR_XARGS, _logr_p,                \
+                               _logr_lvl | (_logr_on & _LOGR_FORCED), \
+                               fmt, ##args);                       \
+    }                                                              \
+    _logr_n; })
 /// @cond
     int logr_xprintf(LOGR_XARGV, logr_t *logr, int level, const char *fmt, ...);
 /// @endcond
@@ -201,32 +515,309 @@ typedef const char * (*logr_priority_func_t)(int);
  *
  * When <i>level</i> is less than or equal to the level specified by
  * <i>logr_set_level</i>, then print the message to the log file.  This
- * routine is implemented as a macro wrapper around <i>logr_vxprintf</i>.
+ * routine is implemented as a macro wrapper around <i>logr_vxprintf</i>;
+ * <i>ap</i> is not touched when the level is disabled.
  *
  * \param logr The logr_t instance to use.
  * \param level Level for this message.
  * \param fmt <i>printf</i>-style format string.
  * \param ap Variable argument list for <i>fmt</i>
  */
-#define logr_vprintf(logr, level, fmt, ap) \
-    logr_vxprintf(LOGR_XARGS, logr, level, fmt, ap)
+#define logr_vprintf(logr, level, fmt, ap) ({                      \
+    logr_t *_logr_p = (logr);                                      \
+    int _logr_lvl = (level), _logr_n = 0, _logr_on;                \
+    _logr_on = (_logr_p != NULL) ?                                 \
+        _LOGR_PASS(_logr_p, _logr_lvl, level) : 0;                 \
+    if (_logr_on) {                                                \
+        _logr_n = logr_vxprintf(LOGR_XARGS, _logr_p,               \
+                                _logr_lvl | (_logr_on & _LOGR_FORCED), \
+                                fmt, ap);                          \
+    }                                                              \
+    _logr_n; })
 /// @cond
     int logr_vxprintf(LOGR_XARGV, logr_t *logr, int level,
                       const char *fmt, va_list ap);
 /// @endcond
 
+/**
+ * Print every n-th message from this call site.
+ *
+ * Like logr_printf() but only the 1st, (n+1)th, (2n+1)th... call made
+ * while the level is enabled prints anything.  Each call site keeps its own
+ * count, updated atomically; the skipped calls neither evaluate the
+ * arguments nor call into the library.  This routine is implemented as a
+ * macro.
+ *
+ * \param logr The logr_t instance to use.
+ * \param level Level for this message.
+ * \param n Print one call out of this many.
+ * \param fmt <i>printf</i>-style format string.
+ * \param args Variable arguments for <i>fmt</i>.
+ */
+#define logr_printf_every_n(logr, level, n, fmt, args...) ({       \
+    static unsigned long _logr_cnt;                                \
+    logr_t *_logr_p = (logr);                                      \
+    int _logr_lvl = (level), _logr_n = 0, _logr_on;                \
+    unsigned long _logr_every = (n);                               \
+    _logr_on = (_logr_p != NULL) ?                                 \
+        _LOGR_PASS(_logr_p, _logr_lvl, level) : 0;                 \
+    if (_logr_on &&                                                \
+        ((_logr_every <= 1) ||                                     \
+         (__atomic_fetch_add(&_logr_cnt, 1, __ATOMIC_RELAXED) %    \
+          _logr_every == 0))) {                                    \
+        _logr_n = logr_xprintf(LOGR_XARGS, _logr_p,                \
+                               _logr_lvl | (_logr_on & _LOGR_FORCED), \
+                               fmt, ##args);                       \
+    }                                                              \
+    _logr_n; })
+
+/**
+ * Print a random sample of the messages from this call site.
+ *
+ * Like logr_printf() but each call made while the level is enabled prints
+ * with probability <i>p</i>, using a per-thread random number generator.
+ * The calls left out neither evaluate the arguments nor format anything.
+ * This routine is implemented as a macro.
+ *
+ * \param logr The logr_t instance to use.
+ * \param level Level for this message.
+ * \param p The fraction of calls to print, from 0.0 to 1.0.
+ * \param fmt <i>printf</i>-style format string.
+ * \param args Variable arguments for <i>fmt</i>.
+ */
+#define logr_printf_sampled(logr, level, p, fmt, args...) ({       \
+    logr_t *_logr_p = (logr);                                      \
+    int _logr_lvl = (level), _logr_n = 0, _logr_on;                \
+    _logr_on = (_logr_p != NULL) ?                                 \
+        _LOGR_PASS(_logr_p, _logr_lvl, level) : 0;                 \
+    if (_logr_on &&                                                \
+        (logr_random_() < (p) * 4294967296.0)) {                   \
+        _logr_n = logr_xprintf(LOGR_XARGS, _logr_p,                \
+                               _logr_lvl | (_logr_on & _LOGR_FORCED), \
+                               fmt, ##args);                       \
+    }                                                              \
+    _logr_n; })
+
+/**
+ * Print at most k messages a second from this call site.
+ *
+ * Like logr_printf() but once a call site has printed <i>k</i> messages
+ * in the current second, further calls are skipped until the next one.
+ * Each call site keeps its own count, updated with a compare and swap;
+ * the skipped calls neither evaluate the arguments nor format anything.
+ * This routine is implemented as a macro.
+ *
+ * \param logr The logr_t instance to use.
+ * \param level Level for this message.
+ * \param k Messages per second, at most about a million.
+ * \param fmt <i>printf</i>-style format string.
+ * \param args Variable arguments for <i>fmt</i>.
+ */
+#define logr_printf_per_sec(logr, level, k, fmt, args...) ({       \
+    static unsigned long long _logr_rate;                          \
+    logr_t *_logr_p = (logr);                                      \
+    int _logr_lvl = (level), _logr_n = 0, _logr_on;                \
+    _logr_on = (_logr_p != NULL) ?                                 \
+        _LOGR_PASS(_logr_p, _logr_lvl, level) : 0;                 \
+    if (_logr_on &&                                                \
+        logr_per_sec_(&_logr_rate, (k))) {                         \
+        _logr_n = logr_xprintf(LOGR_XARGS, _logr_p,                \
+                               _logr_lvl | (_logr_on & _LOGR_FORCED), \
+                               fmt, ##args);                       \
+    }                                                              \
+    _logr_n; })
+/// @cond
+    unsigned int logr_random_(void);
+    int logr_per_sec_(unsigned long long *state, unsigned int k);
+/// @endcond
+
+/// @cond
+enum {
+    _LOGR_KV_STR = 1,
+    _LOGR_KV_INT,
+    _LOGR_KV_BOOL,
+    _LOGR_KV_DOUBLE
+};
+
+struct logr_kv {
+    const char *key;          /* quoted and followed by ':' */
+    unsigned int len;
+    int type;
+    const char *s;
+    long long i;
+    double d;
+};
+
+#define _LOGR_KV_KEY(key) "\"" key "\":", sizeof(key) + 2
+/// @endcond
+
+/**
+ * A string value for logr_kv().  The key must be a string literal naming
+ * the field, with nothing that needs escaping in it; it is turned into
+ * its encoded form at compile time.  A NULL value is logged as null.
+ */
+#define LOGR_STR(key, v)    { _LOGR_KV_KEY(key), _LOGR_KV_STR, (v), 0, 0 }
+
+/**
+ * An integer value for logr_kv().
+ */
+#define LOGR_INT(key, v)    { _LOGR_KV_KEY(key), _LOGR_KV_INT, 0, (v), 0 }
+
+/**
+ * A boolean value for logr_kv().
+ */
+#define LOGR_BOOL(key, v)   { _LOGR_KV_KEY(key), _LOGR_KV_BOOL, 0, !!(v), 0 }
+
+/**
+ * A floating point value for logr_kv().
+ */
+#define LOGR_DOUBLE(key, v) { _LOGR_KV_KEY(key), _LOGR_KV_DOUBLE, 0, 0, (v) }
+
+/**
+ * Log a structured entry made of a message and key/value pairs.
+ *
+ * The entry is encoded as one JSON object or one logfmt line, depending on
+ * logr_set_kv_format(), instead of text after the prefix.  The fields of
+ * the logger's prefix format become keys of their own: with
+ * <i>LOGR_PREFIX_FORMAT_VERBOSE</i> an entry looks like
+ *
+ *     {"timestamp":"2012-02-04-08:17:05","level":"err","file":"srv.c",
+ *      "line":42,"pretty":"main","msg":"done","user":"bob","ms":12}
+ *
+ * followed by a newline.  Values are written as they are, without going
+ * through printf; strings are escaped.  This routine is implemented as a
+ * macro and the values are not evaluated when the level is disabled.
+ * In binary mode the pairs are recorded as the message, in logfmt.
+ *
+ *     logr_kv(logr, LOGR_INFO, "request done",
+ *             LOGR_STR("user", user), LOGR_INT("ms", elapsed));
+ *
+ * \param logr The logr_t instance to use.
+ * \param level Level for this entry.
+ * \param msg The message, logged as the "msg" key.
+ * \param kvs Any number of LOGR_STR(), LOGR_INT(), LOGR_BOOL() and
+ * LOGR_DOUBLE() values.
+ * \returns the number of bytes logged or -1 on error.
+ */
+#define logr_kv(logr, level, msg, kvs...) ({                       \
+    logr_t *_logr_p = (logr);                                      \
+    int _logr_lvl = (level), _logr_n = 0, _logr_on;                \
+    _logr_on = (_logr_p != NULL) ?                                 \
+        _LOGR_PASS(_logr_p, _logr_lvl, level) : 0;                 \
+    if (_logr_on) {                                                \
+        const struct logr_kv _logr_kvs[] = { kvs };                \
+        _logr_n = logr_xkv(LOGR_XARGS, _logr_p,                    \
+                           _logr_lvl | (_logr_on & _LOGR_FORCED), msg, \
+                           _logr_kvs, sizeof(_logr_kvs) /          \
+                           sizeof(struct logr_kv));                \
+    }                                                              \
+    _logr_n; })
+/// @cond
+    int logr_xkv(LOGR_XARGV, logr_t *logr, int level, const char *msg,
+                 const struct logr_kv *kvs, size_t count);
+/// @endcond
+
+/**
+ * Fold repeats of the same message from the same call site.
+ *
+ * When a call site logs the message it logged last again within
+ * <i>window_ms</i> of its first occurrence, the repeat only counts.
+ * "last message repeated N times" is logged when the window is over, or
+ * before that when the call site logs a different message or on
+ * logr_flush().  After the window the message is logged again and a new
+ * window starts.  Call sites are told apart by file and line; the level
+ * is part of the message.  On Windows the count is only logged with the
+ * next different message or on logr_flush().
+ *
+ * Counting a repeat takes no lock, but every message is formatted to be
+ * compared, also in asynchronous and sharded modes.  Binary mode, which
+ * formats nothing, ignores this setting.
+ *
+ * \param logr The logr_t instance to use.
+ * \param window_ms How long to fold repeats for, 0 to stop (the default).
+ * \returns 0 on success or -1 on error.
+ */
+    int logr_set_dedup(logr_t *logr, unsigned int window_ms);
+
+/**
+ * Callback of logr_list_sites(), return non-zero to stop.
+ */
+typedef int (*logr_site_func_t)(const struct logr_callsite *site, void *arg);
+
+/**
+ * List the call sites of the logging macros in the program and the shared
+ * objects it has loaded.
+ *
+ * Each call site of logr_printf(), logr_kv(), logr_err() and the other
+ * macros has a struct logr_callsite placed in a section of its own by
+ * the compiler, so listing them costs nothing until asked.  This needs
+ * an ELF platform and a GCC compatible compiler; define LOGR_NO_SITES to
+ * leave the descriptors out.  Call sites compiled as C++ have none, so
+ * they are not listed and can't be turned on or off: the compiler can't
+ * put those of inline functions and templates in one section with the
+ * others.
+ *
+ * \param fn Called with each call site, in no particular order.
+ * \param arg Passed to fn.
+ * \returns The number of call sites fn was called with or -1 on error.
+ */
+    int logr_list_sites(logr_site_func_t fn, void *arg);
+
+/**
+ * Turn call sites of the logging macros on or off while the program runs.
+ *
+ * A call site turned on logs whatever the level of the logger, up to
+ * <i>LOGR_COMPILE_LEVEL</i>, so debug messages can be enabled for one
+ * file or function alone; output sinks keep their own levels.  A call
+ * site turned off never logs and costs a load and a branch, and the
+ * count of the entry as filtered.
+ * <i>LOGR_SITE_DEFAULT</i> leaves it to the level of the logger again.
+ *
+ *     logr_set_sites("parser.c", NULL, 0, LOGR_SITE_ON);
+ *
+ * \param file A fnmatch(3) pattern matched against the file name as
+ *             given to the compiler and its last component, or NULL.
+ * \param func A fnmatch(3) pattern for the function name, or NULL.
+ * \param line The line number, or 0 for any.
+ * \param mode One of <i>LOGR_SITE_DEFAULT</i>, <i>LOGR_SITE_ON</i> or
+ *             <i>LOGR_SITE_OFF</i>.
+ * \returns The number of call sites matched or -1 on error.
+ */
+    int logr_set_sites(const char *file, const char *func, int line,
+                       int mode);
+
+/**
+ * Choose how logr_kv() entries are encoded.
+ *
+ * \param logr The logr_t instance to use.
+ * \param format <i>LOGR_KV_JSON</i> or <i>LOGR_KV_LOGFMT</i>.
+ * \returns 0 on success or -1 on error.
+ */
+    int logr_set_kv_format(logr_t *logr, int format);
+
 /**
  * Set the maximum level to be output.
  *
  * All log messages whose level is strictly greater than the specied level
  * are ignored.
  *
+ * The level of a named logger also applies to its descendants that
+ * inherit theirs, see logr_get_named().
+ *
  * \param logr The logr_t instance to use.
  * \param level The maximum level that will be printed.
  * \returns the number of bytes printed to the log or -1 on error.
  */
     int logr_set_level(logr_t *logr, unsigned int level);
 
+/**
+ * Make a named logger inherit the level of its parent again.
+ *
+ * \param logr The named logger.
+ * \returns 0 on success or -1 on error.
+ */
+    int logr_inherit_level(logr_t *logr);
+
 /**
  * Get the current maximum level to be output.
  *
@@ -253,11 +844,51 @@ typedef const char * (*logr_priority_func_t)(int);
 
     int logr_set_rotate_file_count(logr_t *logr, int max_files);
 
+/**
+ * Compress rotated files with gzip.
+ *
+ * After each rotation the newest generation is compressed to
+ * \<path\>.1.gz by a low-priority background thread; logging calls
+ * never wait for it.  Compressed generations keep their .gz suffix as
+ * they are shifted.
+ *
+ * \param logr The logr_t instance to use.
+ * \param level The zlib compression level 1-9, or 0 to disable.
+ * \returns 0 on success or -1 on error.  errno is ENOTSUP if logr was
+ *   built without zlib.
+ */
+    int logr_set_compress(logr_t *logr, int level);
+
+/**
+ * Rotate the log file at fixed times of day, in addition to any size
+ * threshold.
+ *
+ * Periods are aligned to local midnight; the file is rotated by the first
+ * entry written after a period ends.  By default rotated files are
+ * numbered like size based rotation.  If name_fmt is given, they are
+ * instead named \<path\>\<name_fmt\> expanded by strftime(3) for the
+ * period they cover, e.g. ".%Y-%m-%d", with .1, .2, ... appended when the
+ * size threshold rotates more than once in a period.  The
+ * logr_set_rotate_file_count() newest of these are kept.
+ *
+ * \param logr The logr_t instance to use.
+ * \param interval <i>LOGR_ROTATE_HOURLY</i>, <i>LOGR_ROTATE_DAILY</i>,
+ *   another number of seconds dividing a day, or 0 to disable.
+ * \param name_fmt strftime format appended to the path, or NULL.
+ * \returns 0 on success or -1 on error.
+ */
+    int logr_set_rotate_interval(logr_t *logr, unsigned int interval,
+                                 const char *name_fmt);
+
 /**
  * Format the timestamp according to the provided specification.
  *
  * The output format of the date can be set in the same manner as the
- * <i>strftime</i> function.
+ * <i>strftime</i> function.  In addition <tt>%{msec}</tt> and
+ * <tt>%{usec}</tt> insert the milliseconds (3 digits) or microseconds
+ * (6 digits) of the entry time, e.g. <tt>"%H:%M:%S.%{msec}"</tt>.
+ *
+ * The rendered string is cached and rebuilt at most once per second.
  *
  * \param logr The logr_t instance to use.
  * \param fmt The output format of the timestamp.
@@ -268,12 +899,55 @@ typedef const char * (*logr_priority_func_t)(int);
 /**
  * Override default formatting operations.
  *
+ * Removing the prefix function fails with <i>EINVAL</i> if the prefix
+ * format has fields only it understood.
+ *
  * \param logr The logr_t instance to use.
  * \param ops Pointer to the operations to replace.
  * \return 0 on success and -1 on error;
  */
     int logr_set_ops(logr_t *logr, logr_ops_t *ops);
 
+/**
+ * Apply the settings in a file.
+ *
+ * Each line of the file is "key = value", blank or a comment starting
+ * with '#'.  The keys are named after the functions setting the same
+ * thing: level (a name such as "debug" or a number), prefix_format,
+ * timestamp_format, threshold, rotate_file_count, compress,
+ * rotate_interval and rotate_name.  A value may be put in double quotes
+ * to keep spaces at its ends.  Settings not in the file are left alone.
+ *
+ *     level = info
+ *     prefix_format = "%{timestamp}s [%{priority}s] "
+ *     threshold = 10485760
+ *
+ * The settings are applied at once, or not at all if the file has an
+ * error.  Like the setters, this never makes threads that are logging
+ * wait: the new settings are swapped in and the old ones freed once the
+ * entry being written, if any, is done.
+ *
+ * \param logr The logr_t instance to use.
+ * \param path The settings file.
+ * \return 0 on success and -1 on error, <i>EINVAL</i> for a bad file.
+ */
+    int logr_load_config(logr_t *logr, const char *path);
+
+/**
+ * Reload a settings file whenever the process receives SIGHUP.
+ *
+ * The file is loaded with logr_load_config() right away, and then by a
+ * thread of the library after each SIGHUP; errors while reloading are
+ * logged to the logger.  The signal handler only wakes that thread and
+ * then calls the handler installed before it, if any.  It stays
+ * installed once set, even after every logger stopped reloading.
+ *
+ * \param logr The logr_t instance to use.
+ * \param path The settings file, NULL to stop reloading.
+ * \return 0 on success and -1 on error.
+ */
+    int logr_reload_on_sighup(logr_t *logr, const char *path);
+
 /**
  * Specify the prefix format for log entries.
  *
@@ -291,6 +965,14 @@ typedef const char * (*logr_priority_func_t)(int);
  * \li <tt>%{priority}s</tt> - same as %{level}s
  * \li <tt>%{pid}d</tt> - process ID of the current process
  * \li <tt>%{timestamp}s</tt> - entry timestamp using the specified format
+ * \li <tt>%{timestamp}d</tt> - entry time in seconds since the epoch
+ * \li <tt>%{msec}d</tt> - milliseconds of the entry time (3 digits)
+ * \li <tt>%{usec}d</tt> - microseconds of the entry time (6 digits)
+ *
+ * The format is parsed once when it is set.  Unknown directives, malformed
+ * fields and non-printable characters are rejected with <i>EINVAL</i>,
+ * unless a prefix function set with logr_set_ops() renders the prefix:
+ * it is given the format as it is.
  *
  * \param logr The logr_t instance to use.
  * \param fmt The format string specifying the prefix.
@@ -303,104 +985,547 @@ typedef const char * (*logr_priority_func_t)(int);
  */
     int logr_set_prefix_format(logr_t *logr, const char *fmt);
 
+/**
+ * Enable or disable asynchronous logging.
+ *
+ * In asynchronous mode the calling thread only formats the message and
+ * copies it into a bounded queue; a background writer thread owned by the
+ * logger renders the prefix, writes the entry and rotates the file.  When
+ * the queue is full the entry is dropped, the call fails with
+ * <i>EAGAIN</i> and the writer notes the number of dropped entries in the
+ * log.  Pending entries are written before the mode is switched off, the
+ * logger is freed or the process exits.
+ *
+ * \param logr The logr_t instance to use.
+ * \param queue_bytes Size of the queue in bytes, 0 to return to
+ * synchronous logging.
+ * \returns 0 on success or -1 on error (<i>ENOTSUP</i> on win32).
+ */
+    int logr_set_async(logr_t *logr, size_t queue_bytes);
+
+/**
+ * Enable or disable sharded logging.
+ *
+ * In sharded mode every thread formats its messages into a ring buffer
+ * of its own, without taking the logger's lock.  Each entry gets a number
+ * from a global counter, and a merge thread owned by the logger writes the
+ * entries in that order, adding the prefix, so the output is the same as
+ * in synchronous mode.  When a thread's ring is full its entry is dropped,
+ * the call fails with <i>EAGAIN</i> and the number of dropped entries is
+ * noted in the log.  Pending entries are written before the mode is
+ * switched off, the logger is freed or the process exits.
+ *
+ * Sharded mode takes precedence over asynchronous mode and is meant for
+ * many threads logging at high rates, where a single lock or queue does
+ * not scale.
+ *
+ * \param logr The logr_t instance to use.
+ * \param shard_bytes Size of each thread's ring in bytes, 0 to return to
+ * synchronous logging.
+ * \returns 0 on success or -1 on error (<i>ENOTSUP</i> on win32).
+ */
+    int logr_set_sharded(logr_t *logr, size_t shard_bytes);
+
+/**
+ * Write the log file through io_uring.
+ *
+ * Entries are copied into buffers registered with the kernel and queued
+ * as writes, in order, on a ring owned by the logger; the caller returns
+ * without waiting for the write to finish and only waits when all
+ * buffers are in flight.  Pending writes are completed before the file
+ * is rotated, closed or flushed with logr_flush(), when the logger is
+ * freed, when a thread that queued writes exits and at process exit.  A
+ * failed write is reported by the next call that writes.  stderr, pipes
+ * and terminals are still written with write(2).
+ *
+ * When io_uring is not available at run time, for instance on an old
+ * kernel or when it is disabled, the call fails and the logger keeps
+ * writing with write(2).  Without <i>LOGR_IO_URING_SQPOLL</i> every write
+ * still takes one system call; combine with logr_set_flush_policy() or
+ * logr_set_async() to write many entries at a time.
+ *
+ * \param logr The logr_t instance to use.
+ * \param enable Non-zero to use io_uring, 0 to go back to write(2).
+ * \param flags <i>LOGR_IO_URING_*</i> flags or 0.
+ * \returns 0 on success or -1 on error, <i>ENOTSUP</i> if io_uring is
+ * not available.
+ */
+    int logr_set_io_uring(logr_t *logr, int enable, unsigned int flags);
+
+/**
+ * Append to the log file through a memory mapping.
+ *
+ * The file is preallocated <i>extent</i> bytes at a time with
+ * posix_fallocate() and the end of it is mapped, so that an entry is
+ * appended with a memory copy and no system call.  The size and rotation
+ * threshold are accounted as usual.  The unused part of the last extent
+ * is cut off when the file is rotated or closed, the logger is freed and
+ * at process exit.
+ *
+ * If the process dies before that, the file holds every entry that was
+ * completely copied, possibly a partial last entry, and then NUL bytes up
+ * to the end of the extent.  These are trimmed when the file is next
+ * mapped; readers can stop at the first NUL byte.  As with write(2), data
+ * the kernel hasn't written back is lost if the system crashes.
+ *
+ * Only one process may write to the file, and it mustn't be truncated
+ * behind the logger's back.  stderr, pipes and terminals are still
+ * written with write(2), and so are binary logs, whose records may end in
+ * NUL bytes.  The mapping takes precedence over io_uring.
+ *
+ * \param logr The logr_t instance to use.
+ * \param extent Bytes to preallocate and map at a time, rounded up to the
+ * page size, or 0 to write with write(2) again.
+ * \returns 0 on success or -1 on error (<i>ENOTSUP</i> on win32).
+ */
+    int logr_set_mmap(logr_t *logr, size_t extent);
+
+/**
+ * Enable or disable binary logging.
+ *
+ * In binary mode nothing is formatted when logging.  Each entry records
+ * its level, timestamp, an id for the call site and the raw printf
+ * arguments (strings are copied); the call site itself, including the
+ * format string, is written once per file.  Such files are turned back
+ * into text with logr_decode() or the <i>logr-decode</i> program, which
+ * use the prefix and timestamp formats in effect when the file was
+ * written.
+ *
+ * Formats using %n, %m, wide characters or positional arguments are
+ * formatted as usual and stored as text.  Binary mode takes precedence
+ * over asynchronous logging; the flush policy and rotation still apply.
+ * Enable it before logr_open() so a file doesn't mix both formats.
+ *
+ * \param logr The logr_t instance to use.
+ * \param enable Non-zero to write binary entries, 0 to write text.
+ * \returns 0 on success or -1 on error.
+ */
+    int logr_set_binary(logr_t *logr, int enable);
+
+/**
+ * Format a binary log.
+ *
+ * Reads a file written in binary mode from fd and logs its entries to
+ * logr as text, with their original level, timestamp, call site and
+ * process id.  Entries above logr's level are skipped.  The prefix and
+ * timestamp formats recorded in the file are set on logr unless flags
+ * contains <i>LOGR_DECODE_KEEP_PREFIX</i> or
+ * <i>LOGR_DECODE_KEEP_TIMESTAMP</i>.
+ *
+ * \param logr The logr_t instance to write to.
+ * \param fd The file descriptor to read.
+ * \param flags <i>LOGR_DECODE_*</i> flags or 0.
+ * \returns 0 on success or -1 on error, <i>EINVAL</i> if the input isn't
+ * a valid binary log.
+ * \see logr_set_binary
+ */
+    int logr_decode(logr_t *logr, int fd, unsigned int flags);
+
+/**
+ * Control when entries are written to the log.
+ *
+ * By default every entry is written as soon as it is logged.  Otherwise
+ * entries are collected in a buffer that is written out when any of the
+ * following is true:
+ * \li the entry's level is <i>level</i> or more severe,
+ * \li <i>bytes</i> are buffered (or the buffer is full),
+ * \li <i>interval_ms</i> milliseconds have passed since the last timed
+ * flush,
+ * \li the file is about to be rotated, reopened or the logger is freed,
+ * \li the process exits.
+ *
+ * For example <tt>logr_set_flush_policy(logr, LOGR_ERR, 0, 100)</tt>
+ * batches informational traffic into large writes at most 100ms old while
+ * errors still reach the disk right away.
+ *
+ * \param logr The logr_t instance to use.
+ * \param level Entries at or below this level are written immediately;
+ * <i>LOGR_FLUSH_ALWAYS</i> restores the default, <i>LOGR_FLUSH_NEVER</i>
+ * disables level based flushing.
+ * \param bytes Write once this many bytes are buffered, 0 for the buffer
+ * size.
+ * \param interval_ms Write at least this often from a timer thread, 0 to
+ * disable (<i>ENOTSUP</i> on win32).
+ * \returns 0 on success or -1 on error.
+ * \see logr_set_buffer_size
+ */
+    int logr_set_flush_policy(logr_t *logr, int level, size_t bytes,
+                              unsigned int interval_ms);
+
+/**
+ * Set the size of the buffer used by the flush policy.
+ *
+ * \param logr The logr_t instance to use.
+ * \param size Size of the buffer in bytes, defaults to
+ * <i>LOGR_DEFAULT_BUFFER_SIZE</i>.
+ * \returns 0 on success or -1 on error.
+ * \see logr_set_flush_policy
+ */
+    int logr_set_buffer_size(logr_t *logr, size_t size);
+
+/**
+ * Write out any entries held back by the flush policy.
+ *
+ * \param logr The logr_t instance to use.
+ * \returns 0 on success or -1 on error.
+ */
+    int logr_flush(logr_t *logr);
+
+/**
+ * Write out what the logger holds when the process crashes.
+ *
+ * Installs handlers for SIGSEGV, SIGBUS, SIGABRT and SIGFPE, shared by
+ * every logger that asks, which write out the entries buffered by the
+ * flush policy and those still waiting in asynchronous or sharded mode
+ * using async-signal-safe calls only, and then hand the signal on to the
+ * handler installed before, or the default action.  So buffering no
+ * longer costs the last entries before a crash, the most useful ones.
+ *
+ * Queued entries are given the prefix from the prefix format with the
+ * timestamp in UTC ISO 8601, or none with a prefix function.  Enable this
+ * on the logger that has the file; up to 64 loggers can.
+ *
+ * Once a handler runs, the writer and merge threads of every logger stop
+ * for good, and the handler waits up to 2 seconds for threads logging at
+ * the time to finish, so that no entry is written twice; threads that log
+ * while it writes wait for it.
+ *
+ * \param logr The logr_t instance to use.
+ * \param enable Non-zero to flush on a crash, 0 to stop.
+ * \returns 0 on success or -1 on error.
+ */
+    int logr_set_crash_flush(logr_t *logr, int enable);
+
+/**
+ * Keep the last entries filtered out in memory.
+ *
+ * Entries of <i>level</i> or a more severe level that the logger's own
+ * level filters out are copied into a ring of <i>records</i> preallocated
+ * slots, rounded up to a power of two; entries written anyway are not, so
+ * a dump repeats nothing already in the log.  Putting an entry in the ring
+ * takes no lock and no system call, so debug entries can be kept all the
+ * time.  Messages are cut to fit a slot of about 400 bytes.
+ *
+ * The ring is written to the log, between marker lines and with each
+ * entry's own timestamp, by logr_flight_dump(), before any entry of
+ * <i>dump_level</i> or a more severe level, and when the process crashes
+ * if logr_set_crash_flush() is enabled on the same logger.  Each entry is
+ * dumped once.  In asynchronous and sharded modes the dump is queued
+ * behind the entries queued before it.  Named loggers have rings of their
+ * own; the ring is dumped to the logger writing the entries.  Binary
+ * loggers can't dump the ring.
+ *
+ * \param logr The logr_t instance to use.
+ * \param records Number of entries to keep, 0 to stop.
+ * \param level Most verbose level kept, e.g. <i>LOGR_DEBUG</i>.
+ * \param dump_level Entries of this level or more severe dump the ring,
+ * <i>LOGR_FLUSH_NEVER</i> for none.
+ * \returns 0 on success or -1 on error.
+ */
+    int logr_set_flight_recorder(logr_t *logr, size_t records, int level,
+                                 int dump_level);
+
+/**
+ * Write out the entries kept by the flight recorder since the last dump.
+ *
+ * \param logr The logr_t instance to use.
+ * \returns 0 on success or -1 on error.
+ * \see logr_set_flight_recorder
+ */
+    int logr_flight_dump(logr_t *logr);
+
+/**
+ * Counters of a logger, see logr_get_stats().
+ */
+struct logr_stats {
+    unsigned long long emitted;       /* entries past the level test */
+    unsigned long long filtered;      /* entries stopped by it */
+    unsigned long long bytes;         /* written to the output */
+    unsigned long long dropped;       /* lost to a full queue, or by syslog */
+    unsigned long long rotations;
+    unsigned long long rotate_errors; /* rotations with a step failing */
+    unsigned long long write_errors;  /* to the file, sinks or syslog */
+    unsigned long long flushes;       /* writes of rendered entries */
+    unsigned long long lock_wait_ns;  /* waiting for the logger's lock */
+};
+
+/**
+ * Get the counters of a logger since it was allocated.
+ *
+ * Entries emitted and filtered are those logged through this logger;
+ * the other counters are about the output, so a named logger without a
+ * file of its own has its entries written, and counted, by an ancestor.
+ * Entries the macros stop at the level test are counted as filtered too,
+ * unless their level was compiled out with LOGR_COMPILE_LEVEL.  Counters
+ * bumped outside the logger's lock are atomics spread over 16 stripes,
+ * each thread taking the next stripe in turn, and summed here; threads
+ * rarely share a stripe, but more than 16 of them always do.
+ *
+ * \param logr The logr_t instance to use.
+ * \param stats Filled in with the counters.
+ * \returns 0 on success or -1 on error.
+ */
+    int logr_get_stats(logr_t *logr, struct logr_stats *stats);
+
 /* high-level interface */
 
 /**
  * Shorthand for: logr_printf(logr_getlogger(), LOGR_EMERG, fmt, ...)
- * This routine is implemented as a macro.
+ * This routine is implemented as a macro; the arguments are not evaluated
+ * when the level is disabled.
  * \see logr_printf
  * \see logr_getlogger
  */
-#define logr_emerg(fmt, args...) logr_emerg_(LOGR_XARGS, fmt, ## args)
+#define logr_emerg(fmt, args...) \
+    _LOGR_CALL(LOGR_EMERG, fmt, ## args)
 /// @cond
     int logr_emerg_(LOGR_XARGV, const char *fmt, ...);
 /// @endcond
 
 /**
  * Shorthand for: logr_printf(logr_getlogger(), LOGR_ALERT, fmt, ...)
- * This routine is implemented as a macro.
+ * This routine is implemented as a macro; the arguments are not evaluated
+ * when the level is disabled.
  * \see logr_printf
  * \see logr_getlogger
  */
-#define logr_alert(fmt, args...) logr_alert_(LOGR_XARGS, fmt, ## args)
+#define logr_alert(fmt, args...) \
+    _LOGR_CALL(LOGR_ALERT, fmt, ## args)
 /// @cond
     int logr_alert_(LOGR_XARGV, const char *fmt, ...);
 /// @endcond
 
 /**
  * Shorthand for: logr_printf(logr_getlogger(), LOGR_CRIT, fmt, ...)
- * This routine is implemented as a macro.
+ * This routine is implemented as a macro; the arguments are not evaluated
+ * when the level is disabled.
  * \see logr_printf
  * \see logr_getlogger
  */
-#define logr_crit(fmt, args...) logr_crit_(LOGR_XARGS, fmt, ## args)
+#define logr_crit(fmt, args...) \
+    _LOGR_CALL(LOGR_CRIT, fmt, ## args)
 /// @cond
     int logr_crit_(LOGR_XARGV, const char *fmt, ...);
 /// @endcond
 
 /**
  * Shorthand for: logr_printf(logr_getlogger(), LOGR_ERR, fmt, ...)
- * This routine is implemented as a macro.
+ * This routine is implemented as a macro; the arguments are not evaluated
+ * when the level is disabled.
  * \see logr_printf
  * \see logr_getlogger
  */
-#define logr_err(fmt, args...) logr_err_(LOGR_XARGS, fmt, ## args)
+#define logr_err(fmt, args...) \
+    _LOGR_CALL(LOGR_ERR, fmt, ## args)
 /// @cond
     int logr_err_(LOGR_XARGV, const char *fmt, ...);
 /// @endcond
 
 /**
  * Shorthand for: logr_printf(logr_getlogger(), LOGR_WARNING, fmt, ...)
- * This routine is implemented as a macro.
+ * This routine is implemented as a macro; the arguments are not evaluated
+ * when the level is disabled.
  * \see logr_printf
  * \see logr_getlogger
  */
-#define logr_warning(fmt, args...) logr_warning_(LOGR_XARGS, fmt, ## args)
+#define logr_warning(fmt, args...) \
+    _LOGR_CALL(LOGR_WARNING, fmt, ## args)
 /// @cond
     int logr_warning_(LOGR_XARGV, const char *fmt, ...);
 /// @endcond
 
 /**
  * Shorthand for: logr_printf(logr_getlogger(), LOGR_WARNING, fmt, ...)
- * This routine is implemented as a macro.
+ * This routine is implemented as a macro; the arguments are not evaluated
+ * when the level is disabled.
  * \see logr_printf
  * \see logr_getlogger
  */
-#define logr_warn(fmt, args...) logr_warning_(LOGR_XARGS, fmt, ## args)
+#define logr_warn(fmt, args...) logr_warning(fmt, ## args)
 
 /**
  * Shorthand for: logr_printf(logr_getlogger(), LOGR_NOTICE, fmt, ...)
- * This routine is implemented as a macro.
+ * This routine is implemented as a macro; the arguments are not evaluated
+ * when the level is disabled.
  * \see logr_printf
  * \see logr_getlogger
  */
-#define logr_notice(fmt, args...) logr_notice_(LOGR_XARGS, fmt, ## args)
+#define logr_notice(fmt, args...) \
+    _LOGR_CALL(LOGR_NOTICE, fmt, ## args)
 /// @cond
     int logr_notice_(LOGR_XARGV, const char *fmt, ...);
 /// @endcond
 
 /**
  * Shorthand for: logr_printf(logr_getlogger(), LOGR_INFO, fmt, ...)
- * This routine is implemented as a macro.
+ * This routine is implemented as a macro; the arguments are not evaluated
+ * when the level is disabled.
  * \see logr_printf
  * \see logr_getlogger
  */
-#define logr_info(fmt, args...) logr_info_(LOGR_XARGS, fmt, ## args)
+#define logr_info(fmt, args...) \
+    _LOGR_CALL(LOGR_INFO, fmt, ## args)
 /// @cond
     int logr_info_(LOGR_XARGV, const char *fmt, ...);
 /// @endcond
 
 /**
  * Shorthand for: logr_printf(logr_getlogger(), LOGR_DEBUG, fmt, ...)
- * This routine is implemented as a macro.
+ * This routine is implemented as a macro; the arguments are not evaluated
+ * when the level is disabled.
  * \see logr_printf
  * \see logr_getlogger
  */
-#define logr_debug(fmt, args...) logr_debug_(LOGR_XARGS, fmt, ## args)
+#define logr_debug(fmt, args...) \
+    _LOGR_CALL(LOGR_DEBUG, fmt, ## args)
 /// @cond
     int logr_debug_(LOGR_XARGV, const char *fmt, ...);
 /// @endcond
 
+/**
+ * Shorthand for:
+ *     logr_printf_every_n(logr_getlogger(), LOGR_ERR, n, fmt, ...)
+ * \see logr_printf_every_n
+ */
+#define logr_err_every_n(n, fmt, args...) \
+    logr_printf_every_n(_logr_global, LOGR_ERR, n, fmt, ## args)
+
+/**
+ * Shorthand for:
+ *     logr_printf_every_n(logr_getlogger(), LOGR_WARNING, n, fmt, ...)
+ * \see logr_printf_every_n
+ */
+#define logr_warning_every_n(n, fmt, args...) \
+    logr_printf_every_n(_logr_global, LOGR_WARNING, n, fmt, ## args)
+
+/**
+ * Shorthand for:
+ *     logr_printf_every_n(logr_getlogger(), LOGR_WARNING, n, fmt, ...)
+ * \see logr_printf_every_n
+ */
+#define logr_warn_every_n(n, fmt, args...) \
+    logr_warning_every_n(n, fmt, ## args)
+
+/**
+ * Shorthand for:
+ *     logr_printf_every_n(logr_getlogger(), LOGR_NOTICE, n, fmt, ...)
+ * \see logr_printf_every_n
+ */
+#define logr_notice_every_n(n, fmt, args...) \
+    logr_printf_every_n(_logr_global, LOGR_NOTICE, n, fmt, ## args)
+
+/**
+ * Shorthand for:
+ *     logr_printf_every_n(logr_getlogger(), LOGR_INFO, n, fmt, ...)
+ * \see logr_printf_every_n
+ */
+#define logr_info_every_n(n, fmt, args...) \
+    logr_printf_every_n(_logr_global, LOGR_INFO, n, fmt, ## args)
+
+/**
+ * Shorthand for:
+ *     logr_printf_every_n(logr_getlogger(), LOGR_DEBUG, n, fmt, ...)
+ * \see logr_printf_every_n
+ */
+#define logr_debug_every_n(n, fmt, args...) \
+    logr_printf_every_n(_logr_global, LOGR_DEBUG, n, fmt, ## args)
+
+/**
+ * Shorthand for:
+ *     logr_printf_sampled(logr_getlogger(), LOGR_ERR, p, fmt, ...)
+ * \see logr_printf_sampled
+ */
+#define logr_err_sampled(p, fmt, args...) \
+    logr_printf_sampled(_logr_global, LOGR_ERR, p, fmt, ## args)
+
+/**
+ * Shorthand for:
+ *     logr_printf_sampled(logr_getlogger(), LOGR_WARNING, p, fmt, ...)
+ * \see logr_printf_sampled
+ */
+#define logr_warning_sampled(p, fmt, args...) \
+    logr_printf_sampled(_logr_global, LOGR_WARNING, p, fmt, ## args)
+
+/**
+ * Shorthand for:
+ *     logr_printf_sampled(logr_getlogger(), LOGR_WARNING, p, fmt, ...)
+ * \see logr_printf_sampled
+ */
+#define logr_warn_sampled(p, fmt, args...) \
+    logr_warning_sampled(p, fmt, ## args)
+
+/**
+ * Shorthand for:
+ *     logr_printf_sampled(logr_getlogger(), LOGR_NOTICE, p, fmt, ...)
+ * \see logr_printf_sampled
+ */
+#define logr_notice_sampled(p, fmt, args...) \
+    logr_printf_sampled(_logr_global, LOGR_NOTICE, p, fmt, ## args)
+
+/**
+ * Shorthand for:
+ *     logr_printf_sampled(logr_getlogger(), LOGR_INFO, p, fmt, ...)
+ * \see logr_printf_sampled
+ */
+#define logr_info_sampled(p, fmt, args...) \
+    logr_printf_sampled(_logr_global, LOGR_INFO, p, fmt, ## args)
+
+/**
+ * Shorthand for:
+ *     logr_printf_sampled(logr_getlogger(), LOGR_DEBUG, p, fmt, ...)
+ * \see logr_printf_sampled
+ */
+#define logr_debug_sampled(p, fmt, args...) \
+    logr_printf_sampled(_logr_global, LOGR_DEBUG, p, fmt, ## args)
+
+/**
+ * Shorthand for:
+ *     logr_printf_per_sec(logr_getlogger(), LOGR_ERR, k, fmt, ...)
+ * \see logr_printf_per_sec
+ */
+#define logr_err_per_sec(k, fmt, args...) \
+    logr_printf_per_sec(_logr_global, LOGR_ERR, k, fmt, ## args)
+
+/**
+ * Shorthand for:
+ *     logr_printf_per_sec(logr_getlogger(), LOGR_WARNING, k, fmt, ...)
+ * \see logr_printf_per_sec
+ */
+#define logr_warning_per_sec(k, fmt, args...) \
+    logr_printf_per_sec(_logr_global, LOGR_WARNING, k, fmt, ## args)
+
+/**
+ * Shorthand for:
+ *     logr_printf_per_sec(logr_getlogger(), LOGR_WARNING, k, fmt, ...)
+ * \see logr_printf_per_sec
+ */
+#define logr_warn_per_sec(k, fmt, args...) \
+    logr_warning_per_sec(k, fmt, ## args)
+
+/**
+ * Shorthand for:
+ *     logr_printf_per_sec(logr_getlogger(), LOGR_NOTICE, k, fmt, ...)
+ * \see logr_printf_per_sec
+ */
+#define logr_notice_per_sec(k, fmt, args...) \
+    logr_printf_per_sec(_logr_global, LOGR_NOTICE, k, fmt, ## args)
+
+/**
+ * Shorthand for:
+ *     logr_printf_per_sec(logr_getlogger(), LOGR_INFO, k, fmt, ...)
+ * \see logr_printf_per_sec
+ */
+#define logr_info_per_sec(k, fmt, args...) \
+    logr_printf_per_sec(_logr_global, LOGR_INFO, k, fmt, ## args)
+
+/**
+ * Shorthand for:
+ *     logr_printf_per_sec(logr_getlogger(), LOGR_DEBUG, k, fmt, ...)
+ * \see logr_printf_per_sec
+ */
+#define logr_debug_per_sec(k, fmt, args...) \
+    logr_printf_per_sec(_logr_global, LOGR_DEBUG, k, fmt, ## args)
+
 /**
  * Utility function to invoke the priority callback.
  *
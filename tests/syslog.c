@@ -0,0 +1,227 @@
+/* Copyright (C) 2012 Akiri Solutions, Inc.
+ * For conditions of distribution and use, see copyright notice in logr.h
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <logr.h>
+
+/* Checks the syslog sink against a socket standing in for the daemon. */
+
+#define CHECK(cond) do {                                                \
+    if (!(cond)) {                                                      \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+                #cond);                                                 \
+        exit(1);                                                        \
+    }                                                                   \
+} while (0)
+
+#define DGRAM_MAX 4096
+#define HELD 2000             /* more than the socket queues */
+#define FLOOD 5000            /* more than the 256KB backlog holds */
+
+static int sock = -1;
+
+/* Receive one datagram without waiting, NUL terminated.  -1 if none. */
+static ssize_t
+receive(char *buf)
+{
+    ssize_t n;
+
+    do {
+        n = recv(sock, buf, DGRAM_MAX - 1, MSG_DONTWAIT);
+    } while ((n < 0) && (errno == EINTR));
+    if (n < 0) {
+        CHECK((errno == EAGAIN) || (errno == EWOULDBLOCK));
+        return -1;
+    }
+    buf[n] = '\0';
+    return n;
+}
+
+/* The RFC 5424 datagram buf carries msg at level from this process. */
+static void
+check_rfc5424(const char *buf, int level, const char *msg)
+{
+    char head[16], tail[256];
+    int year, mon, day, hour, min, sec;
+    long usec;
+    char z;
+
+    snprintf(head, sizeof(head), "<%d>1 ", LOG_LOCAL0 | level);
+    CHECK(strncmp(buf, head, strlen(head)) == 0);
+    CHECK(sscanf(buf + strlen(head), "%4d-%2d-%2dT%2d:%2d:%2d.%6ld%c ",
+                 &year, &mon, &day, &hour, &min, &sec, &usec, &z) == 8);
+    CHECK(z == 'Z');
+    snprintf(tail, sizeof(tail), " logr-test %ld - - %s", (long)getpid(),
+             msg);
+    CHECK(strlen(buf) > strlen(tail));
+    CHECK(strcmp(buf + strlen(buf) - strlen(tail), tail) == 0);
+}
+
+static void
+test_rfc5424(logr_t *logr)
+{
+    char buf[DGRAM_MAX];
+
+    CHECK(logr_printf(logr, LOGR_ERR, "hello %s\n", "world") > 0);
+    CHECK(receive(buf) > 0);
+    check_rfc5424(buf, LOGR_ERR, "hello world");
+
+    /* below the sink's level */
+    logr_printf(logr, LOGR_DEBUG, "not sent\n");
+    CHECK(receive(buf) < 0);
+}
+
+static void
+test_journal(logr_t *logr)
+{
+    char buf[DGRAM_MAX], head[128];
+    const char *p;
+    ssize_t n;
+    size_t len;
+    int i;
+
+    CHECK(logr_printf(logr, LOGR_WARNING, "journal entry\n") > 0);
+    CHECK(receive(buf) > 0);
+    snprintf(head, sizeof(head),
+             "PRIORITY=%d\nSYSLOG_FACILITY=%d\nSYSLOG_PID=%ld\n"
+             "SYSLOG_IDENTIFIER=logr-test\nCODE_FILE=", LOGR_WARNING,
+             LOG_LOCAL0 >> 3, (long)getpid());
+    CHECK(strncmp(buf, head, strlen(head)) == 0);
+    CHECK(strstr(buf, "\nCODE_LINE=") != NULL);
+    CHECK(strstr(buf, "\nCODE_FUNC=test_journal\n") != NULL);
+    p = "\nMESSAGE=journal entry\n";
+    CHECK(strcmp(buf + strlen(buf) - strlen(p), p) == 0);
+
+    /* a multi-line message is sent with its length, little endian */
+    CHECK(logr_printf(logr, LOGR_WARNING, "two\nlines\n") > 0);
+    n = receive(buf);
+    CHECK(n > 0);
+    p = strstr(buf, "\nMESSAGE\n");
+    CHECK(p != NULL);
+    p += 9;
+    CHECK(buf + n - p == 8 + 9 + 1);
+    for (i = 7, len = 0; i >= 0; i--) {
+        len = (len << 8) | (unsigned char)p[i];
+    }
+    CHECK(len == 9);
+    CHECK(memcmp(p + 8, "two\nlines\n", 10) == 0);
+}
+
+/*
+ * Let logr_flush() send what the sink held back and receive it, until
+ * nothing more comes.  Entries "n <seq>" must arrive in order; anything
+ * else is passed to other() if given.  Returns the next seq expected.
+ */
+static int
+drain(logr_t *logr, int seq, void (*other)(const char *))
+{
+    char buf[DGRAM_MAX];
+    const char *p;
+    int got;
+
+    do {
+        CHECK(logr_flush(logr) == 0);
+        for (got = 0; receive(buf) > 0; got++) {
+            p = strstr(buf, " - - ");
+            CHECK(p != NULL);
+            if (strncmp(p + 5, "n ", 2) == 0) {
+                CHECK(atoi(p + 7) == seq);
+                seq++;
+            } else {
+                CHECK(other != NULL);
+                other(buf);
+            }
+        }
+    } while (got != 0);
+    return seq;
+}
+
+static unsigned long long reported;
+
+static void
+dropped_note(const char *buf)
+{
+    unsigned long long n;
+
+    check_rfc5424(buf, LOGR_WARNING, strstr(buf, "*** logr: "));
+    CHECK(sscanf(strstr(buf, "*** logr: "), "*** logr: %llu entries",
+                 &n) == 1);
+    reported += n;
+}
+
+static void
+test_backlog(logr_t *logr)
+{
+    struct logr_stats stats;
+    char buf[DGRAM_MAX];
+    int i, seq;
+
+    /* nobody reads: the socket fills up and the rest is held back */
+    for (i = 0; i < HELD; i++) {
+        CHECK(logr_printf(logr, LOGR_ERR, "n %d\n", i) > 0);
+    }
+    for (i = 0; receive(buf) > 0; i++) {
+        CHECK(atoi(strstr(buf, " - - ") + 7) == i);
+    }
+    CHECK(i < HELD);
+    /* sent in batches by sendmmsg() as the socket empties */
+    CHECK(drain(logr, i, NULL) == HELD);
+    CHECK(logr_get_stats(logr, &stats) == 0);
+    CHECK(stats.dropped == 0);
+
+    /* more than the backlog holds: the rest is dropped and reported */
+    for (i = 0; i < FLOOD; i++) {
+        logr_printf(logr, LOGR_ERR, "n %d %0200d\n", HELD + i, 0);
+    }
+    CHECK(logr_get_stats(logr, &stats) == 0);
+    CHECK(stats.dropped != 0);
+    seq = drain(logr, HELD, NULL);
+    CHECK(seq + stats.dropped == HELD + FLOOD);
+
+    /* the count goes ahead of the next entry */
+    CHECK(logr_printf(logr, LOGR_ERR, "n %d\n", seq) > 0);
+    CHECK(drain(logr, seq, dropped_note) == seq + 1);
+    CHECK(reported == stats.dropped);
+}
+
+int
+main(void)
+{
+    char dir[] = "/tmp/logr-test.XXXXXX";
+    struct sockaddr_un addr;
+    logr_t *logr;
+
+    CHECK(mkdtemp(dir) != NULL);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/log", dir);
+    sock = socket(AF_UNIX, SOCK_DGRAM, 0);
+    CHECK(sock >= 0);
+    CHECK(bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+
+    logr = logr_alloc("/dev/null");
+    CHECK(logr != NULL);
+    logr_set_level(logr, LOGR_DEBUG);
+    CHECK(logr_add_syslog(logr, addr.sun_path, "logr-test", LOG_LOCAL0,
+                          LOGR_INFO, 0) == 0);
+    test_rfc5424(logr);
+    test_backlog(logr);
+    CHECK(logr_remove_syslog(logr, addr.sun_path) == 0);
+
+    CHECK(logr_add_syslog(logr, addr.sun_path, "logr-test", LOG_LOCAL0,
+                          LOGR_INFO, LOGR_SYSLOG_JOURNAL) == 0);
+    test_journal(logr);
+    logr_free(logr);
+
+    close(sock);
+    unlink(addr.sun_path);
+    rmdir(dir);
+    return 0;
+}